@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <time.h>
+#include "chunk.h"
+#include "compaction.h"
+#include "consts.h"
+#include "tsdb.h"
+#include "rmutil/alloc.h"
+
+/*
+ * Benchmarks of the engine, without redis. Every result is printed on one line in the format of go
+ * benchmarks, so that the output of two builds can be compared with benchstat:
+ *   Benchmark<Name>/<case>  <ops>  <ns> ns/op  <allocs> allocs/op
+ * allocations are the calls to the RedisModule allocator, chunks recycled by the pool don't count.
+ */
+
+#define BENCH_SAMPLES 1000000
+#define BENCH_ROUNDS 20
+// samples per run handed to appendValues, like a bucket of an uncompressed chunk
+#define BENCH_RUN_SIZE 360
+#define BENCH_SAMPLES_PER_CHUNK 360
+
+static double values[BENCH_SAMPLES];
+static long long allocations;
+
+static void *(*systemAlloc)(size_t bytes);
+static void *(*systemCalloc)(size_t nmemb, size_t size);
+static void *(*systemRealloc)(void *ptr, size_t bytes);
+
+static void *CountingAlloc(size_t bytes) {
+    allocations++;
+    return systemAlloc(bytes);
+}
+
+static void *CountingCalloc(size_t nmemb, size_t size) {
+    allocations++;
+    return systemCalloc(nmemb, size);
+}
+
+static void *CountingRealloc(void *ptr, size_t bytes) {
+    allocations++;
+    return systemRealloc(ptr, bytes);
+}
+
+static double nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef struct BenchTimer {
+    double start;
+    long long allocations;
+} BenchTimer;
+
+static BenchTimer BenchStart() {
+    BenchTimer timer = {.start = nowNs(), .allocations = allocations};
+    return timer;
+}
+
+static void BenchReport(BenchTimer *timer, const char *name, const char *benchCase, long long ops) {
+    double elapsed = nowNs() - timer->start;
+    printf("Benchmark%s/%s\t%lld\t%.3f ns/op\t%.4f allocs/op\n", name, benchCase, ops, elapsed / ops,
+           (double)(allocations - timer->allocations) / ops);
+}
+
+static const char *EncodingName(int encoding) {
+    return encoding == CHUNK_COMPRESSED ? "compressed" : "uncompressed";
+}
+
+static void benchChunkAddSample(int encoding) {
+    BenchTimer timer = BenchStart();
+    for (size_t i = 0; i < BENCH_SAMPLES; i += BENCH_SAMPLES_PER_CHUNK) {
+        Chunk *chunk = NewChunk(BENCH_SAMPLES_PER_CHUNK, encoding);
+        for (size_t j = i; j < i + BENCH_SAMPLES_PER_CHUNK && j < BENCH_SAMPLES; j++) {
+            Sample sample = {.timestamp = j, .data = values[j]};
+            if (!ChunkAddSample(chunk, sample) && ChunkCanGrow(chunk)) {
+                chunk = ChunkGrow(chunk);
+                ChunkAddSample(chunk, sample);
+            }
+        }
+        FreeChunk(chunk);
+    }
+    BenchReport(&timer, "ChunkAddSample", EncodingName(encoding), BENCH_SAMPLES);
+}
+
+typedef struct BenchRules {
+    Series *series;
+    Series *destSeries[3];
+} BenchRules;
+
+// feeds the rules of the source series like the compaction of the module does, without looking up the
+// destinations
+static void feedRules(void *privdata, Sample sample) {
+    BenchRules *rules = (BenchRules *)privdata;
+    int r = 0;
+    for (CompactionRule *rule = rules->series->rules; rule != NULL; rule = rule->nextRule) {
+        SeriesRuleAddSample(rule, rules->destSeries[r++], sample.timestamp, sample.data);
+    }
+}
+
+static void benchSeriesAddSample(int encoding, int rulesCount) {
+    int aggTypes[] = {TS_AGG_AVG, TS_AGG_MAX, TS_AGG_SUM};
+    char benchCase[64];
+    Series *series = NewSeries(0, BENCH_SAMPLES_PER_CHUNK, CHUNK_SIZE_BYTES_DEFAULT, encoding);
+    BenchRules rules = {.series = series};
+    Series **destSeries = rules.destSeries;
+    for (int r = 0; r < rulesCount; r++) {
+        destSeries[r] = NewSeries(0, BENCH_SAMPLES_PER_CHUNK, CHUNK_SIZE_BYTES_DEFAULT, encoding);
+        SeriesRuleSetDest(SeriesAddRule(series, NULL, 0, aggTypes[r], 10 * (r + 1)), destSeries[r]);
+    }
+
+    BenchTimer timer = BenchStart();
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        SeriesInsertSample(series, i, values[i], rulesCount > 0 ? feedRules : NULL, &rules);
+    }
+    snprintf(benchCase, sizeof(benchCase), "%s/rules=%d", EncodingName(encoding), rulesCount);
+    BenchReport(&timer, "SeriesAddSample", benchCase, BENCH_SAMPLES);
+
+    FreeSeries(series);
+    for (int r = 0; r < rulesCount; r++) {
+        FreeSeries(destSeries[r]);
+    }
+}
+
+static void benchSeriesIteratorGetNext(int encoding) {
+    // ranges of the whole series, a window in the middle and a few samples at the end
+    size_t rangeStarts[] = {0, BENCH_SAMPLES / 2, BENCH_SAMPLES - 100};
+    size_t rangeSizes[] = {BENCH_SAMPLES, BENCH_SAMPLES / 100, 100};
+    const char *rangeNames[] = {"all", "1pct", "last100"};
+    char benchCase[64];
+    Series *series = NewSeries(0, BENCH_SAMPLES_PER_CHUNK, CHUNK_SIZE_BYTES_DEFAULT, encoding);
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        SeriesAddSample(series, i, values[i]);
+    }
+
+    for (int r = 0; r < sizeof(rangeSizes) / sizeof(rangeSizes[0]); r++) {
+        api_timestamp_t start = rangeStarts[r];
+        api_timestamp_t end = start + rangeSizes[r] - 1;
+        // small ranges are repeated to get a measurable time
+        size_t rounds = BENCH_SAMPLES / rangeSizes[r];
+        Sample sample;
+        double checksum = 0;
+        long long ops = 0;
+
+        BenchTimer timer = BenchStart();
+        for (size_t round = 0; round < rounds; round++) {
+            SeriesIterator iterator = SeriesQuery(series, start, end);
+            while (SeriesIteratorGetNext(&iterator, &sample) != 0) {
+                checksum += sample.data;
+                ops++;
+            }
+        }
+        snprintf(benchCase, sizeof(benchCase), "%s/range=%s", EncodingName(encoding), rangeNames[r]);
+        BenchReport(&timer, "SeriesIteratorGetNext", benchCase, ops);
+        if (checksum < 0) {
+            printf("unexpected checksum %f\n", checksum);
+        }
+    }
+    FreeSeries(series);
+}
+
+static void benchAppendValue(int aggType) {
+    AggregationClass *aggClass = GetAggClass(aggType);
+    void *context = aggClass->createContext();
+    BenchTimer timer = BenchStart();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+            aggClass->appendValue(context, values[i]);
+        }
+    }
+    BenchReport(&timer, "AggregationAppendValue", AggTypeEnumToString(aggType),
+                (long long)BENCH_SAMPLES * BENCH_ROUNDS);
+    aggClass->finalize(context);
+    aggClass->freeContext(context);
+}
+
+static void benchAppendValues(int aggType) {
+    AggregationClass *aggClass = GetAggClass(aggType);
+    void *context = aggClass->createContext();
+    BenchTimer timer = BenchStart();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BENCH_SAMPLES; i += BENCH_RUN_SIZE) {
+            size_t count = BENCH_SAMPLES - i < BENCH_RUN_SIZE ? BENCH_SAMPLES - i : BENCH_RUN_SIZE;
+            aggClass->appendValues(context, values + i, count);
+        }
+    }
+    BenchReport(&timer, "AggregationAppendValues", AggTypeEnumToString(aggType),
+                (long long)BENCH_SAMPLES * BENCH_ROUNDS);
+    aggClass->finalize(context);
+    aggClass->freeContext(context);
+}
+
+static void benchSeriesReverseIteratorGetNext(int encoding) {
+    // the newest 100 samples of the whole series, what a TS.REVRANGE with LIMIT 100 reads
+    const size_t limit = 100;
+    char benchCase[64];
+    Series *series = NewSeries(0, BENCH_SAMPLES_PER_CHUNK, CHUNK_SIZE_BYTES_DEFAULT, encoding);
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        SeriesAddSample(series, i, values[i]);
+    }
+
+    Sample sample;
+    double checksum = 0;
+    long long ops = 0;
+    BenchTimer timer = BenchStart();
+    for (size_t round = 0; round < BENCH_SAMPLES / limit; round++) {
+        SeriesReverseIterator iterator = SeriesReverseQuery(series, 0, BENCH_SAMPLES);
+        for (size_t i = 0; i < limit && SeriesReverseIteratorGetNext(&iterator, &sample) != 0; i++) {
+            checksum += sample.data;
+            ops++;
+        }
+        FreeSeriesReverseIterator(&iterator);
+    }
+    snprintf(benchCase, sizeof(benchCase), "%s/range=all/limit=%zu", EncodingName(encoding), limit);
+    BenchReport(&timer, "SeriesReverseIteratorGetNext", benchCase, ops);
+    if (checksum < 0) {
+        printf("unexpected checksum %f\n", checksum);
+    }
+    FreeSeries(series);
+}
+
+int main(int argc, char *argv[]) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+
+    RMUTil_InitAlloc();
+    systemAlloc = RedisModule_Alloc;
+    systemCalloc = RedisModule_Calloc;
+    systemRealloc = RedisModule_Realloc;
+    RedisModule_Alloc = CountingAlloc;
+    RedisModule_Calloc = CountingCalloc;
+    RedisModule_Realloc = CountingRealloc;
+
+    for (size_t i = 0; i < BENCH_SAMPLES; i++) {
+        values[i] = (double)((i * 7919) % 10007) / 7;
+    }
+
+    for (int e = 0; e < 2; e++) {
+        benchChunkAddSample(encodings[e]);
+    }
+    for (int e = 0; e < 2; e++) {
+        for (int rulesCount = 0; rulesCount <= 3; rulesCount += 3) {
+            benchSeriesAddSample(encodings[e], rulesCount);
+        }
+    }
+    for (int e = 0; e < 2; e++) {
+        benchSeriesIteratorGetNext(encodings[e]);
+        benchSeriesReverseIteratorGetNext(encodings[e]);
+    }
+    for (int aggType = TS_AGG_NONE + 1; aggType < TS_AGG_TYPES_MAX; aggType++) {
+        benchAppendValue(aggType);
+        benchAppendValues(aggType);
+    }
+    return 0;
+}
@@ -1,21 +1,265 @@
 #include "chunk.h"
+#include <pthread.h>
 #include <string.h>
-#include "rmutil/alloc.h"
+#include "chunk_pool.h"
+#include "compaction.h"
 
-Chunk * NewChunk(size_t sampleCount)
+// size of the first buffer of a chunk, in 64 bit words or in samples. it doubles whenever it fills up
+#define COMPRESSED_CHUNK_INITIAL_WORDS 8
+#define UNCOMPRESSED_CHUNK_INITIAL_SAMPLES 8
+// samples of a compressed chunk decoded at a time when sealing it
+#define CHUNK_SEAL_RUN_SIZE 128
+// what a sample of regular data takes in a compressed chunk, until a chunk of the series tells better
+#define COMPRESSED_BYTES_PER_SAMPLE_ESTIMATE 2.0
+
+// the chunk header up to encoding version 5 of the rdb, when the sample counts were shorts
+typedef struct ChunkHeaderV5 {
+    timestamp_t base_timestamp;
+    void *samples;
+    short num_samples;
+    short max_samples;
+    char encoding;
+    char sealed;
+    ChunkSummary summary;
+    struct Chunk *nextChunk;
+} ChunkHeaderV5;
+
+// the header and the samples are allocated as a single block, samples follow the header.
+// uncompressed samples are stored as columns, all the values and then all the timestamps
+static size_t ChunkSizeFor(size_t sampleCount, int encoding, size_t compressedWords) {
+    if (encoding == CHUNK_COMPRESSED) {
+        return sizeof(Chunk) + GORILLA_DATA_SIZE(compressedWords);
+    }
+    return sizeof(Chunk) + (sizeof(double) + sizeof(timestamp_t)) * sampleCount;
+}
+
+size_t ChunkBlockSize(Chunk *chunk) {
+    size_t compressedWords = 0;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        compressedWords = ((GorillaData *)chunk->samples)->capacity;
+    }
+    return ChunkSizeFor(chunk->allocated_samples, chunk->encoding, compressedWords);
+}
+
+Chunk * NewChunk(size_t sampleCount, int encoding)
 {
-    Chunk *newChunk = (Chunk *)malloc(sizeof(Chunk));
+    // no room for samples yet, many series are created and never written or written rarely
+    Chunk *newChunk = (Chunk *)ChunkPoolAlloc(ChunkSizeFor(0, encoding, 0));
     newChunk->num_samples = 0;
     newChunk->max_samples = sampleCount;
+    newChunk->allocated_samples = 0;
+    newChunk->encoding = encoding;
+    newChunk->sealed = FALSE;
     newChunk->nextChunk = NULL;
-    newChunk->samples = malloc(sizeof(Sample)*sampleCount);
+    newChunk->samples = newChunk + 1;
+    if (encoding == CHUNK_COMPRESSED) {
+        GorillaInit(newChunk->samples, 0);
+    }
 
     return newChunk;
 }
 
+/*
+ * Chunks freed while background readers are running are kept in the list of the current epoch. The
+ * epoch moves on once the readers of the previous one are gone, and the chunks that were freed during
+ * the previous one can be reclaimed, no reader that is still running could have seen them.
+ */
+// taken by FreeSeries on the lazy free thread too, see tsdb.h
+static pthread_mutex_t readersLock = PTHREAD_MUTEX_INITIALIZER;
+static long long chunkReaders[2];
+static Chunk *deferredChunks[2];
+static int chunkReaderEpoch = 0;
+
+static void ChunkFreeBlock(Chunk *chunk) {
+    ChunkPoolFree(chunk, ChunkBlockSize(chunk));
+}
+
+static void ChunkReclaimDeferred() {
+    for (int i = 0; i < 2; i++) {
+        int previousEpoch = 1 - chunkReaderEpoch;
+        if (chunkReaders[previousEpoch] > 0) {
+            return;
+        }
+        while (deferredChunks[previousEpoch] != NULL) {
+            Chunk *chunk = deferredChunks[previousEpoch];
+            deferredChunks[previousEpoch] = chunk->nextChunk;
+            ChunkFreeBlock(chunk);
+        }
+        chunkReaderEpoch = previousEpoch;
+    }
+}
+
+int ChunkReadersEnter() {
+    pthread_mutex_lock(&readersLock);
+    int readerEpoch = chunkReaderEpoch;
+    chunkReaders[readerEpoch]++;
+    pthread_mutex_unlock(&readersLock);
+    return readerEpoch;
+}
+
+void ChunkReadersLeave(int readerEpoch) {
+    pthread_mutex_lock(&readersLock);
+    chunkReaders[readerEpoch]--;
+    ChunkReclaimDeferred();
+    pthread_mutex_unlock(&readersLock);
+}
+
 void FreeChunk(Chunk *chunk) {
-    free(chunk->samples);
-    free(chunk);
+    pthread_mutex_lock(&readersLock);
+    if (chunkReaders[0] > 0 || chunkReaders[1] > 0) {
+        chunk->nextChunk = deferredChunks[chunkReaderEpoch];
+        deferredChunks[chunkReaderEpoch] = chunk;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&readersLock);
+    if (chunk != NULL) {
+        ChunkFreeBlock(chunk);
+    }
+}
+
+Chunk *ChunkClone(Chunk *chunk) {
+    size_t size = ChunkBlockSize(chunk);
+    Chunk *newChunk = (Chunk *)ChunkPoolAlloc(size);
+    memcpy(newChunk, chunk, size);
+    newChunk->samples = newChunk + 1;
+    newChunk->nextChunk = NULL;
+    return newChunk;
+}
+
+// converts a legacy block to the current header, the samples that follow it are the same
+static Chunk *ChunkFromLegacyBuffer(const char *buffer, size_t *len) {
+    ChunkHeaderV5 header;
+    if (*len < sizeof(ChunkHeaderV5)) {
+        return NULL;
+    }
+    memcpy(&header, buffer, sizeof(ChunkHeaderV5));
+    if (header.num_samples < 0 || header.max_samples < 0) {
+        return NULL;
+    }
+    size_t samplesLen = *len - sizeof(ChunkHeaderV5);
+    *len = sizeof(Chunk) + samplesLen;
+    Chunk *chunk = (Chunk *)ChunkPoolAlloc(*len);
+    chunk->base_timestamp = header.base_timestamp;
+    chunk->num_samples = header.num_samples;
+    chunk->max_samples = header.max_samples;
+    // the legacy header has no such field, ChunkHeaderIsValid derives it for uncompressed blocks
+    chunk->allocated_samples = 0;
+    chunk->encoding = header.encoding;
+    chunk->sealed = header.sealed;
+    chunk->summary = header.summary;
+    memcpy(chunk + 1, buffer + sizeof(ChunkHeaderV5), samplesLen);
+    return chunk;
+}
+
+// checks the header of a block read from the rdb against its length, so that a corrupted block
+// can't make the chunk read or write outside of it. also fixes the pointers of the saved header
+static int ChunkHeaderIsValid(Chunk *chunk, size_t len) {
+    if (chunk->encoding != CHUNK_COMPRESSED && chunk->encoding != CHUNK_UNCOMPRESSED) {
+        return FALSE;
+    }
+    // the pointers of the saved block are meaningless
+    chunk->samples = chunk + 1;
+    chunk->nextChunk = NULL;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        if (len < sizeof(Chunk) + sizeof(GorillaData)) {
+            return FALSE;
+        }
+        GorillaData *data = chunk->samples;
+        if (data->capacity > (len - sizeof(Chunk) - sizeof(GorillaData)) / sizeof(u_int64_t) ||
+            data->state.bitCount > data->capacity * 64 || data->undoState.bitCount > data->capacity * 64) {
+            return FALSE;
+        }
+        // the gorilla capacity sizes a compressed buffer, the field isn't used
+        chunk->allocated_samples = 0;
+    } else {
+        // the saved field may be padding, see Chunk. the buffer of older blocks always had room for max_samples
+        chunk->allocated_samples = (len - sizeof(Chunk)) / (sizeof(double) + sizeof(timestamp_t));
+    }
+    return ChunkBlockSize(chunk) == len && chunk->num_samples <= chunk->max_samples &&
+           (chunk->encoding == CHUNK_COMPRESSED ||
+            (chunk->allocated_samples <= chunk->max_samples && chunk->num_samples <= chunk->allocated_samples));
+}
+
+Chunk *ChunkFromBuffer(const char *buffer, size_t len, int legacyHeader) {
+    Chunk *chunk;
+    if (legacyHeader) {
+        chunk = ChunkFromLegacyBuffer(buffer, &len);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    } else {
+        if (len < sizeof(Chunk)) {
+            return NULL;
+        }
+        chunk = (Chunk *)ChunkPoolAlloc(len);
+        memcpy(chunk, buffer, len);
+    }
+    if (!ChunkHeaderIsValid(chunk, len)) {
+        ChunkPoolFree(chunk, len);
+        return NULL;
+    }
+    return chunk;
+}
+
+int ChunkCanGrow(Chunk *chunk) {
+    return !IsChunkFull(chunk);
+}
+
+Chunk *ChunkGrow(Chunk *chunk) {
+    Chunk *newChunk;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        GorillaData *data = chunk->samples;
+        size_t newCapacity = data->capacity > 0 ? data->capacity * 2 : COMPRESSED_CHUNK_INITIAL_WORDS;
+        newChunk = (Chunk *)ChunkPoolAlloc(ChunkSizeFor(0, chunk->encoding, newCapacity));
+        memcpy(newChunk, chunk, sizeof(Chunk));
+        newChunk->samples = newChunk + 1;
+        GorillaCopy(newChunk->samples, data, newCapacity);
+    } else {
+        size_t newAllocated = chunk->allocated_samples > 0 ? chunk->allocated_samples * 2
+                                                           : UNCOMPRESSED_CHUNK_INITIAL_SAMPLES;
+        if (newAllocated > chunk->max_samples) {
+            newAllocated = chunk->max_samples;
+        }
+        newChunk = (Chunk *)ChunkPoolAlloc(ChunkSizeFor(newAllocated, chunk->encoding, 0));
+        memcpy(newChunk, chunk, sizeof(Chunk));
+        newChunk->samples = newChunk + 1;
+        newChunk->allocated_samples = newAllocated;
+        // the timestamps column moves to the end of the bigger buffer
+        memcpy(ChunkGetValues(newChunk), ChunkGetValues(chunk), sizeof(double) * chunk->num_samples);
+        memcpy(ChunkGetTimestamps(newChunk), ChunkGetTimestamps(chunk), sizeof(timestamp_t) * chunk->num_samples);
+    }
+    FreeChunk(chunk);
+    return newChunk;
+}
+
+void ChunkSeal(Chunk *chunk) {
+    ChunkSummary *summary = &chunk->summary;
+    ChunkIterator iter = NewChunkIterator(chunk);
+    timestamp_t timestampsBuffer[CHUNK_SEAL_RUN_SIZE];
+    double valuesBuffer[CHUNK_SEAL_RUN_SIZE];
+    SampleRun run;
+
+    memset(summary, 0, sizeof(ChunkSummary));
+    while (ChunkIteratorGetNextRun(&iter, &run, timestampsBuffer, valuesBuffer, CHUNK_SEAL_RUN_SIZE)) {
+        double min = AggMinValues(run.values, run.count);
+        double max = AggMaxValues(run.values, run.count);
+        if (summary->count == 0) {
+            summary->first = run.values[0];
+            summary->min = min;
+            summary->max = max;
+        } else {
+            if (min < summary->min) summary->min = min;
+            if (max > summary->max) summary->max = max;
+        }
+        summary->sum += AggSumValues(run.values, run.count);
+        summary->last = run.values[run.count - 1];
+        summary->count += run.count;
+    }
+    chunk->sealed = TRUE;
+}
+
+int ChunkIsSealed(Chunk *chunk) {
+    return chunk->sealed;
 }
 
 int IsChunkFull(Chunk *chunk) {
@@ -26,25 +270,42 @@ int ChunkNumOfSample(Chunk *chunk) {
     return chunk->num_samples;
 }
 
-Sample *ChunkGetSampleArray(Chunk *chunk) {
-    return (Sample *)chunk->samples;
+double ChunkEstimatedBytesPerSample(int encoding) {
+    if (encoding == CHUNK_COMPRESSED) {
+        return COMPRESSED_BYTES_PER_SAMPLE_ESTIMATE;
+    }
+    return sizeof(double) + sizeof(timestamp_t);
 }
 
-Sample *ChunkGetSample(Chunk *chunk, int index) {
-    return &ChunkGetSampleArray(chunk)[index];
+double ChunkBytesPerSample(Chunk *chunk) {
+    if (chunk->encoding != CHUNK_COMPRESSED || chunk->num_samples == 0) {
+        return ChunkEstimatedBytesPerSample(chunk->encoding);
+    }
+    return ((GorillaData *)chunk->samples)->state.bitCount / 8.0 / chunk->num_samples;
+}
+
+double *ChunkGetValues(Chunk *chunk) {
+    return (double *)chunk->samples;
+}
+
+timestamp_t *ChunkGetTimestamps(Chunk *chunk) {
+    return (timestamp_t *)(ChunkGetValues(chunk) + chunk->allocated_samples);
 }
 
 timestamp_t ChunkGetLastTimestamp(Chunk *chunk) {
     if (chunk->num_samples == 0) {
         return -1;
     }
-    return ChunkGetSample(chunk, chunk->num_samples - 1)->timestamp;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        return ((GorillaData *)chunk->samples)->state.prevTimestamp;
+    }
+    return ChunkGetTimestamps(chunk)[chunk->num_samples - 1];
 }
 timestamp_t ChunkGetFirstTimestamp(Chunk *chunk) {
     if (chunk->num_samples == 0) {
         return -1;
     }
-    return ChunkGetSample(chunk, 0)->timestamp;
+    return chunk->base_timestamp;
 }
 
 int ChunkAddSample(Chunk *chunk, Sample sample) {
@@ -57,23 +318,125 @@ int ChunkAddSample(Chunk *chunk, Sample sample) {
         chunk->base_timestamp = sample.timestamp;
     }
 
-    ChunkGetSampleArray(chunk)[chunk->num_samples] = sample;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        if (!GorillaAppend(chunk->samples, chunk->num_samples == 0, sample.timestamp, sample.data)) {
+            // out of buffer space, the caller should grow the chunk
+            return 0;
+        }
+    } else {
+        if (chunk->num_samples == chunk->allocated_samples) {
+            // out of buffer space, the caller should grow the chunk
+            return 0;
+        }
+        ChunkGetTimestamps(chunk)[chunk->num_samples] = sample.timestamp;
+        ChunkGetValues(chunk)[chunk->num_samples] = sample.data;
+    }
     chunk->num_samples++;
 
     return 1;
 }
 
+void ChunkRemoveLastSample(Chunk *chunk) {
+    if (chunk->num_samples == 0) {
+        return;
+    }
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        GorillaRemoveLast(chunk->samples);
+    }
+    chunk->num_samples--;
+}
+
 ChunkIterator NewChunkIterator(Chunk* chunk) {
-    return (ChunkIterator){.chunk = chunk, .currentIndex = 0};
+    ChunkIterator iter = {.chunk = chunk, .currentIndex = 0, .endIndex = chunk->num_samples,
+                          .maxTimestamp = ChunkGetLastTimestamp(chunk)};
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        GorillaReaderInit(&iter.gorillaReader);
+    }
+    return iter;
+}
+
+// index of the first sample in [low, high) whose timestamp is bigger than timestamp,
+// or bigger or equal when inclusive is set
+static int ChunkBinarySearch(Chunk *chunk, int low, int high, timestamp_t timestamp, int inclusive) {
+    timestamp_t *timestamps = ChunkGetTimestamps(chunk);
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (timestamps[mid] < timestamp || (!inclusive && timestamps[mid] == timestamp)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void ChunkIteratorSeek(ChunkIterator *iter, timestamp_t minTimestamp, timestamp_t maxTimestamp) {
+    Chunk *chunk = iter->chunk;
+    if (chunk->encoding == CHUNK_COMPRESSED) {
+        // compressed samples can only be decoded in order, skip until the first one in range
+        Sample sample;
+        while (iter->currentIndex < iter->endIndex) {
+            GorillaState before = iter->gorillaReader;
+            ChunkIteratorGetNext(iter, &sample);
+            if (sample.timestamp >= minTimestamp) {
+                iter->gorillaReader = before;
+                iter->currentIndex--;
+                break;
+            }
+        }
+        iter->maxTimestamp = maxTimestamp;
+        return;
+    }
+    if (ChunkGetFirstTimestamp(chunk) < minTimestamp) {
+        iter->currentIndex = ChunkBinarySearch(chunk, iter->currentIndex, iter->endIndex, minTimestamp, TRUE);
+    }
+    if (ChunkGetLastTimestamp(chunk) > maxTimestamp) {
+        iter->endIndex = ChunkBinarySearch(chunk, iter->currentIndex, iter->endIndex, maxTimestamp, FALSE);
+    }
 }
 
 int ChunkIteratorGetNext(ChunkIterator *iter, Sample* sample) {
-    if (iter->currentIndex < iter->chunk->num_samples) {
+    if (iter->currentIndex < iter->endIndex) {
         iter->currentIndex++;
-        Sample *internalSample = ChunkGetSample(iter->chunk, iter->currentIndex-1);
-        memcpy(sample, internalSample, sizeof(Sample));
+        if (iter->chunk->encoding == CHUNK_COMPRESSED) {
+            GorillaRead(iter->chunk->samples, &iter->gorillaReader, iter->currentIndex == 1,
+                        &sample->timestamp, &sample->data);
+            if (sample->timestamp > iter->maxTimestamp) {
+                // reached the end of the range
+                iter->endIndex = iter->currentIndex;
+                return 0;
+            }
+            return 1;
+        }
+        sample->timestamp = ChunkGetTimestamps(iter->chunk)[iter->currentIndex - 1];
+        sample->data = ChunkGetValues(iter->chunk)[iter->currentIndex - 1];
         return 1;
     } else {
         return 0;
     }
-}
\ No newline at end of file
+}
+
+int ChunkIteratorGetNextRun(ChunkIterator *iter, SampleRun *run, timestamp_t *timestampsBuffer,
+                            double *valuesBuffer, size_t bufferSize) {
+    if (iter->chunk->encoding == CHUNK_COMPRESSED) {
+        Sample sample;
+        run->timestamps = timestampsBuffer;
+        run->values = valuesBuffer;
+        run->count = 0;
+        while (run->count < bufferSize && ChunkIteratorGetNext(iter, &sample)) {
+            timestampsBuffer[run->count] = sample.timestamp;
+            valuesBuffer[run->count] = sample.data;
+            run->count++;
+        }
+        return run->count > 0;
+    }
+
+    if (iter->currentIndex >= iter->endIndex) {
+        return 0;
+    }
+    run->timestamps = ChunkGetTimestamps(iter->chunk) + iter->currentIndex;
+    run->values = ChunkGetValues(iter->chunk) + iter->currentIndex;
+    run->count = iter->endIndex - iter->currentIndex;
+    iter->currentIndex = iter->endIndex;
+    return 1;
+}
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "consts.h"
+#include "gorilla.h"
 #include <sys/types.h>
 
 typedef struct Sample {
@@ -10,12 +11,37 @@ typedef struct Sample {
     double data;
 } Sample;
 
+// consecutive samples of a chunk stored as columns
+typedef struct SampleRun {
+    timestamp_t *timestamps;
+    double *values;
+    size_t count;
+} SampleRun;
+
+// aggregates of all the samples of a sealed chunk
+typedef struct ChunkSummary {
+    double min;
+    double max;
+    double sum;
+    double first;
+    double last;
+    size_t count;
+} ChunkSummary;
+
 typedef struct Chunk
 {
     timestamp_t base_timestamp;
     void * samples;
-    short num_samples;
-    short max_samples;
+    u_int32_t num_samples;
+    u_int32_t max_samples;
+    char encoding;
+    // set once the series moved on to a new chunk, the samples can't change anymore
+    char sealed;
+    // the samples an uncompressed buffer has room for, it grows up to max_samples as samples come.
+    // it sits in what was padding in the first blocks of encoding version 6, so it is never read from a
+    // saved block: the loader derives it from the length of the block
+    u_int32_t allocated_samples;
+    ChunkSummary summary;
     struct Chunk *nextChunk;
     // struct Chunk *prevChunk;
 } Chunk;
@@ -24,20 +50,57 @@ typedef struct ChunkIterator
 {
     Chunk *chunk;
     int currentIndex;
-    timestamp_t lastTimestamp;
-    int lastValue;
+    int endIndex;
+    timestamp_t maxTimestamp;
+    GorillaState gorillaReader;
 } ChunkIterator;
 
-Chunk * NewChunk(size_t sampleCount);
+Chunk * NewChunk(size_t sampleCount, int encoding);
+// frees the chunk, or defers it until the background readers that might still hold it are done
 void FreeChunk(Chunk *chunk);
+// a background reader may read sealed chunks without the redis lock between ChunkReadersEnter and
+// ChunkReadersLeave, the chunks freed meanwhile are kept until it leaves
+int ChunkReadersEnter();
+void ChunkReadersLeave(int readerEpoch);
+// copies the chunk into a new block
+Chunk *ChunkClone(Chunk *chunk);
+// size of the memory block that holds the chunk header and its samples
+size_t ChunkBlockSize(Chunk *chunk);
+// rebuilds a chunk from a copy of its memory block, NULL when the buffer isn't a valid block.
+// legacyHeader is set for the blocks saved before the sample counts of the header were widened
+Chunk *ChunkFromBuffer(const char *buffer, size_t len, int legacyHeader);
+// whether a chunk that can't take more samples can get a bigger buffer instead of being sealed.
+// new chunks are only a header, their buffer grows geometrically as samples are added
+int ChunkCanGrow(Chunk *chunk);
+// moves the chunk to a bigger block and frees the old one, the caller has to relink the chunk
+Chunk *ChunkGrow(Chunk *chunk);
+
+// computes the summary of the chunk, no samples can be added or removed after that
+void ChunkSeal(Chunk *chunk);
+int ChunkIsSealed(Chunk *chunk);
+
+// columns of an uncompressed chunk
+double *ChunkGetValues(Chunk *chunk);
+timestamp_t *ChunkGetTimestamps(Chunk *chunk);
 
 // 0 for failure, 1 for success
 int ChunkAddSample(Chunk *chunk, Sample sample);
+// drops the last sample that was added to the chunk
+void ChunkRemoveLastSample(Chunk *chunk);
 int IsChunkFull(Chunk *chunk);
 int ChunkNumOfSample(Chunk *chunk);
+// average size of a sample in the chunk buffer, the estimate of the encoding when the chunk is empty
+double ChunkBytesPerSample(Chunk *chunk);
+double ChunkEstimatedBytesPerSample(int encoding);
 timestamp_t ChunkGetLastTimestamp(Chunk *chunk);
 timestamp_t ChunkGetFirstTimestamp(Chunk *chunk);
 
 ChunkIterator NewChunkIterator(Chunk *chunk);
+// moves the iterator to the first sample newer or equal to minTimestamp and stops it after maxTimestamp
+void ChunkIteratorSeek(ChunkIterator *iter, timestamp_t minTimestamp, timestamp_t maxTimestamp);
 int ChunkIteratorGetNext(ChunkIterator *iter, Sample* sample);
+// returns all the remaining samples of an uncompressed chunk, or decodes up to bufferSize samples
+// of a compressed chunk into the buffers. 0 when there are no more samples
+int ChunkIteratorGetNextRun(ChunkIterator *iter, SampleRun *run, timestamp_t *timestampsBuffer,
+                            double *valuesBuffer, size_t bufferSize);
 #endif
\ No newline at end of file
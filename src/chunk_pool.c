@@ -0,0 +1,89 @@
+#include <pthread.h>
+#include "consts.h"
+#include "chunk_pool.h"
+#include "rmutil/alloc.h"
+
+static ChunkPoolClass classes[CHUNK_POOL_MAX_CLASSES];
+static long long hits = 0;
+static long long misses = 0;
+// chunks are returned from any thread FreeSeries runs on, see tsdb.h
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// the class of the smallest blocks that fit size, NULL when they are too big to pool
+static ChunkPoolClass *findClass(size_t size) {
+    if (size > CHUNK_POOL_MAX_BLOCK) {
+        return NULL;
+    }
+    size_t index = 0, blockSize = CHUNK_POOL_MIN_BLOCK;
+    if (size > CHUNK_POOL_MIN_BLOCK) {
+        // size - 1 is in [2^power, 2^(power + 1)), which is split in CHUNK_POOL_CLASSES_PER_DOUBLING steps
+        int power = 63 - __builtin_clzll(size - 1);
+        size_t step = ((size_t)1 << power) / CHUNK_POOL_CLASSES_PER_DOUBLING;
+        size_t stepIndex = ((size - 1) - ((size_t)1 << power)) / step;
+        index = 1 + (power - __builtin_ctzll(CHUNK_POOL_MIN_BLOCK)) * CHUNK_POOL_CLASSES_PER_DOUBLING + stepIndex;
+        blockSize = ((size_t)1 << power) + (stepIndex + 1) * step;
+    }
+    classes[index].blockSize = blockSize;
+    return &classes[index];
+}
+
+void *ChunkPoolAlloc(size_t size) {
+    void *block = NULL;
+    pthread_mutex_lock(&poolLock);
+    ChunkPoolClass *poolClass = findClass(size);
+    if (poolClass != NULL) {
+        size = poolClass->blockSize;
+        poolClass->usedBlocks++;
+        if (poolClass->freeList != NULL) {
+            block = poolClass->freeList;
+            poolClass->freeList = *(void **)block;
+            poolClass->freeBlocks--;
+            hits++;
+        } else {
+            misses++;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (block == NULL) {
+        block = malloc(size);
+    }
+    return block;
+}
+
+void ChunkPoolFree(void *block, size_t size) {
+    pthread_mutex_lock(&poolLock);
+    ChunkPoolClass *poolClass = findClass(size);
+    if (poolClass != NULL) {
+        poolClass->usedBlocks--;
+        if ((poolClass->freeBlocks + 1) * poolClass->blockSize <= CHUNK_POOL_MAX_FREE_BYTES) {
+            *(void **)block = poolClass->freeList;
+            poolClass->freeList = block;
+            poolClass->freeBlocks++;
+            block = NULL;
+        }
+    }
+    pthread_mutex_unlock(&poolLock);
+
+    if (block != NULL) {
+        free(block);
+    }
+}
+
+void ChunkPoolGetStats(ChunkPoolStats *stats) {
+    pthread_mutex_lock(&poolLock);
+    stats->classesCount = 0;
+    stats->usedBytes = 0;
+    stats->freeBytes = 0;
+    for (size_t i = 0; i < CHUNK_POOL_MAX_CLASSES; i++) {
+        if (classes[i].usedBlocks == 0 && classes[i].freeBlocks == 0) {
+            continue;
+        }
+        stats->classes[stats->classesCount++] = classes[i];
+        stats->usedBytes += classes[i].usedBlocks * classes[i].blockSize;
+        stats->freeBytes += classes[i].freeBlocks * classes[i].blockSize;
+    }
+    stats->hits = hits;
+    stats->misses = misses;
+    pthread_mutex_unlock(&poolLock);
+}
@@ -0,0 +1,46 @@
+#ifndef CHUNK_POOL_H
+#define CHUNK_POOL_H
+
+#include <sys/types.h>
+
+/*
+ * Pool of memory blocks for chunks, each chunk is a single block that holds its header and samples.
+ * Freed blocks are kept per size class and handed out again to new chunks of the same class,
+ * so trimming and creating chunks doesn't churn the allocator.
+ *
+ * The chunk sizes vary with the ingest rate of each series, so they are rounded up to fixed classes:
+ * CHUNK_POOL_CLASSES_PER_DOUBLING evenly spaced sizes between two powers of two, from CHUNK_POOL_MIN_BLOCK
+ * to CHUNK_POOL_MAX_BLOCK. A block wastes at most a fifth of its size, and bigger blocks aren't pooled.
+ */
+
+#define CHUNK_POOL_MIN_BLOCK 64
+#define CHUNK_POOL_MAX_BLOCK (1024 * 1024)
+#define CHUNK_POOL_CLASSES_PER_DOUBLING 4
+// 64 bytes, then 4 classes for each doubling up to 1MB
+#define CHUNK_POOL_MAX_CLASSES (1 + 14 * CHUNK_POOL_CLASSES_PER_DOUBLING)
+// free blocks kept per size class, anything above that goes back to the allocator
+#define CHUNK_POOL_MAX_FREE_BYTES (4 * 1024 * 1024)
+
+typedef struct ChunkPoolClass {
+    size_t blockSize;
+    size_t usedBlocks;
+    size_t freeBlocks;
+    void *freeList;
+} ChunkPoolClass;
+
+typedef struct ChunkPoolStats {
+    // the classes that hold blocks, by block size
+    size_t classesCount;
+    ChunkPoolClass classes[CHUNK_POOL_MAX_CLASSES];
+    size_t usedBytes;
+    size_t freeBytes;
+    long long hits;
+    long long misses;
+} ChunkPoolStats;
+
+// the block may be bigger than size, it is freed with the same size
+void *ChunkPoolAlloc(size_t size);
+void ChunkPoolFree(void *block, size_t size);
+void ChunkPoolGetStats(ChunkPoolStats *stats);
+
+#endif
@@ -1,7 +1,191 @@
 #include <ctype.h>
+#include <pthread.h>
 #include <string.h>
 #include "compaction.h"
 #include "rmutil/alloc.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Kernels that fold a run of values, used by the appendValues of the aggregations.
+ * On x86-64 SSE2 is always there and AVX2 is used when the CPU supports it.
+ * The sums are computed on several accumulators, so their rounding may differ in the last bits
+ * from adding the values one by one.
+ */
+static double SumValuesScalar(const double *values, size_t count) {
+    double sum[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum[0] += values[i];
+        sum[1] += values[i + 1];
+        sum[2] += values[i + 2];
+        sum[3] += values[i + 3];
+    }
+    for (; i < count; i++) {
+        sum[0] += values[i];
+    }
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+}
+
+static double MaxValuesScalar(const double *values, size_t count) {
+    double max = values[0];
+    for (size_t i = 1; i < count; i++) {
+        if (values[i] > max) max = values[i];
+    }
+    return max;
+}
+
+static double MinValuesScalar(const double *values, size_t count) {
+    double min = values[0];
+    for (size_t i = 1; i < count; i++) {
+        if (values[i] < min) min = values[i];
+    }
+    return min;
+}
+
+#if defined(__x86_64__)
+static double SumValuesSSE2(const double *values, size_t count) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_add_pd(sum0, sum1));
+    return (lanes[0] + lanes[1]) + SumValuesScalar(values + i, count - i);
+}
+
+static double MaxValuesSSE2(const double *values, size_t count) {
+    if (count < 4) return MaxValuesScalar(values, count);
+    __m128d max0 = _mm_loadu_pd(values), max1 = _mm_loadu_pd(values + 2);
+    size_t i = 4;
+    for (; i + 4 <= count; i += 4) {
+        max0 = _mm_max_pd(max0, _mm_loadu_pd(values + i));
+        max1 = _mm_max_pd(max1, _mm_loadu_pd(values + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_max_pd(max0, max1));
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < count; i++) {
+        if (values[i] > max) max = values[i];
+    }
+    return max;
+}
+
+static double MinValuesSSE2(const double *values, size_t count) {
+    if (count < 4) return MinValuesScalar(values, count);
+    __m128d min0 = _mm_loadu_pd(values), min1 = _mm_loadu_pd(values + 2);
+    size_t i = 4;
+    for (; i + 4 <= count; i += 4) {
+        min0 = _mm_min_pd(min0, _mm_loadu_pd(values + i));
+        min1 = _mm_min_pd(min1, _mm_loadu_pd(values + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(min0, min1));
+    double min = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    for (; i < count; i++) {
+        if (values[i] < min) min = values[i];
+    }
+    return min;
+}
+
+__attribute__((target("avx2")))
+static double SumValuesAVX2(const double *values, size_t count) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(sum0, sum1));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static double MaxValuesAVX2(const double *values, size_t count) {
+    if (count < 8) return MaxValuesSSE2(values, count);
+    __m256d max0 = _mm256_loadu_pd(values), max1 = _mm256_loadu_pd(values + 4);
+    size_t i = 8;
+    for (; i + 8 <= count; i += 8) {
+        max0 = _mm256_max_pd(max0, _mm256_loadu_pd(values + i));
+        max1 = _mm256_max_pd(max1, _mm256_loadu_pd(values + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_max_pd(max0, max1));
+    double max = MaxValuesScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] > max) max = values[i];
+    }
+    return max;
+}
+
+__attribute__((target("avx2")))
+static double MinValuesAVX2(const double *values, size_t count) {
+    if (count < 8) return MinValuesSSE2(values, count);
+    __m256d min0 = _mm256_loadu_pd(values), min1 = _mm256_loadu_pd(values + 4);
+    size_t i = 8;
+    for (; i + 8 <= count; i += 8) {
+        min0 = _mm256_min_pd(min0, _mm256_loadu_pd(values + i));
+        min1 = _mm256_min_pd(min1, _mm256_loadu_pd(values + i + 4));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_min_pd(min0, min1));
+    double min = MinValuesScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] < min) min = values[i];
+    }
+    return min;
+}
+#endif
+
+typedef double (*ValuesKernel)(const double *values, size_t count);
+
+static ValuesKernel sumKernel = NULL;
+static ValuesKernel maxKernel = NULL;
+static ValuesKernel minKernel = NULL;
+// the kernels are picked on the first use, which can happen on several range workers at once
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+
+static void InitKernels() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sumKernel = SumValuesAVX2;
+        maxKernel = MaxValuesAVX2;
+        minKernel = MinValuesAVX2;
+    } else {
+        sumKernel = SumValuesSSE2;
+        maxKernel = MaxValuesSSE2;
+        minKernel = MinValuesSSE2;
+    }
+#else
+    sumKernel = SumValuesScalar;
+    maxKernel = MaxValuesScalar;
+    minKernel = MinValuesScalar;
+#endif
+}
+
+double AggSumValues(const double *values, size_t count) {
+    pthread_once(&kernelsOnce, InitKernels);
+    return sumKernel(values, count);
+}
+
+double AggMaxValues(const double *values, size_t count) {
+    pthread_once(&kernelsOnce, InitKernels);
+    return maxKernel(values, count);
+}
+
+double AggMinValues(const double *values, size_t count) {
+    pthread_once(&kernelsOnce, InitKernels);
+    return minKernel(values, count);
+}
 
 typedef struct MaxMinContext {
     double value;
@@ -26,6 +210,18 @@ void AvgAddValue(void *contextPtr, double value){
     context->cnt++;
 }
 
+void AvgAddValues(void *contextPtr, const double *values, size_t count) {
+    AvgContext *context = (AvgContext *)contextPtr;
+    context->val += AggSumValues(values, count);
+    context->cnt += count;
+}
+
+void AvgAddSummary(void *contextPtr, const ChunkSummary *summary) {
+    AvgContext *context = (AvgContext *)contextPtr;
+    context->val += summary->sum;
+    context->cnt += summary->count;
+}
+
 double AvgFinalize(void *contextPtr) {
     AvgContext *context = (AvgContext *)contextPtr;
     return context->val / context->cnt;
@@ -56,10 +252,13 @@ void rm_free(void* ptr) {
 static AggregationClass aggAvg = {
     .createContext = AvgCreateContext,
     .appendValue = AvgAddValue,
+    .appendValues = AvgAddValues,
+    .appendSummary = AvgAddSummary,
     .freeContext = rm_free,
     .finalize = AvgFinalize,
     .writeContext = AvgWriteContext,
     .readContext = AvgReadContext,
+    .contextSize = sizeof(AvgContext),
     .resetContext = AvgReset
 };
 
@@ -136,63 +335,133 @@ void LastAppendValue(void *contextPtr, double value) {
     context->value = value;
 }
 
+void MaxAppendValues(void *contextPtr, const double *values, size_t count) {
+    MaxAppendValue(contextPtr, AggMaxValues(values, count));
+}
+
+void MinAppendValues(void *contextPtr, const double *values, size_t count) {
+    MinAppendValue(contextPtr, AggMinValues(values, count));
+}
+
+void SumAppendValues(void *contextPtr, const double *values, size_t count) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    context->value += AggSumValues(values, count);
+}
+
+void CountAppendValues(void *contextPtr, const double *values, size_t count) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    context->value += count;
+}
+
+void FirstAppendValues(void *contextPtr, const double *values, size_t count) {
+    FirstAppendValue(contextPtr, values[0]);
+}
+
+void LastAppendValues(void *contextPtr, const double *values, size_t count) {
+    LastAppendValue(contextPtr, values[count - 1]);
+}
+
+void MaxAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    MaxAppendValue(contextPtr, summary->max);
+}
+
+void MinAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    MinAppendValue(contextPtr, summary->min);
+}
+
+void SumAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    context->value += summary->sum;
+}
+
+void CountAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    MaxMinContext *context = (MaxMinContext *)contextPtr;
+    context->value += summary->count;
+}
+
+void FirstAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    FirstAppendValue(contextPtr, summary->first);
+}
+
+void LastAppendSummary(void *contextPtr, const ChunkSummary *summary) {
+    LastAppendValue(contextPtr, summary->last);
+}
+
 static AggregationClass aggMax = {
     .createContext = MaxMinCreateContext,
     .appendValue = MaxAppendValue,
+    .appendValues = MaxAppendValues,
+    .appendSummary = MaxAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext = MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
 static AggregationClass aggMin = {
     .createContext = MaxMinCreateContext,
     .appendValue = MinAppendValue,
+    .appendValues = MinAppendValues,
+    .appendSummary = MinAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext = MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
 static AggregationClass aggSum = {
     .createContext = MaxMinCreateContext,
     .appendValue = SumAppendValue,
+    .appendValues = SumAppendValues,
+    .appendSummary = SumAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext =  MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
 static AggregationClass aggCount = {
     .createContext = MaxMinCreateContext,
     .appendValue = CountAppendValue,
+    .appendValues = CountAppendValues,
+    .appendSummary = CountAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext = MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
 static AggregationClass aggFirst = {
     .createContext = MaxMinCreateContext,
     .appendValue = FirstAppendValue,
+    .appendValues = FirstAppendValues,
+    .appendSummary = FirstAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext = MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
 static AggregationClass aggLast = {
     .createContext = MaxMinCreateContext,
     .appendValue = LastAppendValue,
+    .appendValues = LastAppendValues,
+    .appendSummary = LastAppendSummary,
     .freeContext = rm_free,
     .finalize = MaxMinFinalize,
     .writeContext = MaxMinWriteContext,
     .readContext = MaxMinReadContext,
+    .contextSize = sizeof(MaxMinContext),
     .resetContext = MaxMinReset
 };
 
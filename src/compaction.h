@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include "redismodule.h"
 #include "consts.h"
+#include "chunk.h"
 #include <rmutil/util.h>
 
 
@@ -21,13 +22,23 @@ typedef struct AggregationClass
     void *(*createContext)();
     void(*freeContext)(void *context);
     void(*appendValue)(void *context, double value);
+    // appends a run of values at once, uses the vectorized kernels where the aggregation allows it
+    void(*appendValues)(void *context, const double *values, size_t count);
+    // appends all the samples of a sealed chunk using its precomputed summary
+    void(*appendSummary)(void *context, const ChunkSummary *summary);
     void(*resetContext)(void *context);
     void(*writeContext)(void *context, RedisModuleIO * io);
     void(*readContext)(void *context, RedisModuleIO *io);
     double(*finalize)(void *context);
+    // bytes allocated by createContext
+    size_t contextSize;
 } AggregationClass;
 
 AggregationClass* GetAggClass(int aggType);
+// vectorized folds of a run of values, count must be positive
+double AggSumValues(const double *values, size_t count);
+double AggMaxValues(const double *values, size_t count);
+double AggMinValues(const double *values, size_t count);
 int StringAggTypeToEnum(const char *agg_type);
 int RMStringLenAggTypeToEnum(RedisModuleString *aggTypeStr);
 int StringLenAggTypeToEnum(const char *agg_type, size_t len);
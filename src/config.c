@@ -44,5 +44,26 @@ int ReadConfig(RedisModuleString **argv, int argc) {
     } else {
         TSGlobalConfig.maxSamplesPerChunk = SAMPLES_PER_CHUNK_DEFAULT_SECS;
     }
+
+    if (argc > 1 && RMUtil_ArgIndex("CHUNK_SIZE_BYTES", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter("CHUNK_SIZE_BYTES", argv, argc, "l", &TSGlobalConfig.chunkSizeBytes) != REDISMODULE_OK ||
+            TSGlobalConfig.chunkSizeBytes <= 0 || TSGlobalConfig.chunkSizeBytes > CHUNK_SIZE_BYTES_MAX) {
+            return TSDB_ERROR;
+        }
+
+        printf("loaded default CHUNK_SIZE_BYTES policy: %lld \n", TSGlobalConfig.chunkSizeBytes);
+    } else {
+        TSGlobalConfig.chunkSizeBytes = CHUNK_SIZE_BYTES_DEFAULT;
+    }
+
+    if (argc > 1 && RMUtil_ArgIndex("RANGE_THREAD_MIN_CHUNKS", argv, argc) >= 0) {
+        if (RMUtil_ParseArgsAfter("RANGE_THREAD_MIN_CHUNKS", argv, argc, "l", &TSGlobalConfig.rangeThreadMinChunks) != REDISMODULE_OK) {
+            return TSDB_ERROR;
+        }
+
+        printf("loaded default RANGE_THREAD_MIN_CHUNKS policy: %lld \n", TSGlobalConfig.rangeThreadMinChunks);
+    } else {
+        TSGlobalConfig.rangeThreadMinChunks = RANGE_THREAD_MIN_CHUNKS_DEFAULT;
+    }
     return TSDB_OK;
 }
\ No newline at end of file
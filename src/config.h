@@ -9,6 +9,8 @@ typedef struct {
     size_t compactionRulesCount;
     long long retentionPolicy;
     long long maxSamplesPerChunk;
+    long long chunkSizeBytes;
+    long long rangeThreadMinChunks;
     int hasGlobalConfig;
 } TSConfig;
 
@@ -12,9 +12,23 @@
 #define TSDB_OK 0
 #define TSDB_ERROR -1
 
+/* Chunk encodings */
+typedef enum {
+    CHUNK_UNCOMPRESSED = 0,
+    CHUNK_COMPRESSED
+} CHUNK_ENCODING_T;
+
 /* TS.CREATE Defaults */
 #define RETENTION_DEFAULT_SECS          0LL
-#define SAMPLES_PER_CHUNK_DEFAULT_SECS  360LL
+/* 0 leaves the number of samples per chunk to the chunk size in bytes */
+#define SAMPLES_PER_CHUNK_DEFAULT_SECS  0LL
+#define CHUNK_SIZE_BYTES_DEFAULT        4096LL
+#define CHUNK_SIZE_BYTES_MAX            (16LL * 1024 * 1024)
+
+/* TS.RANGE queries over at least this many chunks run on a background thread, 0 to never do it.
+ * Off by default: a module can't block a client inside MULTI or a Lua script, so it may only be
+ * turned on when TS.RANGE isn't called from transactions or scripts */
+#define RANGE_THREAD_MIN_CHUNKS_DEFAULT 0LL
 
 /* TS.Range Aggregation types */
 typedef enum {
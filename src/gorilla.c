@@ -0,0 +1,210 @@
+#include <string.h>
+#include "gorilla.h"
+
+#define NO_WINDOW 0xFF
+
+typedef union {
+    double d;
+    u_int64_t u;
+} DoubleBits;
+
+static void writeBits(u_int64_t *words, u_int64_t *pos, u_int64_t value, int nbits) {
+    if (nbits < 64) {
+        value &= (1ULL << nbits) - 1;
+    }
+    u_int64_t index = *pos / 64;
+    int offset = *pos % 64;
+    words[index] |= value << offset;
+    if (offset + nbits > 64) {
+        words[index + 1] |= value >> (64 - offset);
+    }
+    *pos += nbits;
+}
+
+static u_int64_t readBits(u_int64_t *words, u_int64_t *pos, int nbits) {
+    u_int64_t index = *pos / 64;
+    int offset = *pos % 64;
+    u_int64_t value = words[index] >> offset;
+    if (offset + nbits > 64) {
+        value |= words[index + 1] << (64 - offset);
+    }
+    if (nbits < 64) {
+        value &= (1ULL << nbits) - 1;
+    }
+    *pos += nbits;
+    return value;
+}
+
+static int64_t signExtend(u_int64_t value, int nbits) {
+    if (nbits < 64 && (value & (1ULL << (nbits - 1)))) {
+        value |= ~((1ULL << nbits) - 1);
+    }
+    return (int64_t)value;
+}
+
+static void clearBits(u_int64_t *words, u_int64_t from, u_int64_t to) {
+    u_int64_t index = from / 64;
+    int offset = from % 64;
+    if (offset != 0) {
+        words[index] &= (1ULL << offset) - 1;
+        index++;
+    }
+    for (; index * 64 < to; index++) {
+        words[index] = 0;
+    }
+}
+
+void GorillaInit(GorillaData *data, size_t capacity) {
+    memset(&data->state, 0, sizeof(GorillaState));
+    data->state.leading = NO_WINDOW;
+    data->undoState = data->state;
+    data->capacity = capacity;
+    memset(data->words, 0, capacity * sizeof(u_int64_t));
+}
+
+void GorillaCopy(GorillaData *dest, GorillaData *src, size_t newCapacity) {
+    memcpy(dest, src, GORILLA_DATA_SIZE(src->capacity));
+    memset(dest->words + src->capacity, 0, (newCapacity - src->capacity) * sizeof(u_int64_t));
+    dest->capacity = newCapacity;
+}
+
+static void appendTimestamp(GorillaData *data, timestamp_t timestamp) {
+    GorillaState *state = &data->state;
+    int64_t delta = (int64_t)timestamp - state->prevTimestamp;
+    int64_t deltaOfDelta = delta - state->prevDelta;
+
+    if (deltaOfDelta == 0) {
+        writeBits(data->words, &state->bitCount, 0, 1);
+    } else if (deltaOfDelta >= -64 && deltaOfDelta <= 63) {
+        writeBits(data->words, &state->bitCount, 0x1, 2);      // '10'
+        writeBits(data->words, &state->bitCount, deltaOfDelta, 7);
+    } else if (deltaOfDelta >= -256 && deltaOfDelta <= 255) {
+        writeBits(data->words, &state->bitCount, 0x3, 3);      // '110'
+        writeBits(data->words, &state->bitCount, deltaOfDelta, 9);
+    } else if (deltaOfDelta >= -2048 && deltaOfDelta <= 2047) {
+        writeBits(data->words, &state->bitCount, 0x7, 4);      // '1110'
+        writeBits(data->words, &state->bitCount, deltaOfDelta, 12);
+    } else {
+        writeBits(data->words, &state->bitCount, 0xF, 4);      // '1111'
+        writeBits(data->words, &state->bitCount, deltaOfDelta, 64);
+    }
+    state->prevDelta = delta;
+    state->prevTimestamp = timestamp;
+}
+
+static void appendValue(GorillaData *data, u_int64_t value) {
+    GorillaState *state = &data->state;
+    u_int64_t xorValue = value ^ state->prevValue;
+
+    if (xorValue == 0) {
+        writeBits(data->words, &state->bitCount, 0, 1);
+        return;
+    }
+
+    int leading = __builtin_clzll(xorValue);
+    int trailing = __builtin_ctzll(xorValue);
+    if (leading > 31) {
+        // we only have 5 bits to store the leading zeros
+        leading = 31;
+    }
+
+    if (state->leading != NO_WINDOW && leading >= state->leading && trailing >= state->trailing) {
+        // the meaningful bits fall inside the previous window
+        writeBits(data->words, &state->bitCount, 0x1, 2);      // '10'
+        writeBits(data->words, &state->bitCount, xorValue >> state->trailing,
+                  64 - state->leading - state->trailing);
+    } else {
+        int significant = 64 - leading - trailing;
+        writeBits(data->words, &state->bitCount, 0x3, 2);      // '11'
+        writeBits(data->words, &state->bitCount, leading, 5);
+        // 64 significant bits do not fit in 6 bits, they are stored as 0
+        writeBits(data->words, &state->bitCount, significant, 6);
+        writeBits(data->words, &state->bitCount, xorValue >> trailing, significant);
+        state->leading = leading;
+        state->trailing = trailing;
+    }
+    state->prevValue = value;
+}
+
+int GorillaAppend(GorillaData *data, int isFirst, timestamp_t timestamp, double value) {
+    DoubleBits bits = {.d = value};
+
+    if (data->state.bitCount + GORILLA_MAX_SAMPLE_BITS > data->capacity * 64) {
+        return 0;
+    }
+    data->undoState = data->state;
+
+    if (isFirst) {
+        // the first sample is stored as is
+        writeBits(data->words, &data->state.bitCount, (u_int32_t)timestamp, 32);
+        writeBits(data->words, &data->state.bitCount, bits.u, 64);
+        data->state.prevTimestamp = timestamp;
+        data->state.prevValue = bits.u;
+    } else {
+        appendTimestamp(data, timestamp);
+        appendValue(data, bits.u);
+    }
+    return 1;
+}
+
+void GorillaRemoveLast(GorillaData *data) {
+    clearBits(data->words, data->undoState.bitCount, data->state.bitCount);
+    data->state = data->undoState;
+}
+
+void GorillaReaderInit(GorillaState *reader) {
+    memset(reader, 0, sizeof(GorillaState));
+    reader->leading = NO_WINDOW;
+}
+
+static timestamp_t readTimestamp(GorillaData *data, GorillaState *reader) {
+    int64_t deltaOfDelta;
+    if (readBits(data->words, &reader->bitCount, 1) == 0) {
+        deltaOfDelta = 0;
+    } else if (readBits(data->words, &reader->bitCount, 1) == 0) {
+        deltaOfDelta = signExtend(readBits(data->words, &reader->bitCount, 7), 7);
+    } else if (readBits(data->words, &reader->bitCount, 1) == 0) {
+        deltaOfDelta = signExtend(readBits(data->words, &reader->bitCount, 9), 9);
+    } else if (readBits(data->words, &reader->bitCount, 1) == 0) {
+        deltaOfDelta = signExtend(readBits(data->words, &reader->bitCount, 12), 12);
+    } else {
+        deltaOfDelta = (int64_t)readBits(data->words, &reader->bitCount, 64);
+    }
+    reader->prevDelta += deltaOfDelta;
+    reader->prevTimestamp += reader->prevDelta;
+    return reader->prevTimestamp;
+}
+
+static u_int64_t readValue(GorillaData *data, GorillaState *reader) {
+    if (readBits(data->words, &reader->bitCount, 1) == 0) {
+        return reader->prevValue;
+    }
+
+    if (readBits(data->words, &reader->bitCount, 1) != 0) {
+        // a new window
+        reader->leading = readBits(data->words, &reader->bitCount, 5);
+        int significant = readBits(data->words, &reader->bitCount, 6);
+        if (significant == 0) {
+            significant = 64;
+        }
+        reader->trailing = 64 - reader->leading - significant;
+    }
+    int significant = 64 - reader->leading - reader->trailing;
+    u_int64_t xorValue = readBits(data->words, &reader->bitCount, significant) << reader->trailing;
+    reader->prevValue ^= xorValue;
+    return reader->prevValue;
+}
+
+void GorillaRead(GorillaData *data, GorillaState *reader, int isFirst, timestamp_t *timestamp, double *value) {
+    DoubleBits bits;
+    if (isFirst) {
+        reader->prevTimestamp = (timestamp_t)readBits(data->words, &reader->bitCount, 32);
+        reader->prevValue = readBits(data->words, &reader->bitCount, 64);
+        bits.u = reader->prevValue;
+    } else {
+        readTimestamp(data, reader);
+        bits.u = readValue(data, reader);
+    }
+    *timestamp = reader->prevTimestamp;
+    *value = bits.d;
+}
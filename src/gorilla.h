@@ -0,0 +1,49 @@
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <sys/types.h>
+#include "consts.h"
+
+/*
+ * Gorilla style encoding of (timestamp, value) pairs, as described in
+ * "Gorilla: A Fast, Scalable, In-Memory Time Series Database" (Facebook, VLDB 2015).
+ * Timestamps are stored as bit packed delta-of-deltas, values as the XOR with
+ * the previous value, so regular interval metrics take 1-2 bytes per sample.
+ */
+
+// the biggest a single sample can get: 4 + 64 bits of timestamp and 2 + 5 + 6 + 64 bits of value
+#define GORILLA_MAX_SAMPLE_BITS 160
+
+typedef struct GorillaState {
+    u_int64_t bitCount;
+    int64_t prevDelta;
+    u_int64_t prevValue;
+    timestamp_t prevTimestamp;
+    u_int8_t leading;
+    u_int8_t trailing;
+} GorillaState;
+
+typedef struct GorillaData {
+    GorillaState state;
+    // the state before the last append, used to override the last sample
+    GorillaState undoState;
+    size_t capacity; // in 64 bit words
+    u_int64_t words[];
+} GorillaData;
+
+// size in bytes of a GorillaData with the given capacity
+#define GORILLA_DATA_SIZE(capacity) (sizeof(GorillaData) + (capacity) * sizeof(u_int64_t))
+
+void GorillaInit(GorillaData *data, size_t capacity);
+// moves the data to a bigger buffer of newCapacity words
+void GorillaCopy(GorillaData *dest, GorillaData *src, size_t newCapacity);
+// appends a sample, returns 0 when the buffer might not have room for it.
+// isFirst must be set for the first sample of the data
+int GorillaAppend(GorillaData *data, int isFirst, timestamp_t timestamp, double value);
+// drops the last appended sample, can only be called once after each append
+void GorillaRemoveLast(GorillaData *data);
+
+void GorillaReaderInit(GorillaState *reader);
+void GorillaRead(GorillaData *data, GorillaState *reader, int isFirst, timestamp_t *timestamp, double *value);
+
+#endif
@@ -0,0 +1,334 @@
+#include <fnmatch.h>
+#include <pthread.h>
+#include <string.h>
+#include "consts.h"
+#include "label_index.h"
+#include "tsdb.h"
+#include "rmutil/alloc.h"
+
+typedef struct Postings {
+    Series **series;
+    size_t count;
+    size_t capacity;
+} Postings;
+
+typedef struct LabelValueEntry {
+    char *value;
+    Postings postings;
+    struct LabelValueEntry *next;
+} LabelValueEntry;
+
+typedef struct LabelNameEntry {
+    char *name;
+    LabelValueEntry **buckets;
+    size_t bucketsCount;
+    size_t valuesCount;
+    struct LabelNameEntry *next;
+} LabelNameEntry;
+
+// FreeSeries removes the series without the redis lock, see tsdb.h
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+// few names carry many values, the names are a plain list
+static LabelNameEntry *names = NULL;
+static u_int64_t nextIndexId = 1;
+
+int LabelIsValid(const char *name, size_t nameLen, const char *value, size_t valueLen) {
+    if (nameLen == 0 || valueLen == 0 || strlen(name) != nameLen || strlen(value) != valueLen) {
+        return FALSE;
+    }
+    return strpbrk(name, "=!") == NULL;
+}
+
+void FreeLabels(Label *labels, size_t labelsCount) {
+    for (size_t i = 0; i < labelsCount; i++) {
+        free(labels[i].name);
+        free(labels[i].value);
+    }
+    free(labels);
+}
+
+static char *copyString(const char *str, size_t len) {
+    char *copy = malloc(len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+int ParseLabelFilter(const char *filter, size_t len, LabelFilter *parsed) {
+    const char *equals = memchr(filter, '=', len);
+    if (equals == NULL || strlen(filter) != len) {
+        return TSDB_ERROR;
+    }
+    int negate = equals > filter && equals[-1] == '!';
+    size_t nameLen = equals - filter - (negate ? 1 : 0);
+    size_t valueLen = len - (equals - filter) - 1;
+    if (nameLen == 0 || valueLen == 0 || memchr(filter, '!', nameLen) != NULL) {
+        return TSDB_ERROR;
+    }
+    parsed->name = copyString(filter, nameLen);
+    parsed->value = copyString(equals + 1, valueLen);
+    parsed->negate = negate;
+    parsed->glob = strpbrk(parsed->value, "*?[") != NULL;
+    return TSDB_OK;
+}
+
+void FreeLabelFilter(LabelFilter *filter) {
+    free(filter->name);
+    free(filter->value);
+}
+
+static u_int64_t hashValue(const char *value) {
+    // FNV-1a
+    u_int64_t hash = 14695981039346656037ULL;
+    for (; *value != '\0'; value++) {
+        hash ^= (unsigned char)*value;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static LabelNameEntry *findName(const char *name, int create) {
+    for (LabelNameEntry *entry = names; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    LabelNameEntry *entry = malloc(sizeof(LabelNameEntry));
+    entry->name = strdup(name);
+    entry->bucketsCount = LABEL_INDEX_INITIAL_BUCKETS;
+    entry->buckets = calloc(entry->bucketsCount, sizeof(LabelValueEntry *));
+    entry->valuesCount = 0;
+    entry->next = names;
+    names = entry;
+    return entry;
+}
+
+static void growBuckets(LabelNameEntry *nameEntry) {
+    size_t bucketsCount = nameEntry->bucketsCount * 2;
+    LabelValueEntry **buckets = calloc(bucketsCount, sizeof(LabelValueEntry *));
+    for (size_t i = 0; i < nameEntry->bucketsCount; i++) {
+        LabelValueEntry *entry = nameEntry->buckets[i];
+        while (entry != NULL) {
+            LabelValueEntry *next = entry->next;
+            size_t bucket = hashValue(entry->value) % bucketsCount;
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(nameEntry->buckets);
+    nameEntry->buckets = buckets;
+    nameEntry->bucketsCount = bucketsCount;
+}
+
+static LabelValueEntry *findValue(LabelNameEntry *nameEntry, const char *value, int create) {
+    size_t bucket = hashValue(value) % nameEntry->bucketsCount;
+    for (LabelValueEntry *entry = nameEntry->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->value, value) == 0) {
+            return entry;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (nameEntry->valuesCount >= nameEntry->bucketsCount) {
+        growBuckets(nameEntry);
+        bucket = hashValue(value) % nameEntry->bucketsCount;
+    }
+    LabelValueEntry *entry = calloc(1, sizeof(LabelValueEntry));
+    entry->value = strdup(value);
+    entry->next = nameEntry->buckets[bucket];
+    nameEntry->buckets[bucket] = entry;
+    nameEntry->valuesCount++;
+    return entry;
+}
+
+static void removeValue(LabelNameEntry *nameEntry, LabelValueEntry *valueEntry) {
+    LabelValueEntry **link = &nameEntry->buckets[hashValue(valueEntry->value) % nameEntry->bucketsCount];
+    while (*link != valueEntry) {
+        link = &(*link)->next;
+    }
+    *link = valueEntry->next;
+    nameEntry->valuesCount--;
+    free(valueEntry->postings.series);
+    free(valueEntry->value);
+    free(valueEntry);
+}
+
+// position of the series in the postings, or where it would go
+static size_t postingsSearch(Series **series, size_t count, u_int64_t indexId) {
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (series[mid]->labelIndexId < indexId) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int postingsContain(Series **series, size_t count, Series *target) {
+    size_t position = postingsSearch(series, count, target->labelIndexId);
+    return position < count && series[position] == target;
+}
+
+void LabelIndexAdd(Series *series) {
+    pthread_mutex_lock(&indexLock);
+    // ids only grow, appending keeps the posting lists sorted
+    series->labelIndexId = nextIndexId++;
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        LabelNameEntry *nameEntry = findName(series->labels[i].name, TRUE);
+        Postings *postings = &findValue(nameEntry, series->labels[i].value, TRUE)->postings;
+        if (postings->count == postings->capacity) {
+            postings->capacity = postings->capacity > 0 ? postings->capacity * 2 : 4;
+            postings->series = realloc(postings->series, sizeof(Series *) * postings->capacity);
+        }
+        postings->series[postings->count++] = series;
+    }
+    pthread_mutex_unlock(&indexLock);
+}
+
+void LabelIndexRemove(Series *series) {
+    if (series->labelIndexId == 0) {
+        return;
+    }
+    pthread_mutex_lock(&indexLock);
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        LabelNameEntry *nameEntry = findName(series->labels[i].name, FALSE);
+        LabelValueEntry *valueEntry = findValue(nameEntry, series->labels[i].value, FALSE);
+        Postings *postings = &valueEntry->postings;
+        size_t position = postingsSearch(postings->series, postings->count, series->labelIndexId);
+        memmove(postings->series + position, postings->series + position + 1,
+                sizeof(Series *) * (postings->count - position - 1));
+        postings->count--;
+        if (postings->count == 0) {
+            // values of short lived series would pile up otherwise
+            removeValue(nameEntry, valueEntry);
+        }
+    }
+    series->labelIndexId = 0;
+    pthread_mutex_unlock(&indexLock);
+}
+
+static const char *seriesLabelValue(Series *series, const char *name) {
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        if (strcmp(series->labels[i].name, name) == 0) {
+            return series->labels[i].value;
+        }
+    }
+    return NULL;
+}
+
+static int filterMatches(LabelFilter *filter, const char *value) {
+    if (filter->glob) {
+        return fnmatch(filter->value, value, 0) == 0;
+    }
+    return strcmp(filter->value, value) == 0;
+}
+
+static int compareIndexIds(const void *a, const void *b) {
+    u_int64_t idA = (*(Series **)a)->labelIndexId;
+    u_int64_t idB = (*(Series **)b)->labelIndexId;
+    return idA < idB ? -1 : idA > idB;
+}
+
+// the postings of a positive filter, a glob filter gets the union of the postings of its values
+static void filterPostings(LabelFilter *filter, Postings *result, int *owned) {
+    memset(result, 0, sizeof(Postings));
+    *owned = FALSE;
+    LabelNameEntry *nameEntry = findName(filter->name, FALSE);
+    if (nameEntry == NULL) {
+        return;
+    }
+    if (!filter->glob) {
+        LabelValueEntry *valueEntry = findValue(nameEntry, filter->value, FALSE);
+        if (valueEntry != NULL) {
+            *result = valueEntry->postings;
+        }
+        return;
+    }
+    *owned = TRUE;
+    for (size_t i = 0; i < nameEntry->bucketsCount; i++) {
+        for (LabelValueEntry *entry = nameEntry->buckets[i]; entry != NULL; entry = entry->next) {
+            if (!filterMatches(filter, entry->value)) {
+                continue;
+            }
+            Postings *postings = &entry->postings;
+            if (result->count + postings->count > result->capacity) {
+                result->capacity = result->count + postings->count;
+                result->series = realloc(result->series, sizeof(Series *) * result->capacity);
+            }
+            memcpy(result->series + result->count, postings->series, sizeof(Series *) * postings->count);
+            result->count += postings->count;
+        }
+    }
+    // a series has a single value per name, the union has no duplicates
+    qsort(result->series, result->count, sizeof(Series *), compareIndexIds);
+}
+
+LabelIndexMatch *LabelIndexQuery(LabelFilter *filters, size_t filtersCount, size_t *resultCount) {
+    Postings *postings = malloc(sizeof(Postings) * filtersCount);
+    int *owned = malloc(sizeof(int) * filtersCount);
+    LabelIndexMatch *result = NULL;
+    long smallest = -1;
+    *resultCount = 0;
+
+    pthread_mutex_lock(&indexLock);
+    for (size_t f = 0; f < filtersCount; f++) {
+        owned[f] = FALSE;
+        if (filters[f].negate) {
+            continue;
+        }
+        filterPostings(&filters[f], &postings[f], &owned[f]);
+        if (smallest < 0 || postings[f].count < postings[smallest].count) {
+            smallest = f;
+        }
+    }
+
+    if (smallest >= 0 && postings[smallest].count > 0) {
+        result = malloc(sizeof(LabelIndexMatch) * postings[smallest].count);
+        for (size_t i = 0; i < postings[smallest].count; i++) {
+            Series *series = postings[smallest].series[i];
+            int matches = TRUE;
+            for (size_t f = 0; f < filtersCount && matches; f++) {
+                if (filters[f].negate) {
+                    const char *value = seriesLabelValue(series, filters[f].name);
+                    matches = value == NULL || !filterMatches(&filters[f], value);
+                } else if (f != smallest) {
+                    matches = postingsContain(postings[f].series, postings[f].count, series);
+                }
+            }
+            if (matches) {
+                // the key name goes away with the series, which FreeSeries only frees after removing
+                // the series from the index
+                LabelIndexMatch *match = &result[(*resultCount)++];
+                match->series = series;
+                match->labelIndexId = series->labelIndexId;
+                match->keyName = series->keyName != NULL ? copyString(series->keyName, series->keyNameLen) : NULL;
+                match->keyNameLen = series->keyNameLen;
+            }
+        }
+    }
+    pthread_mutex_unlock(&indexLock);
+
+    for (size_t f = 0; f < filtersCount; f++) {
+        if (owned[f]) {
+            free(postings[f].series);
+        }
+    }
+    free(postings);
+    free(owned);
+    return result;
+}
+
+void FreeLabelIndexMatches(LabelIndexMatch *matches, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(matches[i].keyName);
+    }
+    free(matches);
+}
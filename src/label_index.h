@@ -0,0 +1,56 @@
+#ifndef LABEL_INDEX_H
+#define LABEL_INDEX_H
+
+#include <sys/types.h>
+
+struct Series;
+
+/*
+ * Inverted index of the labels of the series, TS.MRANGE and TS.MGET resolve their filters with it.
+ * Every name=value pair has a posting list of the series that carry it, in the order the series were
+ * indexed, so the lists of the positive filters are intersected with binary searches. The values of a
+ * name are hashed, a glob filter walks the values of its name only, never the keyspace.
+ */
+
+#define LABEL_INDEX_INITIAL_BUCKETS 16
+
+typedef struct Label {
+    char *name;
+    char *value;
+} Label;
+
+typedef struct LabelFilter {
+    char *name;
+    char *value;
+    // name!=value matches the series without the label or with another value
+    int negate;
+    // the value holds glob characters, it is matched with fnmatch
+    int glob;
+} LabelFilter;
+
+// whether the label can be stored, names can't hold the characters filters are split on
+int LabelIsValid(const char *name, size_t nameLen, const char *value, size_t valueLen);
+void FreeLabels(Label *labels, size_t labelsCount);
+// parses name=value or name!=value, TSDB_ERROR when the filter is malformed
+int ParseLabelFilter(const char *filter, size_t len, LabelFilter *parsed);
+void FreeLabelFilter(LabelFilter *filter);
+
+// the index is updated from the lazy free thread too, see FreeSeries
+void LabelIndexAdd(struct Series *series);
+void LabelIndexRemove(struct Series *series);
+typedef struct LabelIndexMatch {
+    // not safe to dereference, the series may be freed once the index lock is released. it is only
+    // compared with the value of the key, along with the id it had in the index
+    struct Series *series;
+    u_int64_t labelIndexId;
+    // copied under the index lock, NULL for a series without a key name
+    char *keyName;
+    size_t keyNameLen;
+} LabelIndexMatch;
+
+// the series that match all the filters, NULL and no results when none of the filters is positive.
+// the caller frees the matches with FreeLabelIndexMatches
+LabelIndexMatch *LabelIndexQuery(LabelFilter *filters, size_t filtersCount, size_t *resultCount);
+void FreeLabelIndexMatches(LabelIndexMatch *matches, size_t count);
+
+#endif
@@ -1,3 +1,5 @@
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "redismodule.h"
 #include "rmutil/util.h"
@@ -9,10 +11,66 @@
 #include "rdb.h"
 #include "config.h"
 #include "module.h"
+#include "chunk_pool.h"
+#include "retention.h"
+#include "workers.h"
+#include "stats.h"
 
 RedisModuleType *SeriesType;
 time_t timer;
 
+// state of the timed command that runs on the main thread, see TIMED_COMMAND
+static long long commandStartNs;
+static int commandFailed;
+// the command handed its work to a worker thread, which records it once done
+static int commandDeferred;
+
+// timed commands reply with errors through these, so that TS.STATS counts the error
+static int ReplyWithCommandError(RedisModuleCtx *ctx, const char *err) {
+    commandFailed = TRUE;
+    return RedisModule_ReplyWithError(ctx, err);
+}
+
+static int ReplyWithCommandWrongArity(RedisModuleCtx *ctx) {
+    commandFailed = TRUE;
+    return RedisModule_WrongArity(ctx);
+}
+
+// defines <command>Timed, that runs the command and records its latency under the stats op
+#define TIMED_COMMAND(command, op)                                                      \
+    static int command##Timed(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) { \
+        commandStartNs = StatsNowNs();                                                  \
+        commandFailed = FALSE;                                                          \
+        commandDeferred = FALSE;                                                        \
+        int ret = command(ctx, argv, argc);                                             \
+        if (!commandDeferred) {                                                         \
+            StatsRecord(op, StatsNowNs() - commandStartNs, commandFailed);              \
+        }                                                                               \
+        return ret;                                                                     \
+    }
+
+// replies with the [name, value] pairs of the labels of the series
+static void ReplyWithLabels(RedisModuleCtx *ctx, Series *series) {
+    RedisModule_ReplyWithArray(ctx, series->labelsCount);
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithStringBuffer(ctx, series->labels[i].name, strlen(series->labels[i].name));
+        RedisModule_ReplyWithStringBuffer(ctx, series->labels[i].value, strlen(series->labels[i].value));
+    }
+}
+
+// the series of a key a command opened. a key renamed, restored or migrated under another name still has
+// the old name in the series, it is updated here so that the multi series queries find the key again
+static Series *GetKeySeries(RedisModuleKey *key, RedisModuleString *keyName) {
+    Series *series = RedisModule_ModuleTypeGetValue(key);
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(keyName, &len);
+    if (series->keyName == NULL || series->keyNameLen != len || memcmp(series->keyName, name, len) != 0) {
+        SeriesSetKeyName(series, name, len);
+    }
+    return series;
+}
+
 int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
     
@@ -26,19 +84,37 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     } else if (RedisModule_ModuleTypeGetType(key) != SeriesType){
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     } else {
-        series = RedisModule_ModuleTypeGetValue(key);
+        series = GetKeySeries(key, argv[1]);
     }
 
-    RedisModule_ReplyWithArray(ctx, 5*2);
+    SeriesMemoryStats memStats;
+    SeriesGetMemoryStats(series, &memStats);
+    size_t totalBytes = memStats.headerBytes + memStats.samplesBytes + memStats.rulesBytes;
+
+    RedisModule_ReplyWithArray(ctx, 13*2);
 
     RedisModule_ReplyWithSimpleString(ctx, "lastTimestamp");
-    RedisModule_ReplyWithLongLong(ctx, series->lastTimestamp);
+    RedisModule_ReplyWithLongLong(ctx, SeriesGetLastTimestamp(series));
     RedisModule_ReplyWithSimpleString(ctx, "retentionSecs");
     RedisModule_ReplyWithLongLong(ctx, series->retentionSecs);
     RedisModule_ReplyWithSimpleString(ctx, "chunkCount");
     RedisModule_ReplyWithLongLong(ctx, series->chunkCount);
     RedisModule_ReplyWithSimpleString(ctx, "maxSamplesPerChunk");
     RedisModule_ReplyWithLongLong(ctx, series->maxSamplesPerChunk);
+    RedisModule_ReplyWithSimpleString(ctx, "chunkSizeBytes");
+    RedisModule_ReplyWithLongLong(ctx, series->chunkSizeBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "chunkEncoding");
+    RedisModule_ReplyWithSimpleString(ctx, series->chunkEncoding == CHUNK_COMPRESSED ? "compressed" : "uncompressed");
+    RedisModule_ReplyWithSimpleString(ctx, "oooWindowSecs");
+    RedisModule_ReplyWithLongLong(ctx, series->oooWindowSecs);
+    RedisModule_ReplyWithSimpleString(ctx, "headerBytes");
+    RedisModule_ReplyWithLongLong(ctx, memStats.headerBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "samplesBytes");
+    RedisModule_ReplyWithLongLong(ctx, memStats.samplesBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "rulesBytes");
+    RedisModule_ReplyWithLongLong(ctx, memStats.rulesBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "bytesPerSample");
+    RedisModule_ReplyWithDouble(ctx, memStats.samplesCount > 0 ? (double)totalBytes / memStats.samplesCount : 0);
 
     RedisModule_ReplyWithSimpleString(ctx, "rules");
     RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
@@ -46,7 +122,7 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     int ruleCount = 0;
     while (rule != NULL) {
         RedisModule_ReplyWithArray(ctx, 3);
-        RedisModule_ReplyWithString(ctx, rule->destKey);
+        RedisModule_ReplyWithStringBuffer(ctx, rule->destKey, rule->destKeyLen);
         RedisModule_ReplyWithLongLong(ctx, rule->bucketSizeSec);
         RedisModule_ReplyWithSimpleString(ctx, AggTypeEnumToString(rule->aggType));
         
@@ -55,9 +131,154 @@ int TSDB_info(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     }
     RedisModule_ReplySetArrayLength(ctx, ruleCount);
 
+    RedisModule_ReplyWithSimpleString(ctx, "labels");
+    ReplyWithLabels(ctx, series);
+
+    return REDISMODULE_OK;
+}
+
+/*
+TS.RETENTIONSTATS
+replies with the number of background retention runs, what the last one did and the totals reclaimed
+*/
+int TSDB_retentionStats(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 1) return RedisModule_WrongArity(ctx);
+
+    RetentionStats stats;
+    RetentionGetStats(&stats);
+
+    RedisModule_ReplyWithArray(ctx, 6*2);
+    RedisModule_ReplyWithSimpleString(ctx, "runs");
+    RedisModule_ReplyWithLongLong(ctx, stats.runs);
+    RedisModule_ReplyWithSimpleString(ctx, "lastRunSeriesChecked");
+    RedisModule_ReplyWithLongLong(ctx, stats.lastRun.seriesChecked);
+    RedisModule_ReplyWithSimpleString(ctx, "lastRunChunksReclaimed");
+    RedisModule_ReplyWithLongLong(ctx, stats.lastRun.chunksReclaimed);
+    RedisModule_ReplyWithSimpleString(ctx, "lastRunBytesReclaimed");
+    RedisModule_ReplyWithLongLong(ctx, stats.lastRun.bytesReclaimed);
+    RedisModule_ReplyWithSimpleString(ctx, "chunksReclaimed");
+    RedisModule_ReplyWithLongLong(ctx, stats.chunksReclaimed);
+    RedisModule_ReplyWithSimpleString(ctx, "bytesReclaimed");
+    RedisModule_ReplyWithLongLong(ctx, stats.bytesReclaimed);
     return REDISMODULE_OK;
 }
 
+/*
+TS.STATS [RESET]
+per operation the number of calls, how many failed and the latency percentiles in microseconds.
+RESET clears the counters
+*/
+int TSDB_stats(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc > 2) return RedisModule_WrongArity(ctx);
+    if (argc == 2) {
+        if (RMUtil_ArgIndex("RESET", argv + 1, 1) != 0) {
+            return RedisModule_ReplyWithError(ctx, "TSDB: unknown argument");
+        }
+        StatsReset();
+        return RedisModule_ReplyWithSimpleString(ctx, "OK");
+    }
+
+    RedisModule_ReplyWithArray(ctx, STATS_OPS_COUNT);
+    for (int op = 0; op < STATS_OPS_COUNT; op++) {
+        StatsSummary summary;
+        StatsGetSummary(op, &summary);
+        RedisModule_ReplyWithArray(ctx, 7*2);
+        RedisModule_ReplyWithSimpleString(ctx, "op");
+        RedisModule_ReplyWithSimpleString(ctx, summary.name);
+        RedisModule_ReplyWithSimpleString(ctx, "calls");
+        RedisModule_ReplyWithLongLong(ctx, summary.calls);
+        RedisModule_ReplyWithSimpleString(ctx, "errors");
+        RedisModule_ReplyWithLongLong(ctx, summary.errors);
+        RedisModule_ReplyWithSimpleString(ctx, "p50Us");
+        RedisModule_ReplyWithDouble(ctx, summary.p50Us);
+        RedisModule_ReplyWithSimpleString(ctx, "p99Us");
+        RedisModule_ReplyWithDouble(ctx, summary.p99Us);
+        RedisModule_ReplyWithSimpleString(ctx, "p999Us");
+        RedisModule_ReplyWithDouble(ctx, summary.p999Us);
+        RedisModule_ReplyWithSimpleString(ctx, "maxUs");
+        RedisModule_ReplyWithDouble(ctx, summary.maxUs);
+    }
+    return REDISMODULE_OK;
+}
+
+/*
+TS.POOLSTATS
+occupancy of the chunk memory pool, per block size
+*/
+int TSDB_poolStats(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 1) return RedisModule_WrongArity(ctx);
+
+    ChunkPoolStats stats;
+    ChunkPoolGetStats(&stats);
+
+    RedisModule_ReplyWithArray(ctx, 5*2);
+    RedisModule_ReplyWithSimpleString(ctx, "usedBytes");
+    RedisModule_ReplyWithLongLong(ctx, stats.usedBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "freeBytes");
+    RedisModule_ReplyWithLongLong(ctx, stats.freeBytes);
+    RedisModule_ReplyWithSimpleString(ctx, "hits");
+    RedisModule_ReplyWithLongLong(ctx, stats.hits);
+    RedisModule_ReplyWithSimpleString(ctx, "misses");
+    RedisModule_ReplyWithLongLong(ctx, stats.misses);
+
+    RedisModule_ReplyWithSimpleString(ctx, "classes");
+    RedisModule_ReplyWithArray(ctx, stats.classesCount);
+    for (size_t i = 0; i < stats.classesCount; i++) {
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithLongLong(ctx, stats.classes[i].blockSize);
+        RedisModule_ReplyWithLongLong(ctx, stats.classes[i].usedBlocks);
+        RedisModule_ReplyWithLongLong(ctx, stats.classes[i].freeBlocks);
+    }
+    return REDISMODULE_OK;
+}
+
+#define RANGE_FORMAT_RESP 0
+// the samples packed into a single bulk string, see PackedSamples
+#define RANGE_FORMAT_BINARY 1
+
+typedef struct RangeArgs {
+    long long startTs;
+    long long endTs;
+    int aggType;
+    long long timeDelta;
+    long long limit;
+    int format;
+    // newest sample first, the range is read backwards from its end
+    int reverse;
+} RangeArgs;
+
+// the reply of FORMAT BINARY, every sample is a little endian int32 timestamp followed by a little endian
+// IEEE 754 double, with no padding
+typedef struct PackedSamples {
+    unsigned char *buffer;
+    size_t len;
+    size_t capacity;
+    long long count;
+} PackedSamples;
+
+#define PACKED_SAMPLE_SIZE 12
+#define PACKED_SAMPLES_INITIAL_CAPACITY 64
+
+static void PackSample(PackedSamples *packed, timestamp_t timestamp, double value) {
+    if (packed->len + PACKED_SAMPLE_SIZE > packed->capacity) {
+        packed->capacity = packed->capacity > 0 ? packed->capacity * 2
+                                                : PACKED_SAMPLES_INITIAL_CAPACITY * PACKED_SAMPLE_SIZE;
+        packed->buffer = realloc(packed->buffer, packed->capacity);
+    }
+    unsigned char *out = packed->buffer + packed->len;
+    u_int32_t timestampBits = (u_int32_t)timestamp;
+    u_int64_t valueBits;
+    memcpy(&valueBits, &value, sizeof(double));
+    for (int i = 0; i < 4; i++) {
+        out[i] = (timestampBits >> (8 * i)) & 0xff;
+    }
+    for (int i = 0; i < 8; i++) {
+        out[4 + i] = (valueBits >> (8 * i)) & 0xff;
+    }
+    packed->len += PACKED_SAMPLE_SIZE;
+    packed->count++;
+}
+
 void ReplyWithAggValue(RedisModuleCtx *ctx, timestamp_t last_agg_timestamp, AggregationClass *aggObject, void *context) {
     RedisModule_ReplyWithArray(ctx, 2);
 
@@ -67,178 +288,787 @@ void ReplyWithAggValue(RedisModuleCtx *ctx, timestamp_t last_agg_timestamp, Aggr
     aggObject->resetContext(context);
 }
 
-int TSDB_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    RedisModule_AutoMemory(ctx);
+// index of the first timestamp in [from, count) that is not smaller than bucketEnd
+static size_t FindBucketEnd(const timestamp_t *timestamps, size_t from, size_t count, timestamp_t bucketEnd) {
+    size_t low = from, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (timestamps[mid] < bucketEnd) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// the bucket that ReplyWithAggregation is currently folding
+typedef struct AggregationBucket {
+    AggregationClass *aggObject;
+    void *context;
+    long long timeDelta;
+    int open;
+    timestamp_t start;
+    timestamp_t end;
+    long long replied;
+    // how many buckets to reply at most, 0 for no limit
+    long long limit;
+    // the buckets are packed here instead of replied when set
+    PackedSamples *packed;
+} AggregationBucket;
+
+static void AggregationBucketReply(RedisModuleCtx *ctx, AggregationBucket *bucket) {
+    if (bucket->packed != NULL) {
+        PackSample(bucket->packed, bucket->start, bucket->aggObject->finalize(bucket->context));
+        bucket->aggObject->resetContext(bucket->context);
+    } else {
+        ReplyWithAggValue(ctx, bucket->start, bucket->aggObject, bucket->context);
+    }
+    bucket->replied++;
+}
+
+static int AggregationBucketsDone(AggregationBucket *bucket) {
+    return bucket->limit > 0 && bucket->replied >= bucket->limit;
+}
+
+// replies with the current bucket if timestamp is past it, and opens the bucket of timestamp.
+// once the limit of buckets is replied no bucket is opened anymore
+static void AggregationBucketMoveTo(RedisModuleCtx *ctx, AggregationBucket *bucket, timestamp_t timestamp) {
+    if (bucket->open && timestamp < bucket->end) {
+        return;
+    }
+    if (bucket->open) {
+        AggregationBucketReply(ctx, bucket);
+        bucket->open = FALSE;
+    }
+    if (AggregationBucketsDone(bucket)) {
+        return;
+    }
+    bucket->start = timestamp - (timestamp % bucket->timeDelta);
+    bucket->end = bucket->start + bucket->timeDelta;
+    bucket->open = TRUE;
+}
+
+// folds the samples of the iterator into the buckets. the samples of each bucket are handed to the aggregation
+// as whole runs, sealed chunks that fall entirely inside a bucket are aggregated from their summary
+static void AggregateSamples(RedisModuleCtx *ctx, AggregationBucket *bucket, SeriesIterator *iterator) {
+    AggregationClass *aggObject = bucket->aggObject;
+    SampleRun run;
+
+    while (TRUE) {
+        Chunk *chunk = SeriesIteratorPeekWholeChunk(iterator);
+        if (chunk != NULL) {
+            AggregationBucketMoveTo(ctx, bucket, ChunkGetFirstTimestamp(chunk));
+            if (AggregationBucketsDone(bucket)) {
+                return;
+            }
+            if (ChunkGetLastTimestamp(chunk) < bucket->end) {
+                aggObject->appendSummary(bucket->context, &chunk->summary);
+                SeriesIteratorSkipChunk(iterator);
+                continue;
+            }
+        }
+        if (SeriesIteratorGetNextRun(iterator, &run) == 0) {
+            break;
+        }
+        size_t i = 0;
+        while (i < run.count) {
+            AggregationBucketMoveTo(ctx, bucket, run.timestamps[i]);
+            if (AggregationBucketsDone(bucket)) {
+                return;
+            }
+            size_t end = FindBucketEnd(run.timestamps, i + 1, run.count, bucket->end);
+            aggObject->appendValues(bucket->context, run.values + i, end - i);
+            i = end;
+        }
+    }
+}
 
-    long long start_ts, end_ts;
-    long long time_delta = 0;
+// folds the samples of a rollup of the same aggregation into the buckets, each one is the summary of its bucket
+static void AggregateRollup(RedisModuleCtx *ctx, AggregationBucket *bucket, SeriesIterator *iterator,
+                            int aggType) {
+    Sample sample;
+    while (SeriesIteratorGetNext(iterator, &sample) != 0) {
+        ChunkSummary summary = {.min = sample.data, .max = sample.data, .sum = sample.data,
+                                .first = sample.data, .last = sample.data,
+                                .count = aggType == TS_AGG_COUNT ? (size_t)sample.data : 1};
+        AggregationBucketMoveTo(ctx, bucket, sample.timestamp);
+        if (AggregationBucketsDone(bucket)) {
+            return;
+        }
+        bucket->aggObject->appendSummary(bucket->context, &summary);
+    }
+}
+
+// looks up the series the destination key of the rule holds now, a renamed or recreated destination is
+// noticed here. returns NULL when the destination key doesn't exist anymore
+static Series *ResolveRuleDest(RedisModuleCtx *ctx, CompactionRule *rule) {
+    Series *destSeries = NULL;
+    RedisModuleString *destKey = RedisModule_CreateString(ctx, rule->destKey, rule->destKeyLen);
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, destKey, REDISMODULE_READ|REDISMODULE_WRITE);
+    if (RedisModule_KeyType(key) != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) == SeriesType) {
+        destSeries = GetKeySeries(key, destKey);
+    }
+    RedisModule_CloseKey(key);
+    RedisModule_FreeString(ctx, destKey);
+    SeriesRuleSetDest(rule, destSeries);
+    return destSeries;
+}
+
+// finds the compaction rule that already rolled up part of the range, see SeriesFindRollup
+static CompactionRule *FindRollup(RedisModuleCtx *ctx, Series *series, long long start_ts, long long end_ts,
+                                  int agg_type, long long time_delta, timestamp_t *rollupStart,
+                                  timestamp_t *rollupEnd, Series **rollupSeries) {
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        if (rule->aggType == agg_type) {
+            ResolveRuleDest(ctx, rule);
+        }
+    }
+    return SeriesFindRollup(series, agg_type, time_delta, start_ts, end_ts, rollupStart, rollupEnd,
+                            rollupSeries);
+}
+
+// replies with a sample per bucket of time_delta seconds of [start_ts, end_ts], up to limit buckets when it
+// isn't 0, or packs them when packed is set. returns how many buckets were replied. when a compaction rule of
+// the same aggregation already rolled up part of the range, that part is read from its destination and only
+// the head and the tail the rule has not closed yet are read from the samples
+static long long ReplyWithAggregation(RedisModuleCtx *ctx, Series *series, long long start_ts, long long end_ts,
+                                      int agg_type, long long time_delta, long long limit,
+                                      PackedSamples *packed) {
+    AggregationClass *aggObject = GetAggClass(agg_type);
+    AggregationBucket bucket = {.aggObject = aggObject, .context = aggObject->createContext(),
+                                .timeDelta = time_delta, .open = FALSE, .replied = 0, .limit = limit,
+                                .packed = packed};
+    timestamp_t rollupStart, rollupEnd;
+    Series *rollupSeries;
+    CompactionRule *rollup = FindRollup(ctx, series, start_ts, end_ts, agg_type, time_delta,
+                                        &rollupStart, &rollupEnd, &rollupSeries);
+    if (rollup == NULL) {
+        SeriesIterator iterator = SeriesQuery(series, start_ts, end_ts);
+        AggregateSamples(ctx, &bucket, &iterator);
+    } else {
+        SeriesIterator iterator = SeriesQuery(series, start_ts, rollupStart - 1);
+        AggregateSamples(ctx, &bucket, &iterator);
+        if (!AggregationBucketsDone(&bucket)) {
+            iterator = SeriesQuery(rollupSeries, rollupStart, rollupEnd - 1);
+            AggregateRollup(ctx, &bucket, &iterator, agg_type);
+        }
+        if (!AggregationBucketsDone(&bucket)) {
+            iterator = SeriesQuery(series, rollupEnd, end_ts);
+            AggregateSamples(ctx, &bucket, &iterator);
+        }
+    }
+
+    if (bucket.open) {
+        // reply last bucket of data
+        AggregationBucketReply(ctx, &bucket);
+    }
+    aggObject->freeContext(bucket.context);
+    return bucket.replied;
+}
+
+// replies with the samples packed into a single bulk string, see PackedSamples
+static void ReplyWithPackedRange(RedisModuleCtx *ctx, Series *series, const RangeArgs *args) {
+    PackedSamples packed = {.buffer = NULL, .len = 0, .capacity = 0, .count = 0};
+    if (args->aggType == AGG_NONE) {
+        SeriesIterator iterator = SeriesQuery(series, args->startTs, args->endTs);
+        SampleRun run;
+        while ((args->limit == 0 || packed.count < args->limit) && SeriesIteratorGetNextRun(&iterator, &run) != 0) {
+            size_t count = run.count;
+            if (args->limit > 0 && count > args->limit - packed.count) {
+                count = args->limit - packed.count;
+            }
+            for (size_t i = 0; i < count; i++) {
+                PackSample(&packed, run.timestamps[i], run.values[i]);
+            }
+        }
+    } else {
+        ReplyWithAggregation(ctx, series, args->startTs, args->endTs, args->aggType, args->timeDelta, args->limit,
+                             &packed);
+    }
+    RedisModule_ReplyWithStringBuffer(ctx, (const char *)packed.buffer, packed.len);
+    free(packed.buffer);
+}
+
+// replies with the samples of the range from the newest, in either format. stops reading after the limit
+static void ReplyWithReverseRange(RedisModuleCtx *ctx, Series *series, const RangeArgs *args) {
+    PackedSamples packed = {.buffer = NULL, .len = 0, .capacity = 0, .count = 0};
+    SeriesReverseIterator iterator = SeriesReverseQuery(series, args->startTs, args->endTs);
+    Sample sample;
+    long long arraylen = 0;
+    if (args->format == RANGE_FORMAT_RESP) {
+        RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    }
+    while ((args->limit == 0 || arraylen < args->limit) && SeriesReverseIteratorGetNext(&iterator, &sample) != 0) {
+        if (args->format == RANGE_FORMAT_BINARY) {
+            PackSample(&packed, sample.timestamp, sample.data);
+        } else {
+            RedisModule_ReplyWithArray(ctx, 2);
+            RedisModule_ReplyWithLongLong(ctx, sample.timestamp);
+            RedisModule_ReplyWithDouble(ctx, sample.data);
+        }
+        arraylen++;
+    }
+    FreeSeriesReverseIterator(&iterator);
+    if (args->format == RANGE_FORMAT_BINARY) {
+        RedisModule_ReplyWithStringBuffer(ctx, (const char *)packed.buffer, packed.len);
+        free(packed.buffer);
+    } else {
+        RedisModule_ReplySetArrayLength(ctx, arraylen);
+    }
+}
+
+// replies with the samples of [start_ts, end_ts], or their aggregation when agg_type isn't TS_AGG_NONE
+static void ReplyWithRange(RedisModuleCtx *ctx, Series *series, const RangeArgs *args) {
+    if (args->reverse) {
+        ReplyWithReverseRange(ctx, series, args);
+        return;
+    }
+    if (args->format == RANGE_FORMAT_BINARY) {
+        ReplyWithPackedRange(ctx, series, args);
+        return;
+    }
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long long arraylen = 0;
+    if (args->aggType == AGG_NONE) { // No aggregation whats so ever
+        SeriesIterator iterator = SeriesQuery(series, args->startTs, args->endTs);
+        Sample sample;
+        while ((args->limit == 0 || arraylen < args->limit) && SeriesIteratorGetNext(&iterator, &sample) != 0) {
+            RedisModule_ReplyWithArray(ctx, 2);
+
+            RedisModule_ReplyWithLongLong(ctx, sample.timestamp);
+            RedisModule_ReplyWithDouble(ctx, sample.data);
+            arraylen++;
+        }
+    } else {
+        arraylen = ReplyWithAggregation(ctx, series, args->startTs, args->endTs, args->aggType, args->timeDelta,
+                                        args->limit, NULL);
+    }
+
+    RedisModule_ReplySetArrayLength(ctx,arraylen);
+}
+
+// a range query that runs on a worker thread over a snapshot of the series
+typedef struct RangeJob {
+    RedisModuleBlockedClient *blockedClient;
+    SeriesSnapshot *snapshot;
+    RangeArgs args;
+    // when the command started, the latency recorded covers the wait for a worker
+    long long commandStartNs;
+} RangeJob;
+
+static void RangeJobRun(void *arg) {
+    RangeJob *job = (RangeJob *)arg;
+    // the reply is collected here and sent by the main thread once the client is unblocked
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(job->blockedClient);
+    ReplyWithRange(ctx, &job->snapshot->series, &job->args);
+    RedisModule_FreeThreadSafeContext(ctx);
+    StatsRecord(STATS_OP_RANGE, StatsNowNs() - job->commandStartNs, FALSE);
+    RedisModule_UnblockClient(job->blockedClient, job);
+}
+
+static void RangeJobFree(void *privdata) {
+    RangeJob *job = (RangeJob *)privdata;
+    FreeSeriesSnapshot(job->snapshot);
+    free(job);
+}
+
+// whether the query reads enough chunks to be worth running on a worker thread. ranges that a rollup
+// answers are cheap and stay on the main thread. redis 4 doesn't tell a module whether the command
+// runs in MULTI or Lua, where the client can't be blocked, see RANGE_THREAD_MIN_CHUNKS_DEFAULT
+static int RangeRunsInBackground(RedisModuleCtx *ctx, Series *series, long long start_ts, long long end_ts,
+                                 int agg_type, long long time_delta) {
+    timestamp_t rollupStart, rollupEnd;
+    Series *rollupSeries;
+    if (TSGlobalConfig.rangeThreadMinChunks <= 0 ||
+        SeriesChunksInRange(series, start_ts, end_ts) < TSGlobalConfig.rangeThreadMinChunks) {
+        return FALSE;
+    }
+    return agg_type == AGG_NONE ||
+           FindRollup(ctx, series, start_ts, end_ts, agg_type, time_delta, &rollupStart, &rollupEnd,
+                      &rollupSeries) == NULL;
+}
+
+// parses start end [aggType timeBucket] [LIMIT n] [FORMAT BINARY], replies with the error when they are invalid
+static int ParseRangeArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, RangeArgs *args) {
     RedisModuleString * aggTypeStr = NULL;
+    args->timeDelta = 0;
+    args->limit = 0;
+    args->aggType = AGG_NONE;
+    args->format = RANGE_FORMAT_RESP;
+    args->reverse = FALSE;
+
+    // the named options come last, in any order
+    while (argc > 2) {
+        if (RMUtil_ArgIndex("LIMIT", argv + argc - 2, 1) == 0) {
+            if (RedisModule_StringToLongLong(argv[argc - 1], &args->limit) != REDISMODULE_OK || args->limit <= 0)
+                return ReplyWithCommandError(ctx, "TSDB: invalid LIMIT"), REDISMODULE_ERR;
+        } else if (RMUtil_ArgIndex("FORMAT", argv + argc - 2, 1) == 0) {
+            if (RMUtil_ArgIndex("BINARY", argv + argc - 1, 1) == 0) {
+                args->format = RANGE_FORMAT_BINARY;
+            } else if (RMUtil_ArgIndex("RESP", argv + argc - 1, 1) == 0) {
+                args->format = RANGE_FORMAT_RESP;
+            } else {
+                return ReplyWithCommandError(ctx, "TSDB: invalid FORMAT"), REDISMODULE_ERR;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+    }
 
     int pRes = REDISMODULE_ERR;
     switch (argc) {
-        case 4:
-            pRes = RMUtil_ParseArgs(argv, argc, 2, "ll", &start_ts, &end_ts);
+        case 2:
+            pRes = RMUtil_ParseArgs(argv, argc, 0, "ll", &args->startTs, &args->endTs);
             break;
-        case 6:
-            pRes = RMUtil_ParseArgs(argv, argc, 2, "llsl", &start_ts, &end_ts, &aggTypeStr, &time_delta );
-            if (!time_delta)
-                return RedisModule_ReplyWithError(ctx, "TSDB: time-delta must != 0");
+        case 4:
+            pRes = RMUtil_ParseArgs(argv, argc, 0, "llsl", &args->startTs, &args->endTs, &aggTypeStr,
+                                    &args->timeDelta);
+            if (!args->timeDelta)
+                return ReplyWithCommandError(ctx, "TSDB: time-delta must != 0"), REDISMODULE_ERR;
             break;
         default:
-            return RedisModule_WrongArity(ctx);
+            return ReplyWithCommandWrongArity(ctx), REDISMODULE_ERR;
     }
     if (pRes != REDISMODULE_OK)
-        return RedisModule_WrongArity(ctx);
-
-    long long agg_type = 0;
-    Series *series;
-    RedisModuleKey *key;
-    AggregationClass *aggObject = NULL;
+        return ReplyWithCommandWrongArity(ctx), REDISMODULE_ERR;
 
-    if (argc > 4)
+    if (argc > 2)
     {
         if (!aggTypeStr){
-            return RedisModule_ReplyWithError(ctx, "TSDB: Unknown aggregation type");
+            return ReplyWithCommandError(ctx, "TSDB: Unknown aggregation type"), REDISMODULE_ERR;
         }
 
-        agg_type = RMStringLenAggTypeToEnum(aggTypeStr);
+        args->aggType = RMStringLenAggTypeToEnum(aggTypeStr);
 
-        if (agg_type < 0 || agg_type >= TS_AGG_TYPES_MAX)
-            return RedisModule_ReplyWithError(ctx, "TSDB: Unknown aggregation type");
+        if (args->aggType < 0 || args->aggType >= TS_AGG_TYPES_MAX)
+            return ReplyWithCommandError(ctx, "TSDB: Unknown aggregation type"), REDISMODULE_ERR;
 
-        aggObject = GetAggClass( agg_type );
-        if (!aggObject)
-            return RedisModule_ReplyWithError(ctx, "TSDB: Failed to retrieve aggObject");
+        if (!GetAggClass(args->aggType))
+            return ReplyWithCommandError(ctx, "TSDB: Failed to retrieve aggObject"), REDISMODULE_ERR;
     }
+    return REDISMODULE_OK;
+}
+
+/*
+TS.RANGE key start end [aggType timeBucket] [LIMIT n] [FORMAT RESP|BINARY]
+LIMIT replies with the first n samples or buckets only. to page through a long range, call again with start set
+to the last timestamp of the reply + 1, or + timeBucket when aggregating.
+FORMAT BINARY replies with a single bulk string of 12 bytes per sample, a little endian int32 timestamp and a
+little endian double, instead of an array of [timestamp, value] pairs
+*/
+int TSDB_range(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    RangeArgs args;
+    Series *series;
+    RedisModuleKey *key;
+
+    if (argc < 2)
+        return ReplyWithCommandWrongArity(ctx);
+    if (ParseRangeArgs(ctx, argv + 2, argc - 2, &args) != REDISMODULE_OK)
+        return REDISMODULE_OK;
 
     key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ|REDISMODULE_WRITE);
     
     if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
-        return RedisModule_ReplyWithError(ctx, "TSDB: key does not exist");
+        return ReplyWithCommandError(ctx, "TSDB: key does not exist");
     } else if (RedisModule_ModuleTypeGetType(key) != SeriesType){
-        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return ReplyWithCommandError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     } else {
-        series = RedisModule_ModuleTypeGetValue(key);
+        series = GetKeySeries(key, argv[1]);
     }
 
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    long long arraylen = 0;
-    SeriesIterator iterator = SeriesQuery(series, start_ts, end_ts);
-    Sample sample;
-    void *context;
-    if (agg_type != AGG_NONE)
-        context = aggObject->createContext();
-    timestamp_t last_agg_timestamp = 0;
-    while (SeriesIteratorGetNext(&iterator, &sample) != 0 ) {
-        if (agg_type == AGG_NONE) { // No aggregation whats so ever
-            RedisModule_ReplyWithArray(ctx, 2);
+    if (RangeRunsInBackground(ctx, series, args.startTs, args.endTs, args.aggType, args.timeDelta)) {
+        RangeJob *job = malloc(sizeof(RangeJob));
+        job->snapshot = NewSeriesSnapshot(series, args.startTs, args.endTs);
+        job->args = args;
+        job->commandStartNs = commandStartNs;
+        commandDeferred = TRUE;
+        job->blockedClient = RedisModule_BlockClient(ctx, NULL, NULL, RangeJobFree, 0);
+        if (WorkersSubmit(RangeJobRun, job) != TSDB_OK) {
+            RangeJobRun(job);
+        }
+        return REDISMODULE_OK;
+    }
 
-            RedisModule_ReplyWithLongLong(ctx, sample.timestamp);
-            RedisModule_ReplyWithDouble(ctx, sample.data);
-            arraylen++;
-        } else {
-            timestamp_t current_timestamp = sample.timestamp - (sample.timestamp % time_delta);
-            if (current_timestamp > last_agg_timestamp) {
-                if (last_agg_timestamp != 0) {
-                    ReplyWithAggValue(ctx, last_agg_timestamp, aggObject, context);
-                    arraylen++;
-                }
+    ReplyWithRange(ctx, series, &args);
+    return REDISMODULE_OK;
+}
 
-                last_agg_timestamp = current_timestamp;
+static int CompareSeriesKeyNames(const void *a, const void *b) {
+    Series *seriesA = *(Series **)a;
+    Series *seriesB = *(Series **)b;
+    size_t len = seriesA->keyNameLen < seriesB->keyNameLen ? seriesA->keyNameLen : seriesB->keyNameLen;
+    int cmp = memcmp(seriesA->keyName, seriesB->keyName, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (seriesA->keyNameLen > seriesB->keyNameLen) - (seriesA->keyNameLen < seriesB->keyNameLen);
+}
+
+// the series that match all the label filters, sorted by key name. replies with the error when the filters
+// are invalid. the index keeps the series of renamed keys under their old name, the series a key doesn't
+// hold any more are skipped
+static int QuerySeriesByFilters(RedisModuleCtx *ctx, RedisModuleString **argv, int argc, Series ***result,
+                                size_t *resultCount) {
+    if (argc == 0)
+        return RedisModule_WrongArity(ctx), REDISMODULE_ERR;
+
+    LabelFilter *filters = malloc(sizeof(LabelFilter) * argc);
+    int filtersCount = 0;
+    int positive = FALSE;
+    for (; filtersCount < argc; filtersCount++) {
+        size_t len;
+        const char *filter = RedisModule_StringPtrLen(argv[filtersCount], &len);
+        if (ParseLabelFilter(filter, len, &filters[filtersCount]) != TSDB_OK) {
+            break;
+        }
+        positive |= !filters[filtersCount].negate;
+    }
+
+    int ret = REDISMODULE_OK;
+    *result = NULL;
+    *resultCount = 0;
+    if (filtersCount < argc) {
+        RedisModule_ReplyWithError(ctx, "TSDB: invalid filter");
+        ret = REDISMODULE_ERR;
+    } else if (!positive) {
+        // only the positive filters are resolved through the index
+        RedisModule_ReplyWithError(ctx, "TSDB: at least one filter must be name=value");
+        ret = REDISMODULE_ERR;
+    } else {
+        size_t matchedCount;
+        LabelIndexMatch *matched = LabelIndexQuery(filters, filtersCount, &matchedCount);
+        *result = malloc(sizeof(Series *) * (matchedCount > 0 ? matchedCount : 1));
+        for (size_t i = 0; i < matchedCount; i++) {
+            if (matched[i].keyName == NULL) {
+                continue;
             }
-            aggObject->appendValue(context, sample.data);
+            // the matched series may have been freed meanwhile by a FLUSHALL ASYNC, it is only used once
+            // the key is found to still hold it
+            RedisModuleString *keyName = RedisModule_CreateString(ctx, matched[i].keyName, matched[i].keyNameLen);
+            RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ);
+            if (RedisModule_ModuleTypeGetType(key) == SeriesType &&
+                RedisModule_ModuleTypeGetValue(key) == matched[i].series &&
+                matched[i].series->labelIndexId == matched[i].labelIndexId) {
+                (*result)[(*resultCount)++] = matched[i].series;
+            }
+            RedisModule_CloseKey(key);
         }
+        FreeLabelIndexMatches(matched, matchedCount);
+        qsort(*result, *resultCount, sizeof(Series *), CompareSeriesKeyNames);
     }
 
-    if (agg_type != AGG_NONE) {
-        // reply last bucket of data
-        ReplyWithAggValue(ctx, last_agg_timestamp, aggObject, context);
-        arraylen++;
+    for (int i = 0; i < filtersCount; i++) {
+        FreeLabelFilter(&filters[i]);
     }
+    free(filters);
+    return ret;
+}
 
-    RedisModule_ReplySetArrayLength(ctx,arraylen);
+/*
+TS.MRANGE start end [aggType timeBucket] [LIMIT n] [FORMAT RESP|BINARY] FILTER filter ...
+the range of every series that matches all the filters, a filter is name=value or name!=value and the value
+can be a glob pattern. at least one filter has to be name=value. replies with [key, labels, samples] per series
+*/
+int TSDB_mrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    int filterIndex = RMUtil_ArgIndex("FILTER", argv, argc);
+    if (filterIndex < 1)
+        return RedisModule_WrongArity(ctx);
+
+    RangeArgs args;
+    if (ParseRangeArgs(ctx, argv + 1, filterIndex - 1, &args) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+
+    Series **series;
+    size_t seriesCount;
+    if (QuerySeriesByFilters(ctx, argv + filterIndex + 1, argc - filterIndex - 1, &series, &seriesCount) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+
+    RedisModule_ReplyWithArray(ctx, seriesCount);
+    for (size_t i = 0; i < seriesCount; i++) {
+        RedisModule_ReplyWithArray(ctx, 3);
+        RedisModule_ReplyWithStringBuffer(ctx, series[i]->keyName, series[i]->keyNameLen);
+        ReplyWithLabels(ctx, series[i]);
+        ReplyWithRange(ctx, series[i], &args);
+    }
+    free(series);
     return REDISMODULE_OK;
 }
 
-void handleCompaction(RedisModuleCtx *ctx, CompactionRule *rule, api_timestamp_t timestamp, double value) {
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, rule->destKey, REDISMODULE_READ|REDISMODULE_WRITE);
-    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
-        // key doesn't exist anymore and we don't do anything
+// replies with [timestamp, value] of the newest sample, or an empty array for an empty series.
+// it is read from the cached last sample, the chunks are not touched
+static void ReplyWithLastSample(RedisModuleCtx *ctx, Series *series) {
+    if (SeriesIsEmpty(series)) {
+        RedisModule_ReplyWithArray(ctx, 0);
         return;
     }
-    Series *destSeries = RedisModule_ModuleTypeGetValue(key);
+    RedisModule_ReplyWithArray(ctx, 2);
+    RedisModule_ReplyWithLongLong(ctx, SeriesGetLastTimestamp(series));
+    RedisModule_ReplyWithDouble(ctx, SeriesGetLastValue(series));
+}
+
+/*
+TS.GET key
+the newest sample of the series, [timestamp, value] or an empty array when the series is empty
+*/
+int TSDB_get(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
 
-    timestamp_t currentTimestamp = timestamp - timestamp % rule->bucketSizeSec;
-    if (currentTimestamp > destSeries->lastTimestamp) {
-        rule->aggClass->resetContext(rule->aggContext);
+    if (argc != 2)
+        return RedisModule_WrongArity(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+        return RedisModule_ReplyWithError(ctx, "TSDB: key does not exist");
+    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType){
+        return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
-    rule->aggClass->appendValue(rule->aggContext, value);
-    SeriesAddSample(destSeries, currentTimestamp, rule->aggClass->finalize(rule->aggContext));
+
+    ReplyWithLastSample(ctx, GetKeySeries(key, argv[1]));
+    return REDISMODULE_OK;
 }
 
-int TSDB_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+/*
+TS.MGETKEYS key [key ...]
+the newest sample of every key like TS.GET replies it, in the order of the keys.
+a missing key gets a null and a key of another type an error, the other keys are still replied
+*/
+int TSDB_mgetKeys(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
-    
-    if (argc != 4) {
+
+    if (argc < 2)
+        return RedisModule_WrongArity(ctx);
+
+    RedisModule_ReplyWithArray(ctx, argc - 1);
+    for (int i = 1; i < argc; i++) {
+        RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[i], REDISMODULE_READ);
+        if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
+            RedisModule_ReplyWithNull(ctx);
+        } else if (RedisModule_ModuleTypeGetType(key) != SeriesType) {
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        } else {
+            ReplyWithLastSample(ctx, GetKeySeries(key, argv[i]));
+        }
+        RedisModule_CloseKey(key);
+    }
+    return REDISMODULE_OK;
+}
+
+/*
+TS.MGET FILTER filter ...
+the newest sample of every series that matches all the filters, see TS.MRANGE for the filters.
+replies with [key, labels, timestamp, value] per series, timestamp and value are null for an empty series
+*/
+int TSDB_mget(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 3 || RMUtil_ArgIndex("FILTER", argv + 1, 1) != 0)
         return RedisModule_WrongArity(ctx);
+
+    Series **series;
+    size_t seriesCount;
+    if (QuerySeriesByFilters(ctx, argv + 2, argc - 2, &series, &seriesCount) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+
+    RedisModule_ReplyWithArray(ctx, seriesCount);
+    for (size_t i = 0; i < seriesCount; i++) {
+        RedisModule_ReplyWithArray(ctx, 4);
+        RedisModule_ReplyWithStringBuffer(ctx, series[i]->keyName, series[i]->keyNameLen);
+        ReplyWithLabels(ctx, series[i]);
+        if (SeriesIsEmpty(series[i])) {
+            RedisModule_ReplyWithNull(ctx);
+            RedisModule_ReplyWithNull(ctx);
+        } else {
+            RedisModule_ReplyWithLongLong(ctx, SeriesGetLastTimestamp(series[i]));
+            RedisModule_ReplyWithDouble(ctx, SeriesGetLastValue(series[i]));
+        }
     }
-    RedisModuleString *keyName = argv[1];
-    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ|REDISMODULE_WRITE);
+    free(series);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.REVRANGE key start end [LIMIT n] [FORMAT RESP|BINARY]
+the samples of the range from the newest to the oldest. with LIMIT it reads the newest n samples only, however
+long the series is. to page further back, call again with end set to the last timestamp of the reply - 1
+*/
+int TSDB_revrange(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    RangeArgs args;
+    Series *series;
+    RedisModuleKey *key;
+
+    if (argc < 2)
+        return ReplyWithCommandWrongArity(ctx);
+    if (ParseRangeArgs(ctx, argv + 2, argc - 2, &args) != REDISMODULE_OK)
+        return REDISMODULE_OK;
+    if (args.aggType != AGG_NONE)
+        return ReplyWithCommandError(ctx, "TSDB: TS.REVRANGE doesn't aggregate");
+    args.reverse = TRUE;
+
+    key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY){
+        return ReplyWithCommandError(ctx, "TSDB: key does not exist");
+    } else if (RedisModule_ModuleTypeGetType(key) != SeriesType){
+        return ReplyWithCommandError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+    } else {
+        series = GetKeySeries(key, argv[1]);
+    }
+
+    ReplyWithRange(ctx, series, &args);
+    return REDISMODULE_OK;
+}
+
+void handleCompaction(RedisModuleCtx *ctx, CompactionRule *rule, api_timestamp_t timestamp, double value) {
+    Series *destSeries = NULL;
+    // the destination is only written when a bucket closes, the samples in between stay in the rule
+    if (SeriesRuleNeedsDest(rule, timestamp)) {
+        destSeries = ResolveRuleDest(ctx, rule);
+        if (destSeries == NULL) {
+            // key doesn't exist anymore and we don't do anything
+            return;
+        }
+    }
+    SeriesRuleAddSample(rule, destSeries, timestamp, value);
+}
+
+typedef struct CompactionSource {
+    RedisModuleCtx *ctx;
+    Series *series;
+} CompactionSource;
+
+// feeds the compaction rules with a sample that was written to the chunks of the source series
+static void handleCompactionRules(void *privdata, Sample sample) {
+    CompactionSource *source = (CompactionSource *)privdata;
+    CompactionRule *rule = source->series->rules;
+    if (rule == NULL) {
+        return;
+    }
+    long long startNs = StatsNowNs();
+    while (rule != NULL) {
+        handleCompaction(source->ctx, rule, sample.timestamp, sample.data);
+        rule = rule->nextRule;
+    }
+    StatsRecord(STATS_OP_COMPACTION, StatsNowNs() - startNs, FALSE);
+}
 
+// adds a sample to the series key and feeds its compaction rules, replies with the error on failure.
+// returns REDISMODULE_OK when the sample was added, the caller should reply on success.
+static int internalAdd(RedisModuleCtx *ctx, RedisModuleString *keyName, RedisModuleString *timestampStr,
+                       RedisModuleString *valueStr) {
     double timestamp, value;
-    if ((RedisModule_StringToDouble(argv[3], &value) != REDISMODULE_OK))
-        return RedisModule_ReplyWithError(ctx,"TSDB: invalid value");
-    
-    if ((RedisModule_StringToDouble(argv[2], &timestamp) != REDISMODULE_OK))
-        return RedisModule_ReplyWithError(ctx,"TSDB: invalid timestamp");
+    if ((RedisModule_StringToDouble(valueStr, &value) != REDISMODULE_OK)) {
+        ReplyWithCommandError(ctx,"TSDB: invalid value");
+        return REDISMODULE_ERR;
+    }
+
+    if ((RedisModule_StringToDouble(timestampStr, &timestamp) != REDISMODULE_OK)) {
+        ReplyWithCommandError(ctx,"TSDB: invalid timestamp");
+        return REDISMODULE_ERR;
+    }
 
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ|REDISMODULE_WRITE);
     Series *series = NULL;
     
     if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
         if (TSGlobalConfig.hasGlobalConfig) {
             // the key doesn't exist but we have enough information to create one
-            CreateTsKey(ctx, keyName, TSGlobalConfig.retentionPolicy, TSGlobalConfig.maxSamplesPerChunk, &series, &key);
+            CreateTsKey(ctx, keyName, TSGlobalConfig.retentionPolicy, TSGlobalConfig.maxSamplesPerChunk,
+                        TSGlobalConfig.chunkSizeBytes, CHUNK_UNCOMPRESSED, &series, &key);
             SeriesCreateRulesFromGlobalConfig(ctx, keyName, series);
         } else {
-            return RedisModule_ReplyWithError(ctx, "TSDB: the key does not exist");
+            RedisModule_CloseKey(key);
+            ReplyWithCommandError(ctx, "TSDB: the key does not exist");
+            return REDISMODULE_ERR;
         }
     } else if (RedisModule_ModuleTypeGetType(key) != SeriesType){
-        return RedisModule_ReplyWithError(ctx, "TSDB: the key is not a TSDB key");
+        RedisModule_CloseKey(key);
+        ReplyWithCommandError(ctx, "TSDB: the key is not a TSDB key");
+        return REDISMODULE_ERR;
     } else {
-        series = RedisModule_ModuleTypeGetValue(key);
+        series = GetKeySeries(key, keyName);
     }
 
-    int retval = SeriesAddSample(series, timestamp, value);
+    // the compaction rules see the samples once they are written in order to the chunks
+    CompactionSource source = {.ctx = ctx, .series = series};
+    int retval = SeriesInsertSample(series, timestamp, value, handleCompactionRules, &source);
     int result = 0;
     if (retval == TSDB_ERR_TIMESTAMP_TOO_OLD) {
-        RedisModule_ReplyWithError(ctx, "TSDB: timestamp is too old");
+        ReplyWithCommandError(ctx, "TSDB: timestamp is too old");
         result = REDISMODULE_ERR;
     } else if (retval != TSDB_OK) {
-        RedisModule_ReplyWithError(ctx, "TSDB: Unknown Error");
+        ReplyWithCommandError(ctx, "TSDB: Unknown Error");
         result = REDISMODULE_ERR;
     } else {
-        // handle compaction rules
-        CompactionRule *rule = series->rules;
-        while (rule != NULL) {
-            handleCompaction(ctx, rule, timestamp, value);
-            rule = rule->nextRule;
-        }
-        
-        RedisModule_ReplyWithSimpleString(ctx, "OK");
-        RedisModule_ReplicateVerbatim(ctx);
+        size_t keyNameLen;
+        const char *keyNameStr = RedisModule_StringPtrLen(keyName, &keyNameLen);
+        SeriesMarkDestWritten(keyNameStr, keyNameLen);
         result = REDISMODULE_OK;
     }
     RedisModule_CloseKey(key);
     return result;
 }
 
+int TSDB_add(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+    
+    if (argc != 4) {
+        return ReplyWithCommandWrongArity(ctx);
+    }
+
+    if (internalAdd(ctx, argv[1], argv[2], argv[3]) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+/*
+TS.MADD key timestamp value [key timestamp value ...]
+replies with an array that holds OK or the error of each sample
+*/
+int TSDB_madd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    RedisModule_AutoMemory(ctx);
+
+    if (argc < 4 || (argc - 1) % 3 != 0) {
+        return RedisModule_WrongArity(ctx);
+    }
+
+    long long samplesCount = (argc - 1) / 3;
+    long long addedCount = 0;
+    RedisModule_ReplyWithArray(ctx, samplesCount);
+    for (int i = 1; i < argc; i += 3) {
+        if (internalAdd(ctx, argv[i], argv[i + 1], argv[i + 2]) == REDISMODULE_OK) {
+            RedisModule_ReplyWithSimpleString(ctx, "OK");
+            addedCount++;
+        }
+    }
+
+    if (addedCount > 0) {
+        // replaying the whole command on the replicas gives the same result for every sample
+        RedisModule_ReplicateVerbatim(ctx);
+    }
+    return REDISMODULE_OK;
+}
+
 int CreateTsKey(RedisModuleCtx *ctx, RedisModuleString *keyName, long long retentionSecs,
-                long long maxSamplesPerChunk, Series **series, RedisModuleKey **key) {
+                long long maxSamplesPerChunk, long long chunkSizeBytes, int chunkEncoding, Series **series,
+                RedisModuleKey **key) {
     if (*key == NULL) {
         *key = RedisModule_OpenKey(ctx, keyName, REDISMODULE_READ|REDISMODULE_WRITE);
     }
 
-    *series = NewSeries(retentionSecs, maxSamplesPerChunk);
+    *series = NewSeries(retentionSecs, maxSamplesPerChunk, chunkSizeBytes, chunkEncoding);
+    size_t keyNameLen;
+    const char *keyNameStr = RedisModule_StringPtrLen(keyName, &keyNameLen);
+    SeriesSetKeyName(*series, keyNameStr, keyNameLen);
     if (RedisModule_ModuleTypeSetValue(*key, SeriesType, *series) == REDISMODULE_ERR) {
         return TSDB_ERROR;
     }
@@ -246,13 +1076,81 @@ int CreateTsKey(RedisModuleCtx *ctx, RedisModuleString *keyName, long long reten
     return TSDB_OK;
 }
 
+// checks the name value pairs that follow LABELS, replies with the error when they are invalid
+static int ValidateLabels(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc == 0 || argc % 2 != 0)
+        return RedisModule_WrongArity(ctx), REDISMODULE_ERR;
+    for (int i = 0; i < argc; i += 2) {
+        size_t nameLen, valueLen;
+        const char *name = RedisModule_StringPtrLen(argv[i], &nameLen);
+        const char *value = RedisModule_StringPtrLen(argv[i + 1], &valueLen);
+        if (!LabelIsValid(name, nameLen, value, valueLen))
+            return RedisModule_ReplyWithError(ctx, "TSDB: invalid label"), REDISMODULE_ERR;
+        for (int j = 0; j < i; j += 2) {
+            if (RedisModule_StringCompare(argv[i], argv[j]) == 0)
+                return RedisModule_ReplyWithError(ctx, "TSDB: duplicate label"), REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
+/*
+TS.CREATE key [retentionSecs] [maxSamplesPerChunk] [COMPRESSED] [OOO_WINDOW secs] [CHUNK_SIZE bytes]
+          [LABELS name value ...]
+OOO_WINDOW accepts samples up to secs older than the newest one instead of failing them.
+CHUNK_SIZE is the target size of the sample buffer of a chunk, how many samples it takes depends on the
+encoding and the ingest rate of the series. maxSamplesPerChunk caps it, 0 for no cap.
+LABELS comes last, TS.MRANGE and TS.MGET select the series by them
+*/
 int TSDB_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    if (argc < 2 || argc > 4)
+    if (argc < 2)
         return RedisModule_WrongArity(ctx);
 
     RedisModuleString *keyName = argv[1];
     long long retentionSecs = RETENTION_DEFAULT_SECS;
     long long maxSamplesPerChunk = TSGlobalConfig.maxSamplesPerChunk;
+    long long chunkSizeBytes = TSGlobalConfig.chunkSizeBytes;
+    int chunkEncoding = CHUNK_UNCOMPRESSED;
+    long long oooWindowSecs = 0;
+    RedisModuleString **labelArgs = NULL;
+    int labelArgsCount = 0;
+
+    int labelsIndex = RMUtil_ArgIndex("LABELS", argv + 2, argc - 2);
+    if (labelsIndex >= 0) {
+        labelArgs = argv + 2 + labelsIndex + 1;
+        labelArgsCount = argc - 2 - labelsIndex - 1;
+        if (ValidateLabels(ctx, labelArgs, labelArgsCount) != REDISMODULE_OK)
+            return REDISMODULE_OK;
+        argc = 2 + labelsIndex;
+    }
+
+    // the named options come last, in any order
+    while (argc > 3) {
+        if (RMUtil_ArgIndex("OOO_WINDOW", argv + argc - 2, 1) == 0) {
+            if (RedisModule_StringToLongLong(argv[argc - 1], &oooWindowSecs) != REDISMODULE_OK || oooWindowSecs < 0)
+                return RedisModule_ReplyWithError(ctx,"TSDB: invalid OOO_WINDOW");
+        } else if (RMUtil_ArgIndex("CHUNK_SIZE", argv + argc - 2, 1) == 0) {
+            if (RedisModule_StringToLongLong(argv[argc - 1], &chunkSizeBytes) != REDISMODULE_OK ||
+                chunkSizeBytes <= 0 || chunkSizeBytes > CHUNK_SIZE_BYTES_MAX)
+                return RedisModule_ReplyWithError(ctx,"TSDB: invalid CHUNK_SIZE");
+        } else {
+            break;
+        }
+        argc -= 2;
+    }
+    if (RMUtil_ArgIndex("OOO_WINDOW", argv, argc) > 1 || RMUtil_ArgIndex("CHUNK_SIZE", argv, argc) > 1)
+        return RedisModule_WrongArity(ctx);
+
+    if (argc > 2) {
+        RMUtil_StringToLower(argv[argc - 1]);
+        if (RMUtil_StringEqualsC(argv[argc - 1], "compressed")) {
+            chunkEncoding = CHUNK_COMPRESSED;
+            argc--;
+        }
+    }
+
+    if (argc > 4)
+        return RedisModule_WrongArity(ctx);
 
     if (argc > 2) {
         if ((RedisModule_StringToLongLong(argv[2], &retentionSecs) != REDISMODULE_OK))
@@ -260,7 +1158,7 @@ int TSDB_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     }
 
     if (argc > 3) {
-        if ((RedisModule_StringToLongLong(argv[3], &maxSamplesPerChunk) != REDISMODULE_OK))
+        if ((RedisModule_StringToLongLong(argv[3], &maxSamplesPerChunk) != REDISMODULE_OK) || maxSamplesPerChunk < 0)
             return RedisModule_ReplyWithError(ctx,"TSDB: invalid maxSamplesPerChunk");
     }
 
@@ -272,7 +1170,16 @@ int TSDB_create(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     }
 
     Series *series;
-    CreateTsKey(ctx, keyName, retentionSecs, maxSamplesPerChunk, &series, &key);
+    CreateTsKey(ctx, keyName, retentionSecs, maxSamplesPerChunk, chunkSizeBytes, chunkEncoding, &series, &key);
+    series->oooWindowSecs = oooWindowSecs;
+    if (labelArgsCount > 0) {
+        Label *labels = malloc(sizeof(Label) * labelArgsCount / 2);
+        for (int i = 0; i < labelArgsCount / 2; i++) {
+            labels[i].name = strdup(RedisModule_StringPtrLen(labelArgs[2 * i], NULL));
+            labels[i].value = strdup(RedisModule_StringPtrLen(labelArgs[2 * i + 1], NULL));
+        }
+        SeriesSetLabels(series, labels, labelArgsCount / 2);
+    }
     RedisModule_CloseKey(key);
 
     RedisModule_Log(ctx, "info", "created new series");
@@ -290,19 +1197,27 @@ int TSDB_deleteRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    Series *series = RedisModule_ModuleTypeGetValue(key);
+    Series *series = GetKeySeries(key, argv[1]);
 
     RedisModuleString *destKey = argv[2];
     if (SeriesHasRule(series, destKey)) {
         CompactionRule *rule = series->rules;
         CompactionRule *prev_rule = NULL;
         while (rule != NULL) {
-            if (RMUtil_StringEquals(rule->destKey, destKey)) {
+            if (RuleHasDestKey(rule, destKey)) {
                 if (prev_rule == NULL) {
                     series->rules = rule->nextRule;
                 } else {
                     prev_rule->nextRule = rule->nextRule;
                 }
+                Series *destSeries = rule->bucketOpen ? ResolveRuleDest(ctx, rule) : NULL;
+                if (destSeries != NULL && rule->bucketOpen) {
+                    // the destination keeps the partial bucket the rule was holding
+                    SeriesInsertSample(destSeries, rule->bucketStart,
+                                       rule->aggClass->finalize(rule->aggContext), NULL, NULL);
+                }
+                FreeRule(rule);
+                break;
             }
 
             prev_rule = rule;
@@ -346,15 +1261,21 @@ int TSDB_createRule(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
         return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
     }
 
-    Series *series = RedisModule_ModuleTypeGetValue(key);
+    Series *series = GetKeySeries(key, argv[1]);
     if (SeriesHasRule(series, argv[4])) {
         return RedisModule_ReplyWithError(ctx, "TSDB: the destination key already has a rule");
     }
+    size_t destKeyLen;
+    const char *destKeyName = RedisModule_StringPtrLen(argv[4], &destKeyLen);
+    CompactionRule **destRules;
+    RuleRegistryLock();
+    size_t destRulesCount = RuleRegistryGetRules(destKeyName, destKeyLen, &destRules);
+    RuleRegistryUnlock();
+    if (destRulesCount >= SERIES_ITERATOR_MAX_OPEN_BUCKETS) {
+        return RedisModule_ReplyWithError(ctx, "TSDB: too many rules write into the destination key");
+    }
 
-    RedisModuleString *destKeyStr = RedisModule_CreateStringFromString(ctx, argv[4]);
-    if (SeriesAddRule(series, destKeyStr, aggType, bucketSize) != NULL) {
-        RedisModule_RetainString(ctx, destKeyStr);
-    } else {
+    if (SeriesAddRule(series, destKeyName, destKeyLen, aggType, bucketSize) == NULL) {
         RedisModule_ReplyWithSimpleString(ctx, "ERROR creating rule");
         return REDISMODULE_ERR;
     }
@@ -372,7 +1293,7 @@ int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     RedisModule_AutoMemory(ctx);
 
     if (argc < 3 || argc > 5)
-        return RedisModule_WrongArity(ctx);
+        return ReplyWithCommandWrongArity(ctx);
 
     RedisModuleString *keyName = argv[1];
     Series *series;
@@ -381,20 +1302,22 @@ int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY) {
         if (TSGlobalConfig.hasGlobalConfig) {
             // the key doesn't exist but we have enough information to create one
-            CreateTsKey(ctx, keyName, TSGlobalConfig.retentionPolicy, TSGlobalConfig.maxSamplesPerChunk, &series, &key);
+            CreateTsKey(ctx, keyName, TSGlobalConfig.retentionPolicy, TSGlobalConfig.maxSamplesPerChunk,
+                        TSGlobalConfig.chunkSizeBytes, CHUNK_UNCOMPRESSED, &series, &key);
             SeriesCreateRulesFromGlobalConfig(ctx, keyName, series);
         } else {
-            return RedisModule_ReplyWithError(ctx, "TSDB: the key does not exists");
+            return ReplyWithCommandError(ctx, "TSDB: the key does not exists");
         }
     }
 
-    series = RedisModule_ModuleTypeGetValue(key);
+    series = GetKeySeries(key, keyName);
     long long incrby = 0;
     if (RMUtil_ParseArgs(argv, argc, 2, "l", &incrby) != REDISMODULE_OK)
-        return RedisModule_WrongArity(ctx);
+        return ReplyWithCommandWrongArity(ctx);
     time(&timer);
 
     double result;
+    double lastValue = SeriesGetLastValue(series);
     long long resetSeconds = 1;
     time_t currentUpdatedTime = timer;
     if (argc > 3) {
@@ -403,35 +1326,33 @@ int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
             if (argc > 4) {
                 RMUtil_StringToLower(argv[4]);
                 if (RMUtil_ParseArgs(argv, argc, 4, "l", &resetSeconds) != REDISMODULE_OK) {
-                    return RedisModule_WrongArity(ctx);
+                    return ReplyWithCommandWrongArity(ctx);
                 }
             }
             currentUpdatedTime = timer - ((int)timer % resetSeconds);
-            if (series->lastTimestamp != 0) {
-                int lastTS = series->lastTimestamp;
+            if (SeriesGetLastTimestamp(series) != 0) {
+                int lastTS = SeriesGetLastTimestamp(series);
                 if (lastTS - (lastTS % resetSeconds) !=  currentUpdatedTime) {
-                    series->lastValue = 0;
+                    lastValue = 0;
                 }
             }
         } else {
-            return RedisModule_WrongArity(ctx);
+            return ReplyWithCommandWrongArity(ctx);
         }
     }
 
     RMUtil_StringToLower(argv[0]);
     if (RMUtil_StringEqualsC(argv[0], "ts.incrby")) {
-        result = series->lastValue + incrby;
+        result = lastValue + incrby;
     } else {
-        result = series->lastValue - incrby;
+        result = lastValue - incrby;
     }
 
-    SeriesAddSample(series, currentUpdatedTime, result);
-
-    // handle compaction rules
-    CompactionRule *rule = series->rules;
-    while (rule != NULL) {
-        handleCompaction(ctx, rule, currentUpdatedTime, result);
-        rule = rule->nextRule;
+    CompactionSource source = {.ctx = ctx, .series = series};
+    if (SeriesInsertSample(series, currentUpdatedTime, result, handleCompactionRules, &source) == TSDB_OK) {
+        size_t keyNameLen;
+        const char *keyNameStr = RedisModule_StringPtrLen(keyName, &keyNameLen);
+        SeriesMarkDestWritten(keyNameStr, keyNameLen);
     }
 
     RedisModule_ReplyWithSimpleString(ctx, "OK");
@@ -439,13 +1360,19 @@ int TSDB_incrby(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return REDISMODULE_OK;
 }
 
+TIMED_COMMAND(TSDB_add, STATS_OP_ADD)
+TIMED_COMMAND(TSDB_incrby, STATS_OP_INCRBY)
+TIMED_COMMAND(TSDB_range, STATS_OP_RANGE)
+TIMED_COMMAND(TSDB_revrange, STATS_OP_RANGE)
+
 /*
 module loading function, possible arguments:
 COMPACTION_POLICY - compaction policy from parse_policies,h
 RETENTION_POLICY - integer that represents the retention in seconds
-MAX_SAMPLE_PER_CHUNK - how many samples per chunk
+MAX_SAMPLE_PER_CHUNK - caps the samples per chunk, 0 for no cap
+CHUNK_SIZE_BYTES - target size of the sample buffer of a chunk
 example:
-redis-server --loadmodule ./redis-tsdb-module.so COMPACTION_POLICY "max:1m:1d;min:10s:1h;avg:2h:10d;avg:3d:100d" RETENTION_POLICY 3600 MAX_SAMPLE_PER_CHUNK 1024
+redis-server --loadmodule ./redis-tsdb-module.so COMPACTION_POLICY "max:1m:1d;min:10s:1h;avg:2h:10d;avg:3d:100d" RETENTION_POLICY 3600 CHUNK_SIZE_BYTES 8192
 */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if (RedisModule_Init(ctx, "tsdb", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR) {
@@ -455,6 +1382,7 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     if (ReadConfig(argv, argc) == TSDB_ERROR) {
         return REDISMODULE_ERR;
     }
+    RuleRegistrySetMainThread();
 
     RedisModuleTypeMethods tm = {
             .version = REDISMODULE_TYPE_METHOD_VERSION,
@@ -470,11 +1398,37 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
     RMUtil_RegisterWriteCmd(ctx, "ts.create", TSDB_create);
     RMUtil_RegisterWriteCmd(ctx, "ts.createrule", TSDB_createRule);
     RMUtil_RegisterWriteCmd(ctx, "ts.deleterule", TSDB_deleteRule);
-    RMUtil_RegisterWriteCmd(ctx, "ts.add", TSDB_add);
-    RMUtil_RegisterWriteCmd(ctx, "ts.incrby", TSDB_incrby);
-    RMUtil_RegisterWriteCmd(ctx, "ts.decrby", TSDB_incrby);
-    RMUtil_RegisterReadCmd(ctx, "ts.range", TSDB_range);
+    RMUtil_RegisterWriteCmd(ctx, "ts.add", TSDB_addTimed);
+    if (RedisModule_CreateCommand(ctx, "ts.madd", TSDB_madd, "write", 1, -1, 3) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    RMUtil_RegisterWriteCmd(ctx, "ts.incrby", TSDB_incrbyTimed);
+    RMUtil_RegisterWriteCmd(ctx, "ts.decrby", TSDB_incrbyTimed);
+    RMUtil_RegisterReadCmd(ctx, "ts.range", TSDB_rangeTimed);
+    RMUtil_RegisterReadCmd(ctx, "ts.revrange", TSDB_revrangeTimed);
     RMUtil_RegisterReadCmd(ctx, "ts.info", TSDB_info);
+    RMUtil_RegisterReadCmd(ctx, "ts.get", TSDB_get);
+    if (RedisModule_CreateCommand(ctx, "ts.mgetkeys", TSDB_mgetKeys, "readonly", 1, -1, 1) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "ts.mrange", TSDB_mrange, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "ts.mget", TSDB_mget, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "ts.poolstats", TSDB_poolStats, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "ts.retentionstats", TSDB_retentionStats, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+    if (RedisModule_CreateCommand(ctx, "ts.stats", TSDB_stats, "readonly", 0, 0, 0) == REDISMODULE_ERR)
+        return REDISMODULE_ERR;
+
+    if (WorkersStart() != TSDB_OK) {
+        RedisModule_Log(ctx, "warning", "failed to start the worker threads");
+        return REDISMODULE_ERR;
+    }
+
+    if (RetentionStartThread() != TSDB_OK) {
+        RedisModule_Log(ctx, "warning", "failed to start the background retention thread");
+        return REDISMODULE_ERR;
+    }
 
     return REDISMODULE_OK;
 }
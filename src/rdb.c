@@ -1,30 +1,39 @@
+#include <string.h>
 #include "rdb.h"
 #include "chunk.h"
+#include "rmutil/alloc.h"
 
 void *series_rdb_load(RedisModuleIO *io, int encver)
 {
-    if (encver != TS_ENC_VER) {
+    if (encver > TS_ENC_VER) {
         RedisModule_LogIOError(io, "error", "data is not in the correct encoding");
         return NULL;
     }
     uint64_t retentionSecs = RedisModule_LoadUnsigned(io);
     uint64_t maxSamplesPerChunk = RedisModule_LoadUnsigned(io);
+    uint64_t chunkEncoding = CHUNK_UNCOMPRESSED;
+    if (encver >= TS_ENC_VER_CHUNK_ENCODING) {
+        chunkEncoding = RedisModule_LoadUnsigned(io);
+    }
+    // older series keep their fixed maxSamplesPerChunk, the chunk size only matters below it
+    uint64_t chunkSizeBytes = CHUNK_SIZE_BYTES_DEFAULT;
+    if (encver >= TS_ENC_VER_CHUNK_SIZE) {
+        chunkSizeBytes = RedisModule_LoadUnsigned(io);
+    }
     uint64_t rulesCount = RedisModule_LoadUnsigned(io);
     
-    Series *series = NewSeries(retentionSecs, maxSamplesPerChunk);
+    Series *series = NewSeries(retentionSecs, maxSamplesPerChunk, chunkSizeBytes, chunkEncoding);
 
     CompactionRule *lastRule;
-    RedisModuleCtx *ctx = RedisModule_GetContextFromIO(io);
 
     for (int i = 0; i < rulesCount; i++) {
-        RedisModuleString *destKey = RedisModule_LoadString(io);
+        size_t destKeyLen;
+        char *destKey = RedisModule_LoadStringBuffer(io, &destKeyLen);
         uint64_t bucketSizeSec = RedisModule_LoadUnsigned(io);
         uint64_t aggType = RedisModule_LoadUnsigned(io);
 
-        destKey = RedisModule_CreateStringFromString(ctx, destKey);
-        RedisModule_RetainString(ctx, destKey);
-
-        CompactionRule *rule = NewRule(destKey, aggType, bucketSizeSec);
+        CompactionRule *rule = NewRule(destKey, destKeyLen, aggType, bucketSizeSec);
+        RedisModule_Free(destKey);
         
         if (series->rules == NULL) {
             series->rules = rule;
@@ -32,14 +41,71 @@ void *series_rdb_load(RedisModuleIO *io, int encver)
             lastRule->nextRule = rule;
         }
         rule->aggClass->readContext(rule->aggContext, io);
+        if (encver >= TS_ENC_VER_OPEN_BUCKET) {
+            rule->bucketOpen = RedisModule_LoadUnsigned(io);
+            rule->bucketStart = RedisModule_LoadUnsigned(io);
+        }
+        if (encver >= TS_ENC_VER_RULE_COVERAGE) {
+            rule->coveredFrom = RedisModule_LoadUnsigned(io);
+        }
+        // the destination shows the open bucket once the rule is registered, before the rule looks it up
+        if (RuleRegistryAddRule(rule->destKey, rule->destKeyLen, rule) != TSDB_OK) {
+            RedisModule_LogIOError(io, "warning", "too many rules write into %.*s, its open buckets aren't read",
+                                   (int) rule->destKeyLen, rule->destKey);
+        }
         lastRule = rule;
     }
 
-    uint64_t samplesCount = RedisModule_LoadUnsigned(io);
-    for (size_t sampleIndex = 0; sampleIndex < samplesCount; sampleIndex++) {
-        timestamp_t ts = RedisModule_LoadUnsigned(io);
-        double val = RedisModule_LoadDouble(io);
-        SeriesAddSample(series, ts, val);
+    if (encver < TS_ENC_VER_CHUNKS) {
+        uint64_t samplesCount = RedisModule_LoadUnsigned(io);
+        for (size_t sampleIndex = 0; sampleIndex < samplesCount; sampleIndex++) {
+            timestamp_t ts = RedisModule_LoadUnsigned(io);
+            double val = RedisModule_LoadDouble(io);
+            SeriesAddSample(series, ts, val);
+        }
+        return series;
+    }
+
+    series->lastValue = RedisModule_LoadDouble(io);
+    uint64_t chunkCount = RedisModule_LoadUnsigned(io);
+    for (size_t chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++) {
+        size_t len;
+        char *buffer = RedisModule_LoadStringBuffer(io, &len);
+        Chunk *chunk = ChunkFromBuffer(buffer, len, encver < TS_ENC_VER_CHUNK_SIZE);
+        RedisModule_Free(buffer);
+        if (chunk == NULL) {
+            RedisModule_LogIOError(io, "error", "invalid chunk in series data");
+            DiscardSeries(series);
+            return NULL;
+        }
+        SeriesLoadChunk(series, chunk);
+    }
+
+    if (encver >= TS_ENC_VER_OOO_WINDOW) {
+        series->oooWindowSecs = RedisModule_LoadUnsigned(io);
+        uint64_t stagedCount = RedisModule_LoadUnsigned(io);
+        for (size_t stagedIndex = 0; stagedIndex < stagedCount; stagedIndex++) {
+            timestamp_t ts = RedisModule_LoadUnsigned(io);
+            double val = RedisModule_LoadDouble(io);
+            // the staged samples were saved inside the window, they stay staged
+            SeriesInsertSample(series, ts, val, NULL, NULL);
+        }
+    }
+
+    if (encver >= TS_ENC_VER_LABELS) {
+        size_t len;
+        char *keyName = RedisModule_LoadStringBuffer(io, &len);
+        if (len > 0) {
+            SeriesSetKeyName(series, keyName, len);
+        }
+        RedisModule_Free(keyName);
+        uint64_t labelsCount = RedisModule_LoadUnsigned(io);
+        Label *labels = labelsCount > 0 ? malloc(sizeof(Label) * labelsCount) : NULL;
+        for (size_t labelIndex = 0; labelIndex < labelsCount; labelIndex++) {
+            labels[labelIndex].name = RedisModule_LoadStringBuffer(io, &len);
+            labels[labelIndex].value = RedisModule_LoadStringBuffer(io, &len);
+        }
+        SeriesSetLabels(series, labels, labelsCount);
     }
     return series;
 }
@@ -59,29 +125,43 @@ void series_rdb_save(RedisModuleIO *io, void *value)
     Series *series = value;
     RedisModule_SaveUnsigned(io, series->retentionSecs);
     RedisModule_SaveUnsigned(io, series->maxSamplesPerChunk);
+    RedisModule_SaveUnsigned(io, series->chunkEncoding);
+    RedisModule_SaveUnsigned(io, series->chunkSizeBytes);
     RedisModule_SaveUnsigned(io, countRules(series));
 
     CompactionRule *rule = series->rules;
     while (rule != NULL) {
-        RedisModule_SaveString(io, rule->destKey);
+        RedisModule_SaveStringBuffer(io, rule->destKey, rule->destKeyLen);
         RedisModule_SaveUnsigned(io, rule->bucketSizeSec);
         RedisModule_SaveUnsigned(io, rule->aggType);
         rule->aggClass->writeContext(rule->aggContext, io);
+        RedisModule_SaveUnsigned(io, rule->bucketOpen);
+        RedisModule_SaveUnsigned(io, rule->bucketStart);
+        RedisModule_SaveUnsigned(io, rule->coveredFrom);
         rule = rule->nextRule;
     }
 
+    // every chunk is saved as a copy of its memory block, the header and the samples as they are
+    RedisModule_SaveDouble(io, series->lastValue);
+    RedisModule_SaveUnsigned(io, series->chunkCount);
     Chunk *chunk = series->firstChunk;
-    size_t numSamples =0;
     while (chunk != NULL) {
-        numSamples += ChunkNumOfSample(chunk);
+        RedisModule_SaveStringBuffer(io, (const char *)chunk, ChunkBlockSize(chunk));
         chunk = chunk->nextChunk;
     }
-    RedisModule_SaveUnsigned(io, numSamples);
 
-    SeriesIterator iter = SeriesQuery(series, 0, series->lastTimestamp);
-    Sample sample;
-    while (SeriesIteratorGetNext(&iter, &sample) != 0) {
-        RedisModule_SaveUnsigned(io, sample.timestamp);
-        RedisModule_SaveDouble(io, sample.data);
+    RedisModule_SaveUnsigned(io, series->oooWindowSecs);
+    RedisModule_SaveUnsigned(io, series->stagedCount);
+    for (size_t stagedIndex = 0; stagedIndex < series->stagedCount; stagedIndex++) {
+        RedisModule_SaveUnsigned(io, series->stagedTimestamps[stagedIndex]);
+        RedisModule_SaveDouble(io, series->stagedValues[stagedIndex]);
+    }
+
+    RedisModule_SaveStringBuffer(io, series->keyName != NULL ? series->keyName : "", series->keyNameLen);
+    RedisModule_SaveUnsigned(io, series->labelsCount);
+    for (size_t labelIndex = 0; labelIndex < series->labelsCount; labelIndex++) {
+        // with the terminating null, the loaded buffers are used as they are
+        RedisModule_SaveStringBuffer(io, series->labels[labelIndex].name, strlen(series->labels[labelIndex].name) + 1);
+        RedisModule_SaveStringBuffer(io, series->labels[labelIndex].value, strlen(series->labels[labelIndex].value) + 1);
     }
 }
\ No newline at end of file
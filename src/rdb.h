@@ -4,7 +4,22 @@
 #ifndef RDB_H
 #define RDB_H
 
-#define TS_ENC_VER 0
+#define TS_ENC_VER 7
+// first encoding version that stores the chunk encoding of the series
+#define TS_ENC_VER_CHUNK_ENCODING 1
+// first encoding version that stores whole chunks instead of sample by sample
+#define TS_ENC_VER_CHUNKS 2
+// first encoding version that stores the out of order window and the staged samples
+#define TS_ENC_VER_OOO_WINDOW 3
+// first encoding version that stores the open bucket of the compaction rules
+#define TS_ENC_VER_OPEN_BUCKET 4
+// first encoding version that stores from which bucket on the compaction rules have seen every sample
+#define TS_ENC_VER_RULE_COVERAGE 5
+// first encoding version that stores the chunk size in bytes, and chunk headers with int sample counts.
+// the header has a single layout from there on, allocated_samples of a saved block isn't read
+#define TS_ENC_VER_CHUNK_SIZE 6
+// first encoding version that stores the key name and the labels of the series
+#define TS_ENC_VER_LABELS 7
 
 void *series_rdb_load(RedisModuleIO *io, int encver);
 void series_rdb_save(RedisModuleIO *io, void *value);
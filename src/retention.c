@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "redismodule.h"
+#include "retention.h"
+#include "tsdb.h"
+
+// FreeSeries unregisters the series without the redis lock, see tsdb.h
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static Series *registryHead = NULL;
+// the series the next run starts from, NULL to start over from the head
+static Series *cursor = NULL;
+static RetentionStats stats;
+
+void RetentionRegisterSeries(Series *series) {
+    pthread_mutex_lock(&registryLock);
+    series->prevSeries = NULL;
+    series->nextSeries = registryHead;
+    if (registryHead != NULL) {
+        registryHead->prevSeries = series;
+    }
+    registryHead = series;
+    pthread_mutex_unlock(&registryLock);
+}
+
+void RetentionUnregisterSeries(Series *series) {
+    pthread_mutex_lock(&registryLock);
+    if (cursor == series) {
+        cursor = series->nextSeries;
+    }
+    if (series->prevSeries != NULL) {
+        series->prevSeries->nextSeries = series->nextSeries;
+    } else {
+        registryHead = series->nextSeries;
+    }
+    if (series->nextSeries != NULL) {
+        series->nextSeries->prevSeries = series->prevSeries;
+    }
+    series->prevSeries = NULL;
+    series->nextSeries = NULL;
+    pthread_mutex_unlock(&registryLock);
+}
+
+static long long monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void RetentionRun(long long budgetUs, RetentionRunStats *run) {
+    memset(run, 0, sizeof(RetentionRunStats));
+    pthread_mutex_lock(&registryLock);
+    long long start = monotonicUs();
+    if (cursor == NULL) {
+        cursor = registryHead;
+    }
+    while (cursor != NULL) {
+        size_t bytes = 0;
+        run->chunksReclaimed += SeriesTrim(cursor, &bytes);
+        run->bytesReclaimed += bytes;
+        run->seriesChecked++;
+        cursor = cursor->nextSeries;
+        if (run->seriesChecked % RETENTION_SERIES_PER_CHECK == 0 && monotonicUs() - start >= budgetUs) {
+            break;
+        }
+    }
+    stats.runs++;
+    stats.lastRun = *run;
+    stats.chunksReclaimed += run->chunksReclaimed;
+    stats.bytesReclaimed += run->bytesReclaimed;
+    pthread_mutex_unlock(&registryLock);
+}
+
+void RetentionGetStats(RetentionStats *result) {
+    pthread_mutex_lock(&registryLock);
+    *result = stats;
+    pthread_mutex_unlock(&registryLock);
+}
+
+static void *RetentionThreadMain(void *arg) {
+    RedisModuleCtx *ctx = RedisModule_GetThreadSafeContext(NULL);
+    RetentionRunStats run;
+    while (1) {
+        usleep(RETENTION_TICK_MS * 1000);
+        RedisModule_ThreadSafeContextLock(ctx);
+        RetentionRun(RETENTION_BUDGET_US, &run);
+        if (run.chunksReclaimed > 0) {
+            RedisModule_Log(ctx, "verbose", "retention reclaimed %zu chunks, %zu bytes, checked %zu series",
+                            run.chunksReclaimed, run.bytesReclaimed, run.seriesChecked);
+        }
+        RedisModule_ThreadSafeContextUnlock(ctx);
+    }
+    return NULL;
+}
+
+int RetentionStartThread() {
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, RetentionThreadMain, NULL);
+    pthread_attr_destroy(&attr);
+    return ret == 0 ? TSDB_OK : TSDB_ERROR;
+}
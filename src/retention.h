@@ -0,0 +1,41 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <sys/types.h>
+
+struct Series;
+
+/*
+ * Background retention enforcement. Every live series is registered here, a background thread
+ * wakes up every RETENTION_TICK_MS, takes the redis lock and trims the expired chunks of as many
+ * series as it can within RETENTION_BUDGET_US, continuing from where the previous tick stopped,
+ * like the active expire cycle of redis.
+ */
+
+#define RETENTION_TICK_MS 100
+#define RETENTION_BUDGET_US 1000
+// how many series are trimmed between checks of the time budget
+#define RETENTION_SERIES_PER_CHECK 16
+
+typedef struct RetentionRunStats {
+    size_t seriesChecked;
+    size_t chunksReclaimed;
+    size_t bytesReclaimed;
+} RetentionRunStats;
+
+typedef struct RetentionStats {
+    long long runs;
+    RetentionRunStats lastRun;
+    long long chunksReclaimed;
+    long long bytesReclaimed;
+} RetentionStats;
+
+void RetentionRegisterSeries(struct Series *series);
+void RetentionUnregisterSeries(struct Series *series);
+// trims series until budgetUs microseconds have passed or the end of the series list is reached,
+// the caller must hold the redis lock
+void RetentionRun(long long budgetUs, RetentionRunStats *run);
+void RetentionGetStats(RetentionStats *stats);
+int RetentionStartThread();
+
+#endif
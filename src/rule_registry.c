@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <string.h>
+#include "consts.h"
+#include "rule_registry.h"
+#include "tsdb.h"
+#include "rmutil/alloc.h"
+
+typedef struct RuleRegistryEntry {
+    char *destKey;
+    size_t len;
+    CompactionRule *rules[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    size_t count;
+    struct RuleRegistryEntry *next;
+} RuleRegistryEntry;
+
+// FreeSeries unregisters the series and their rules without the redis lock, see tsdb.h
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static u_int64_t nextHandle = 1;
+// the series by handle, chained through nextInRegistry
+static Series **seriesBuckets = NULL;
+static size_t seriesBucketsCount = 0;
+static size_t seriesCount = 0;
+// the rules by destination key
+static RuleRegistryEntry **entryBuckets = NULL;
+static size_t entryBucketsCount = 0;
+static size_t entriesCount = 0;
+static pthread_t mainThread;
+static int mainThreadSet = FALSE;
+
+void RuleRegistryLock() {
+    pthread_mutex_lock(&registryLock);
+}
+
+void RuleRegistryUnlock() {
+    pthread_mutex_unlock(&registryLock);
+}
+
+static u_int64_t hashKey(const char *key, size_t len) {
+    // FNV-1a
+    u_int64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void growSeriesBuckets() {
+    size_t bucketsCount = seriesBucketsCount > 0 ? seriesBucketsCount * 2 : RULE_REGISTRY_INITIAL_BUCKETS;
+    Series **buckets = calloc(bucketsCount, sizeof(Series *));
+    for (size_t i = 0; i < seriesBucketsCount; i++) {
+        Series *series = seriesBuckets[i];
+        while (series != NULL) {
+            Series *next = series->nextInRegistry;
+            size_t bucket = series->handle % bucketsCount;
+            series->nextInRegistry = buckets[bucket];
+            buckets[bucket] = series;
+            series = next;
+        }
+    }
+    free(seriesBuckets);
+    seriesBuckets = buckets;
+    seriesBucketsCount = bucketsCount;
+}
+
+void RuleRegistryAddSeries(Series *series) {
+    pthread_mutex_lock(&registryLock);
+    if (seriesCount >= seriesBucketsCount) {
+        growSeriesBuckets();
+    }
+    series->handle = nextHandle++;
+    size_t bucket = series->handle % seriesBucketsCount;
+    series->nextInRegistry = seriesBuckets[bucket];
+    seriesBuckets[bucket] = series;
+    seriesCount++;
+    pthread_mutex_unlock(&registryLock);
+}
+
+void RuleRegistryRemoveSeries(Series *series) {
+    pthread_mutex_lock(&registryLock);
+    Series **link = &seriesBuckets[series->handle % seriesBucketsCount];
+    while (*link != series) {
+        link = &(*link)->nextInRegistry;
+    }
+    *link = series->nextInRegistry;
+    series->nextInRegistry = NULL;
+    seriesCount--;
+    pthread_mutex_unlock(&registryLock);
+}
+
+Series *RuleRegistryGetSeries(u_int64_t handle) {
+    if (handle == 0 || seriesBucketsCount == 0) {
+        return NULL;
+    }
+    for (Series *series = seriesBuckets[handle % seriesBucketsCount]; series != NULL; series = series->nextInRegistry) {
+        if (series->handle == handle) {
+            return series;
+        }
+    }
+    return NULL;
+}
+
+static void growEntryBuckets() {
+    size_t bucketsCount = entryBucketsCount > 0 ? entryBucketsCount * 2 : RULE_REGISTRY_INITIAL_BUCKETS;
+    RuleRegistryEntry **buckets = calloc(bucketsCount, sizeof(RuleRegistryEntry *));
+    for (size_t i = 0; i < entryBucketsCount; i++) {
+        RuleRegistryEntry *entry = entryBuckets[i];
+        while (entry != NULL) {
+            RuleRegistryEntry *next = entry->next;
+            size_t bucket = hashKey(entry->destKey, entry->len) % bucketsCount;
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(entryBuckets);
+    entryBuckets = buckets;
+    entryBucketsCount = bucketsCount;
+}
+
+static RuleRegistryEntry *findEntry(const char *destKey, size_t len) {
+    if (entryBucketsCount == 0) {
+        return NULL;
+    }
+    RuleRegistryEntry *entry = entryBuckets[hashKey(destKey, len) % entryBucketsCount];
+    for (; entry != NULL; entry = entry->next) {
+        if (entry->len == len && memcmp(entry->destKey, destKey, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+int RuleRegistryAddRule(const char *destKey, size_t len, CompactionRule *rule) {
+    int ret = TSDB_OK;
+    pthread_mutex_lock(&registryLock);
+    RuleRegistryEntry *entry = findEntry(destKey, len);
+    if (entry == NULL) {
+        if (entriesCount >= entryBucketsCount) {
+            growEntryBuckets();
+        }
+        entry = calloc(1, sizeof(RuleRegistryEntry));
+        entry->destKey = malloc(len);
+        memcpy(entry->destKey, destKey, len);
+        entry->len = len;
+        size_t bucket = hashKey(destKey, len) % entryBucketsCount;
+        entry->next = entryBuckets[bucket];
+        entryBuckets[bucket] = entry;
+        entriesCount++;
+    }
+    if (entry->count == SERIES_ITERATOR_MAX_OPEN_BUCKETS) {
+        ret = TSDB_ERROR;
+    } else {
+        entry->rules[entry->count++] = rule;
+        rule->registryEntry = entry;
+    }
+    pthread_mutex_unlock(&registryLock);
+    return ret;
+}
+
+void RuleRegistryRemoveRule(CompactionRule *rule) {
+    RuleRegistryEntry *entry = rule->registryEntry;
+    if (entry == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&registryLock);
+    for (size_t i = 0; i < entry->count; i++) {
+        if (entry->rules[i] == rule) {
+            entry->rules[i] = entry->rules[--entry->count];
+            break;
+        }
+    }
+    rule->registryEntry = NULL;
+    if (entry->count == 0) {
+        // the names of deleted destinations would pile up otherwise
+        RuleRegistryEntry **link = &entryBuckets[hashKey(entry->destKey, entry->len) % entryBucketsCount];
+        while (*link != entry) {
+            link = &(*link)->next;
+        }
+        *link = entry->next;
+        entriesCount--;
+        free(entry->destKey);
+        free(entry);
+    }
+    pthread_mutex_unlock(&registryLock);
+}
+
+size_t RuleRegistryGetRules(const char *destKey, size_t len, CompactionRule ***rules) {
+    RuleRegistryEntry *entry = findEntry(destKey, len);
+    if (entry == NULL) {
+        *rules = NULL;
+        return 0;
+    }
+    *rules = entry->rules;
+    return entry->count;
+}
+
+size_t RuleRegistryDestRulesCount(CompactionRule *rule) {
+    return rule->registryEntry != NULL ? rule->registryEntry->count : 0;
+}
+
+void RuleRegistrySetMainThread() {
+    mainThread = pthread_self();
+    mainThreadSet = TRUE;
+}
+
+int RuleRegistryOnMainThread() {
+    return mainThreadSet && pthread_equal(pthread_self(), mainThread);
+}
@@ -0,0 +1,47 @@
+#ifndef RULE_REGISTRY_H
+#define RULE_REGISTRY_H
+
+#include <sys/types.h>
+
+struct Series;
+struct CompactionRule;
+struct RuleRegistryEntry;
+
+/*
+ * Links between the compaction rules and the series they write into. A rule doesn't point to its
+ * destination, either side can be freed on the lazy free thread while the other lives on, see FreeSeries.
+ * Every series gets a handle that is never reused instead, a rule keeps the handle of the destination it
+ * last resolved on the main thread, and the series of a handle is looked up here. The rules are also
+ * indexed by the name of their destination key, so that reads of a destination add the open buckets of
+ * the rules writing into it, including the rules that were just loaded and didn't resolve it yet.
+ *
+ * Registering and unregistering can happen on any thread. The rules and the series found here are only
+ * used on the main thread and while holding the registry lock, FreeSeries waits for it before freeing
+ * anything.
+ */
+
+#define RULE_REGISTRY_INITIAL_BUCKETS 64
+
+void RuleRegistryLock();
+void RuleRegistryUnlock();
+
+// gives the series a new handle
+void RuleRegistryAddSeries(struct Series *series);
+void RuleRegistryRemoveSeries(struct Series *series);
+// the series of the handle, NULL once it was freed. needs the lock
+struct Series *RuleRegistryGetSeries(u_int64_t handle);
+
+// indexes the rule under the name of its destination key, TSDB_ERROR when the destination already has
+// SERIES_ITERATOR_MAX_OPEN_BUCKETS rules, reads couldn't add the open bucket of one more
+int RuleRegistryAddRule(const char *destKey, size_t len, struct CompactionRule *rule);
+void RuleRegistryRemoveRule(struct CompactionRule *rule);
+// the rules registered under the destination key, valid until the lock is released. needs the lock
+size_t RuleRegistryGetRules(const char *destKey, size_t len, struct CompactionRule ***rules);
+// how many rules are registered under the destination of the rule, 0 when it isn't registered. needs the lock
+size_t RuleRegistryDestRulesCount(struct CompactionRule *rule);
+
+// remembers the calling thread as the main thread, from RedisModule_OnLoad
+void RuleRegistrySetMainThread();
+int RuleRegistryOnMainThread();
+
+#endif
@@ -0,0 +1,93 @@
+#include <time.h>
+#include "consts.h"
+#include "stats.h"
+
+typedef struct OpStats {
+    long long calls;
+    long long errors;
+    long long maxNs;
+    long long buckets[STATS_BUCKETS];
+} OpStats;
+
+static const char *opNames[STATS_OPS_COUNT] = {"ts.add", "ts.range", "ts.incrby", "compaction", "trim"};
+static OpStats opStats[STATS_OPS_COUNT];
+
+long long StatsNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int StatsBucketIndex(long long latencyNs) {
+    if (latencyNs < STATS_SUB_BUCKETS) {
+        return latencyNs < 0 ? 0 : latencyNs;
+    }
+    int highestBit = 63 - __builtin_clzll(latencyNs);
+    if (highestBit >= STATS_MAX_LATENCY_BITS) {
+        return STATS_BUCKETS - 1;
+    }
+    int shift = highestBit - STATS_SUB_BUCKET_BITS;
+    return (shift + 1) * STATS_SUB_BUCKETS + ((latencyNs >> shift) & (STATS_SUB_BUCKETS - 1));
+}
+
+// the highest latency that falls into the bucket
+static long long StatsBucketHighest(int index) {
+    if (index < STATS_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / STATS_SUB_BUCKETS - 1;
+    long long subBucket = STATS_SUB_BUCKETS + index % STATS_SUB_BUCKETS;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+void StatsRecord(StatsOp op, long long latencyNs, int failed) {
+    OpStats *stats = &opStats[op];
+    __atomic_add_fetch(&stats->calls, 1, __ATOMIC_RELAXED);
+    if (failed) {
+        __atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&stats->buckets[StatsBucketIndex(latencyNs)], 1, __ATOMIC_RELAXED);
+    long long maxNs = __atomic_load_n(&stats->maxNs, __ATOMIC_RELAXED);
+    while (latencyNs > maxNs &&
+           !__atomic_compare_exchange_n(&stats->maxNs, &maxNs, latencyNs, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static double StatsPercentileUs(OpStats *stats, long long recorded, double percentile) {
+    long long rank = (long long)(recorded * percentile / 100);
+    long long seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += __atomic_load_n(&stats->buckets[i], __ATOMIC_RELAXED);
+        if (seen > rank) {
+            return StatsBucketHighest(i) / 1000.0;
+        }
+    }
+    return __atomic_load_n(&stats->maxNs, __ATOMIC_RELAXED) / 1000.0;
+}
+
+void StatsGetSummary(StatsOp op, StatsSummary *summary) {
+    OpStats *stats = &opStats[op];
+    long long recorded = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        recorded += __atomic_load_n(&stats->buckets[i], __ATOMIC_RELAXED);
+    }
+    summary->name = opNames[op];
+    summary->calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+    summary->errors = __atomic_load_n(&stats->errors, __ATOMIC_RELAXED);
+    summary->p50Us = StatsPercentileUs(stats, recorded, 50);
+    summary->p99Us = StatsPercentileUs(stats, recorded, 99);
+    summary->p999Us = StatsPercentileUs(stats, recorded, 99.9);
+    summary->maxUs = __atomic_load_n(&stats->maxNs, __ATOMIC_RELAXED) / 1000.0;
+}
+
+void StatsReset() {
+    // not atomic as a whole, calls recorded meanwhile may be partly kept
+    for (int op = 0; op < STATS_OPS_COUNT; op++) {
+        OpStats *stats = &opStats[op];
+        __atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->errors, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->maxNs, 0, __ATOMIC_RELAXED);
+        for (int i = 0; i < STATS_BUCKETS; i++) {
+            __atomic_store_n(&stats->buckets[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
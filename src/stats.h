@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Call counters and latency histograms of the commands and of the background work, reported by
+ * TS.STATS. The histograms are log linear like HDR histograms: every power of two is split into
+ * STATS_SUB_BUCKETS buckets, so a percentile is within 1/STATS_SUB_BUCKETS of the real value.
+ * Recording is a few relaxed atomic increments and can be done from any thread.
+ */
+
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+// latencies are recorded in nanoseconds, up to 2^40ns (about 18 minutes)
+#define STATS_MAX_LATENCY_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_LATENCY_BITS - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+typedef enum StatsOp {
+    STATS_OP_ADD = 0,
+    STATS_OP_RANGE,
+    STATS_OP_INCRBY,
+    // feeding the compaction rules with a sample
+    STATS_OP_COMPACTION,
+    // trimming a series that had expired chunks
+    STATS_OP_TRIM,
+    STATS_OPS_COUNT
+} StatsOp;
+
+typedef struct StatsSummary {
+    const char *name;
+    long long calls;
+    long long errors;
+    double p50Us;
+    double p99Us;
+    double p999Us;
+    double maxUs;
+} StatsSummary;
+
+long long StatsNowNs();
+void StatsRecord(StatsOp op, long long latencyNs, int failed);
+void StatsGetSummary(StatsOp op, StatsSummary *summary);
+void StatsReset();
+
+#endif
@@ -1,6 +1,13 @@
+#include <pthread.h>
+#include <time.h>
 #include "parse_policies.h"
 #include "minunit.h"
 #include "compaction.h"
+#include "chunk.h"
+#include "chunk_pool.h"
+#include "tsdb.h"
+#include "retention.h"
+#include "stats.h"
 #include "rmutil/alloc.h"
 
 MU_TEST(test_valid_policy) {
@@ -48,14 +55,999 @@ MU_TEST(test_StringLenAggTypeToEnum) {
     mu_check(StringAggTypeToEnum("last") == TS_AGG_LAST);
 }
 
+// adds a sample the way the series does, growing the chunk when it runs out of space
+static Chunk *addSample(Chunk *chunk, Sample sample, int *result) {
+    *result = ChunkAddSample(chunk, sample);
+    if (*result == 0 && ChunkCanGrow(chunk)) {
+        chunk = ChunkGrow(chunk);
+        *result = ChunkAddSample(chunk, sample);
+    }
+    return chunk;
+}
+
+MU_TEST(test_compressed_chunk) {
+    Chunk *chunk = NewChunk(1000, CHUNK_COMPRESSED);
+    Sample sample;
+    int i, result;
+    for (i = 0; i < 500; i++) {
+        // regular interval with a few jitters and repeating values
+        sample.timestamp = 1511885909 + i * 10 + (i % 50 == 0 ? 3 : 0);
+        sample.data = (i % 7 == 0) ? i * 1.5 : 42;
+        chunk = addSample(chunk, sample, &result);
+        mu_check(result == 1);
+    }
+    // a wide jump and a value that needs all 64 bits
+    sample.timestamp += 100000;
+    sample.data = -1.0 / 3;
+    chunk = addSample(chunk, sample, &result);
+    mu_check(result == 1);
+    // override the last sample
+    ChunkRemoveLastSample(chunk);
+    sample.data = 7;
+    chunk = addSample(chunk, sample, &result);
+    mu_check(result == 1);
+    mu_check(ChunkNumOfSample(chunk) == 501);
+    mu_check(ChunkGetFirstTimestamp(chunk) == 1511885909 + 3);
+    mu_check(ChunkGetLastTimestamp(chunk) == sample.timestamp);
+
+    ChunkIterator iter = NewChunkIterator(chunk);
+    for (i = 0; i < 500; i++) {
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 1);
+        mu_check(sample.timestamp == 1511885909 + i * 10 + (i % 50 == 0 ? 3 : 0));
+        mu_check(sample.data == ((i % 7 == 0) ? i * 1.5 : 42));
+    }
+    mu_check(ChunkIteratorGetNext(&iter, &sample) == 1);
+    mu_check(sample.data == 7);
+    mu_check(ChunkIteratorGetNext(&iter, &sample) == 0);
+
+    // regular samples should take a fraction of the uncompressed size
+    mu_check(ChunkBlockSize(chunk) < 501 * sizeof(Sample) / 4);
+    FreeChunk(chunk);
+}
+
+MU_TEST(test_aggregation_append_values) {
+    double values[1000];
+    int aggTypes[] = {TS_AGG_MIN, TS_AGG_MAX, TS_AGG_SUM, TS_AGG_AVG, TS_AGG_COUNT, TS_AGG_FIRST, TS_AGG_LAST};
+    size_t counts[] = {1, 3, 7, 8, 9, 17, 1000};
+    for (int i = 0; i < 1000; i++) {
+        values[i] = (i * 7919) % 1000 - 500.25;
+    }
+    for (int a = 0; a < 7; a++) {
+        AggregationClass *aggClass = GetAggClass(aggTypes[a]);
+        for (int c = 0; c < 7; c++) {
+            void *oneByOne = aggClass->createContext();
+            void *batched = aggClass->createContext();
+            // the batch is appended in two runs, like a bucket that spans two chunks
+            for (size_t i = 0; i < counts[c]; i++) {
+                aggClass->appendValue(oneByOne, values[i]);
+            }
+            aggClass->appendValues(batched, values, counts[c] / 2 + 1);
+            if (counts[c] > counts[c] / 2 + 1) {
+                aggClass->appendValues(batched, values + counts[c] / 2 + 1, counts[c] - counts[c] / 2 - 1);
+            }
+            mu_assert_double_eq(aggClass->finalize(oneByOne), aggClass->finalize(batched));
+            aggClass->freeContext(oneByOne);
+            aggClass->freeContext(batched);
+        }
+    }
+}
+
+MU_TEST(test_uncompressed_chunk_columns) {
+    Chunk *chunk = NewChunk(360, CHUNK_UNCOMPRESSED);
+    int result;
+    // the buffer starts empty and doubles up to the capacity of the chunk
+    mu_check(ChunkBlockSize(chunk) == sizeof(Chunk));
+    for (int i = 0; i < 360; i++) {
+        Sample sample = {.timestamp = i * 2, .data = i * 0.5};
+        chunk = addSample(chunk, sample, &result);
+        mu_check(result == 1);
+        if (i == 0) {
+            // no padding between the timestamp and the value of a sample
+            mu_check(ChunkBlockSize(chunk) == sizeof(Chunk) + 8 * (sizeof(timestamp_t) + sizeof(double)));
+        }
+    }
+    mu_check(IsChunkFull(chunk));
+    mu_check(!ChunkCanGrow(chunk));
+    mu_check(ChunkBlockSize(chunk) == sizeof(Chunk) + 360 * (sizeof(timestamp_t) + sizeof(double)));
+    mu_check(ChunkGetTimestamps(chunk)[100] == 200);
+    mu_check(ChunkGetValues(chunk)[100] == 50);
+    mu_check(ChunkGetLastTimestamp(chunk) == 718);
+    FreeChunk(chunk);
+}
+
+MU_TEST(test_chunk_seek) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+    for (int e = 0; e < 2; e++) {
+        Chunk *chunk = NewChunk(100, encodings[e]);
+        Sample sample;
+        int i, result;
+        for (i = 0; i < 100; i++) {
+            sample.timestamp = 100 + i * 10;
+            sample.data = i;
+            chunk = addSample(chunk, sample, &result);
+        }
+
+        ChunkIterator iter = NewChunkIterator(chunk);
+        ChunkIteratorSeek(&iter, 205, 250);
+        for (i = 11; i <= 15; i++) {
+            mu_check(ChunkIteratorGetNext(&iter, &sample) == 1);
+            mu_check(sample.timestamp == 100 + i * 10);
+            mu_check(sample.data == i);
+        }
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 0);
+
+        iter = NewChunkIterator(chunk);
+        ChunkIteratorSeek(&iter, 0, 100);
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 1 && sample.timestamp == 100);
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 0);
+
+        iter = NewChunkIterator(chunk);
+        ChunkIteratorSeek(&iter, 1090, 5000);
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 1 && sample.timestamp == 1090);
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 0);
+
+        iter = NewChunkIterator(chunk);
+        ChunkIteratorSeek(&iter, 1091, 5000);
+        mu_check(ChunkIteratorGetNext(&iter, &sample) == 0);
+        FreeChunk(chunk);
+    }
+}
+
+MU_TEST(test_series_query) {
+    Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    Sample sample;
+    int i;
+    for (i = 0; i < 1000; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i * 2, i) == TSDB_OK);
+    }
+    mu_check(series->chunkCount == 100);
+
+    // the query should start straight from the chunk that holds the range start
+    SeriesIterator iterator = SeriesQuery(series, 1501, 1600);
+    mu_check(ChunkGetFirstTimestamp(iterator.currentChunk) == 1500);
+    for (i = 251; i <= 300; i++) {
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1);
+        mu_check(sample.timestamp == 1000 + i * 2);
+        mu_check(sample.data == i);
+    }
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+
+    iterator = SeriesQuery(series, 0, 1003);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 1000);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 1002);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+
+    iterator = SeriesQuery(series, 5000, 6000);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+    FreeSeries(series);
+}
+
+MU_TEST(test_chunk_summary) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+    for (int e = 0; e < 2; e++) {
+        Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, encodings[e]);
+        int i;
+        for (i = 0; i < 95; i++) {
+            mu_check(SeriesAddSample(series, 1000 + i, (i * 37) % 11 - 5.5) == TSDB_OK);
+        }
+
+        Chunk *chunk = series->firstChunk->nextChunk;
+        mu_check(ChunkIsSealed(chunk));
+        mu_check(!ChunkIsSealed(series->lastChunk));
+        double min = 100, max = -100, sum = 0;
+        for (i = 10; i < 20; i++) {
+            double value = (i * 37) % 11 - 5.5;
+            if (value < min) min = value;
+            if (value > max) max = value;
+            sum += value;
+        }
+        mu_assert_double_eq(min, chunk->summary.min);
+        mu_assert_double_eq(max, chunk->summary.max);
+        mu_assert_double_eq(sum, chunk->summary.sum);
+        mu_assert_double_eq((10 * 37) % 11 - 5.5, chunk->summary.first);
+        mu_assert_double_eq((19 * 37) % 11 - 5.5, chunk->summary.last);
+        mu_check(chunk->summary.count == 10);
+
+        // only chunks that the range covers entirely and that weren't read yet can be skipped
+        SeriesIterator iterator = SeriesQuery(series, 1005, 1094);
+        Sample sample;
+        mu_check(SeriesIteratorPeekWholeChunk(&iterator) == NULL);
+        for (i = 5; i < 10; i++) {
+            mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 1000 + i);
+        }
+        mu_check(SeriesIteratorPeekWholeChunk(&iterator) == NULL);
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 1010);
+        iterator = SeriesQuery(series, 1010, 1094);
+        mu_check(SeriesIteratorPeekWholeChunk(&iterator) == chunk);
+        SeriesIteratorSkipChunk(&iterator);
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 1020);
+        // the last chunk is still open
+        iterator = SeriesQuery(series, 1090, 1094);
+        mu_check(SeriesIteratorPeekWholeChunk(&iterator) == NULL);
+        FreeSeries(series);
+    }
+}
+
+MU_TEST(test_series_load_chunks) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+    for (int e = 0; e < 2; e++) {
+        Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, encodings[e]);
+        Series *loaded = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, encodings[e]);
+        Sample sample;
+        int i;
+        for (i = 0; i < 25; i++) {
+            mu_check(SeriesAddSample(series, 1000 + i, i * 1.5) == TSDB_OK);
+        }
+        // copy the chunks the way the rdb saves and loads them
+        for (Chunk *chunk = series->firstChunk; chunk != NULL; chunk = chunk->nextChunk) {
+            Chunk *copy = ChunkFromBuffer((const char *)chunk, ChunkBlockSize(chunk), FALSE);
+            mu_check(copy != NULL);
+            SeriesLoadChunk(loaded, copy);
+        }
+        mu_check(ChunkFromBuffer((const char *)series->firstChunk, ChunkBlockSize(series->firstChunk) - 1, FALSE) == NULL);
+        loaded->lastValue = series->lastValue;
+        mu_check(loaded->chunkCount == 3);
+        mu_check(loaded->lastTimestamp == 1024);
+        mu_check(ChunkIsSealed(loaded->firstChunk) && !ChunkIsSealed(loaded->lastChunk));
+
+        // the open chunk can still be written to, including overriding its last sample
+        mu_check(SeriesAddSample(loaded, 1024, 100) == TSDB_OK);
+        for (i = 25; i < 40; i++) {
+            mu_check(SeriesAddSample(loaded, 1000 + i, i * 1.5) == TSDB_OK);
+        }
+        SeriesIterator iterator = SeriesQuery(loaded, 0, 2000);
+        for (i = 0; i < 40; i++) {
+            mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1);
+            mu_check(sample.timestamp == 1000 + i);
+            mu_assert_double_eq(i == 24 ? 100 : i * 1.5, sample.data);
+        }
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+        FreeSeries(series);
+        FreeSeries(loaded);
+    }
+}
+
+static void recordSample(void *privdata, Sample sample) {
+    Sample **next = (Sample **)privdata;
+    **next = sample;
+    (*next)++;
+}
+
+MU_TEST(test_out_of_order_window) {
+    Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    series->oooWindowSecs = 10;
+    Sample added[200];
+    Sample *next = added;
+    Sample sample;
+    int i;
+    // every group of 5 samples arrives reversed
+    for (i = 0; i < 100; i++) {
+        timestamp_t timestamp = 1000 + (i / 5) * 5 + (4 - i % 5);
+        mu_check(SeriesInsertSample(series, timestamp, timestamp * 0.5, recordSample, &next) == TSDB_OK);
+    }
+    // overriding a staged sample
+    mu_check(SeriesInsertSample(series, 1098, 7, recordSample, &next) == TSDB_OK);
+
+    // only the samples that left the window reached the chunks, in order
+    mu_check(series->lastTimestamp == 1089);
+    mu_check(next - added == 90);
+    for (i = 0; i < next - added; i++) {
+        mu_check(added[i].timestamp == 1000 + i);
+    }
+    mu_check(SeriesGetLastTimestamp(series) == 1099);
+    mu_check(SeriesInsertSample(series, 1088, 0, recordSample, &next) == TSDB_ERR_TIMESTAMP_TOO_OLD);
+
+    // reads see the staged samples after the chunks
+    SeriesIterator iterator = SeriesQuery(series, 1085, 1098);
+    for (i = 85; i <= 98; i++) {
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1);
+        mu_check(sample.timestamp == 1000 + i);
+        mu_assert_double_eq(i == 98 ? 7 : (1000 + i) * 0.5, sample.data);
+    }
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+    FreeSeries(series);
+}
+
+MU_TEST(test_retention_run) {
+    Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    RetentionRunStats run;
+    int i;
+    for (i = 0; i < 100; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, i) == TSDB_OK);
+    }
+    size_t chunkSize = ChunkBlockSize(series->firstChunk);
+    // the series expires without getting new samples, only the background run can trim it
+    series->retentionSecs = 10;
+    RetentionRun(RETENTION_BUDGET_US, &run);
+    while (run.seriesChecked > 0 && run.chunksReclaimed == 0) {
+        // a previous run may have stopped in the middle of the series list
+        RetentionRun(RETENTION_BUDGET_US, &run);
+    }
+    mu_check(run.chunksReclaimed == 9);
+    mu_check(run.bytesReclaimed == 9 * chunkSize);
+    mu_check(series->chunkCount == 1 && series->firstChunk == series->lastChunk);
+
+    RetentionStats stats;
+    RetentionGetStats(&stats);
+    mu_check(stats.chunksReclaimed >= 9);
+
+    // a freed series is not visited anymore
+    FreeSeries(series);
+    RetentionRun(RETENTION_BUDGET_US, &run);
+    RetentionRun(RETENTION_BUDGET_US, &run);
+    mu_check(run.chunksReclaimed == 0);
+}
+
+static void *freeSeriesThread(void *series) {
+    FreeSeries(series);
+    return NULL;
+}
+
+MU_TEST(test_rule_open_bucket) {
+    Series *destSeries = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    CompactionRule *rule = NewRule(NULL, 0, TS_AGG_AVG, 10);
+    Sample sample;
+    int i;
+    SeriesSetKeyName(destSeries, "avg_dest", 8);
+    mu_check(RuleRegistryAddRule("avg_dest", 8, rule) == TSDB_OK);
+    SeriesRuleSetDest(rule, destSeries);
+    for (i = 0; i < 25; i++) {
+        SeriesRuleAddSample(rule, destSeries, i, i);
+    }
+    // only the closed buckets were written
+    mu_check(ChunkNumOfSample(destSeries->lastChunk) == 2);
+    mu_check(destSeries->lastTimestamp == 10);
+    mu_check(SeriesGetLastTimestamp(destSeries) == 20);
+
+    // reads add the open bucket
+    SeriesIterator iterator = SeriesQuery(destSeries, 0, 100);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 0);
+    mu_assert_double_eq(4.5, sample.data);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 10);
+    mu_assert_double_eq(14.5, sample.data);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 20);
+    mu_assert_double_eq(22, sample.data);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+    iterator = SeriesQuery(destSeries, 0, 19);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 0);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1 && sample.timestamp == 10);
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+
+    // a series recreated under the name of the destination doesn't read the bucket of the old one,
+    // which the rule drops once it finds the new destination
+    FreeSeries(destSeries);
+    destSeries = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    SeriesSetKeyName(destSeries, "avg_dest", 8);
+    mu_check(SeriesIsEmpty(destSeries));
+    SeriesRuleSetDest(rule, destSeries);
+    mu_check(!rule->bucketOpen && rule->coveredFrom == RULE_COVERAGE_PENDING);
+
+    // a loaded rule didn't look up its destination yet, reads add its open bucket all the same
+    SeriesRuleAddSample(rule, destSeries, 30, 5);
+    rule->destHandle = 0;
+    mu_check(SeriesGetLastTimestamp(destSeries) == 30);
+    mu_assert_double_eq(5, SeriesGetLastValue(destSeries));
+
+    // a source deleted on the main thread writes its open bucket, as TS.DELETERULE does
+    Series *source = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    CompactionRule *sourceRule = SeriesAddRule(source, NULL, 0, TS_AGG_SUM, 10);
+    SeriesRuleSetDest(sourceRule, destSeries);
+    SeriesRuleAddSample(sourceRule, destSeries, 40, 3);
+    SeriesRuleAddSample(sourceRule, destSeries, 41, 4);
+    FreeSeries(source);
+    mu_check(destSeries->lastTimestamp == 40);
+    mu_assert_double_eq(7, destSeries->lastValue);
+
+    // neither does a series whose load failed, nor one freed on the lazy free thread
+    for (int lazy = 0; lazy < 2; lazy++) {
+        source = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+        sourceRule = SeriesAddRule(source, NULL, 0, TS_AGG_SUM, 10);
+        SeriesRuleSetDest(sourceRule, destSeries);
+        SeriesRuleAddSample(sourceRule, destSeries, 50, 3);
+        if (lazy) {
+            pthread_t thread;
+            pthread_create(&thread, NULL, freeSeriesThread, source);
+            pthread_join(thread, NULL);
+        } else {
+            DiscardSeries(source);
+        }
+        mu_check(destSeries->lastTimestamp == 40);
+    }
+
+    // reads can't add more open buckets, the destination takes no more rules
+    CompactionRule *others[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    for (i = 0; i < SERIES_ITERATOR_MAX_OPEN_BUCKETS; i++) {
+        others[i] = NewRule(NULL, 0, TS_AGG_SUM, 10);
+        mu_check(RuleRegistryAddRule("avg_dest", 8, others[i]) ==
+                 (i < SERIES_ITERATOR_MAX_OPEN_BUCKETS - 1 ? TSDB_OK : TSDB_ERROR));
+    }
+    for (i = 0; i < SERIES_ITERATOR_MAX_OPEN_BUCKETS; i++) {
+        FreeRule(others[i]);
+    }
+    FreeRule(rule);
+    FreeSeries(destSeries);
+}
+
+MU_TEST(test_series_memory_stats) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+    SeriesMemoryStats stats;
+    int i;
+    for (int e = 0; e < 2; e++) {
+        Series *series = NewSeries(0, 100, CHUNK_SIZE_BYTES_DEFAULT, encodings[e]);
+        timestamp_t start = time(NULL) - 1000;
+        for (i = 0; i < 1000; i++) {
+            mu_check(SeriesAddSample(series, start + i, i * 1.5) == TSDB_OK);
+        }
+        // overriding the last sample does not count it twice
+        mu_check(SeriesAddSample(series, start + 999, 7) == TSDB_OK);
+
+        size_t blockBytes = 0;
+        for (Chunk *chunk = series->firstChunk; chunk != NULL; chunk = chunk->nextChunk) {
+            blockBytes += ChunkBlockSize(chunk);
+        }
+        SeriesGetMemoryStats(series, &stats);
+        mu_check(stats.samplesCount == 1000);
+        mu_check(stats.samplesBytes == blockBytes - sizeof(Chunk) * series->chunkCount);
+        mu_check(stats.headerBytes >= sizeof(Series) + sizeof(Chunk) * series->chunkCount);
+        mu_check(stats.rulesBytes == 0);
+        mu_check(SeriesMemUsage(series) == stats.headerBytes + stats.samplesBytes);
+
+        // trimmed chunks leave the totals
+        series->retentionSecs = 500;
+        SeriesTrim(series, NULL);
+        SeriesGetMemoryStats(series, &stats);
+        mu_check(stats.samplesCount < 1000 && stats.samplesCount >= 500);
+        blockBytes = 0;
+        for (Chunk *chunk = series->firstChunk; chunk != NULL; chunk = chunk->nextChunk) {
+            blockBytes += ChunkBlockSize(chunk);
+        }
+        mu_check(stats.samplesBytes == blockBytes - sizeof(Chunk) * series->chunkCount);
+
+        // the rule keeps a copy of the destination key, it is freed without a redis context
+        char destKey[] = "dest_max_10";
+        CompactionRule *rule = SeriesAddRule(series, destKey, 11, TS_AGG_MAX, 10);
+        destKey[0] = 'x';
+        mu_check(rule->destKeyLen == 11 && memcmp(rule->destKey, "dest_max_10", 11) == 0);
+        SeriesGetMemoryStats(series, &stats);
+        mu_check(stats.rulesBytes > sizeof(CompactionRule) + 11);
+        FreeSeries(series);
+    }
+}
+
+MU_TEST(test_series_find_rollup) {
+    Series *series = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    Series *destSeries = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    Series *rollupSeries;
+    timestamp_t rollupStart, rollupEnd;
+    int i;
+    mu_check(SeriesAddSample(series, 5, 1) == TSDB_OK);
+    // the rule only sees the samples after it was created, the bucket of 5 is incomplete in the rollup
+    CompactionRule *rule = SeriesAddRule(series, NULL, 0, TS_AGG_SUM, 10);
+    mu_check(rule->coveredFrom == 10);
+    // the destination isn't known until the rule looks it up
+    mu_check(RuleRegistryAddRule("dest", 4, rule) == TSDB_OK);
+    for (i = 6; i < 95; i++) {
+        mu_check(SeriesAddSample(series, i, 1) == TSDB_OK);
+        if (i == 6) {
+            mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+            SeriesRuleSetDest(rule, destSeries);
+        }
+        SeriesRuleAddSample(rule, destSeries, i, 1);
+    }
+
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+    mu_check(rollupStart == 10 && rollupEnd == 90 && rollupSeries == destSeries);
+    // partial buckets at both ends of the range are left to the samples
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 20, 13, 57, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+    mu_check(rollupStart == 20 && rollupEnd == 50);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 20, 13, 25, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    // other aggregations and buckets the rollup doesn't divide can't use it
+    mu_check(SeriesFindRollup(series, TS_AGG_MAX, 30, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 15, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+
+    // nor a destination another rule writes into too
+    Series *other = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    CompactionRule *otherRule = SeriesAddRule(other, NULL, 0, TS_AGG_SUM, 10);
+    mu_check(RuleRegistryAddRule("dest", 4, otherRule) == TSDB_OK);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    FreeSeries(other);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 100, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+
+    // a recreated destination misses the buckets until the next sample
+    FreeSeries(destSeries);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    destSeries = NewSeries(0, 360, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    SeriesRuleSetDest(rule, destSeries);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 30, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    for (i = 95; i < 130; i++) {
+        mu_check(SeriesAddSample(series, i, 1) == TSDB_OK);
+        SeriesRuleAddSample(rule, destSeries, i, 1);
+    }
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 10, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+    mu_check(rollupStart == 100 && rollupEnd == 120);
+
+    // the open bucket aggregates both values of an overridden sample, it is left to the samples
+    mu_check(SeriesAddSample(series, 129, 2) == TSDB_OK);
+    SeriesRuleAddSample(rule, destSeries, 129, 2);
+    mu_check(rule->coveredFrom == 130);
+    for (i = 130; i < 150; i++) {
+        mu_check(SeriesAddSample(series, i, 1) == TSDB_OK);
+        SeriesRuleAddSample(rule, destSeries, i, 1);
+    }
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 10, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+    mu_check(rollupStart == 130 && rollupEnd == 140);
+
+    // a sample written directly into the destination is in the rollup until the next bucket
+    SeriesMarkDestWritten("dest", 4);
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 10, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == NULL);
+    for (i = 150; i < 175; i++) {
+        mu_check(SeriesAddSample(series, i, 1) == TSDB_OK);
+        SeriesRuleAddSample(rule, destSeries, i, 1);
+    }
+    mu_check(SeriesFindRollup(series, TS_AGG_SUM, 10, 0, 200, &rollupStart, &rollupEnd, &rollupSeries) == rule);
+    mu_check(rollupStart == 160 && rollupEnd == 170);
+
+    FreeSeries(series);
+    FreeSeries(destSeries);
+}
+
+MU_TEST(test_series_snapshot) {
+    Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_COMPRESSED);
+    Sample sample;
+    int i;
+    for (i = 0; i < 95; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, i) == TSDB_OK);
+    }
+    mu_check(SeriesChunksInRange(series, 1000, 1094) == 10);
+    mu_check(SeriesChunksInRange(series, 1015, 1034) == 3);
+    // an empty range reads nothing
+    mu_check(SeriesChunksInRange(series, 1050, 1020) == 0);
+
+    SeriesSnapshot *snapshot = NewSeriesSnapshot(series, 1015, 2000);
+    SeriesSnapshot *other = NewSeriesSnapshot(series, 1000, 1009);
+    // the series moves on, trims and goes away while the snapshots are read
+    for (i = 95; i < 200; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, i) == TSDB_OK);
+    }
+    series->retentionSecs = 1;
+    SeriesTrim(series, NULL);
+    FreeSeriesSnapshot(other);
+    FreeSeries(series);
+    // would reuse the blocks of the freed chunks if they weren't kept for the snapshot
+    series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_COMPRESSED);
+    for (i = 0; i < 200; i++) {
+        mu_check(SeriesAddSample(series, i, -1) == TSDB_OK);
+    }
+
+    SeriesIterator iterator = SeriesQuery(&snapshot->series, 1015, 2000);
+    for (i = 15; i < 95; i++) {
+        mu_check(SeriesIteratorGetNext(&iterator, &sample) == 1);
+        mu_check(sample.timestamp == 1000 + i);
+        mu_assert_double_eq(i, sample.data);
+    }
+    mu_check(SeriesIteratorGetNext(&iterator, &sample) == 0);
+    FreeSeriesSnapshot(snapshot);
+    FreeSeries(series);
+}
+
+MU_TEST(test_stats_percentiles) {
+    StatsSummary summary;
+    StatsReset();
+    // 1us to 1ms, one call in ten fails
+    for (int i = 1; i <= 1000; i++) {
+        StatsRecord(STATS_OP_ADD, i * 1000LL, i % 10 == 0);
+    }
+    StatsRecord(STATS_OP_RANGE, 3, FALSE);
+    StatsGetSummary(STATS_OP_ADD, &summary);
+    mu_check(strcmp(summary.name, "ts.add") == 0);
+    mu_check(summary.calls == 1000);
+    mu_check(summary.errors == 100);
+    // the buckets are within 1/16 of the latency
+    mu_check(summary.p50Us >= 500 && summary.p50Us <= 500 * 17 / 16.0);
+    mu_check(summary.p99Us >= 990 && summary.p99Us <= 990 * 17 / 16.0);
+    mu_check(summary.p999Us >= 999 && summary.p999Us <= 999 * 17 / 16.0);
+    mu_assert_double_eq(1000, summary.maxUs);
+    // latencies below the first power of two are exact
+    StatsGetSummary(STATS_OP_RANGE, &summary);
+    mu_check(summary.calls == 1);
+    mu_assert_double_eq(0.003, summary.p50Us);
+    // latencies over the histogram range land in the last bucket
+    StatsRecord(STATS_OP_TRIM, 1LL << 50, FALSE);
+    StatsGetSummary(STATS_OP_TRIM, &summary);
+    mu_check(summary.p50Us >= ((1LL << 40) - 1) / 1000.0);
+    mu_assert_double_eq((1LL << 50) / 1000.0, summary.maxUs);
+
+    StatsReset();
+    StatsGetSummary(STATS_OP_ADD, &summary);
+    mu_check(summary.calls == 0 && summary.errors == 0);
+    mu_assert_double_eq(0, summary.p99Us);
+}
+
+MU_TEST(test_series_chunk_sizing) {
+    size_t uncompressedCapacity = CHUNK_SIZE_BYTES_DEFAULT / (sizeof(double) + sizeof(timestamp_t));
+    // a sample a second fills chunks of the whole size
+    Series *series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    mu_check(series->firstChunk->max_samples == uncompressedCapacity);
+    for (int i = 0; i <= uncompressedCapacity; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, i) == TSDB_OK);
+    }
+    mu_check(series->chunkCount == 2);
+    mu_check(series->lastChunk->max_samples == uncompressedCapacity);
+    FreeSeries(series);
+
+    // a sample an hour gets chunks of a day
+    series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    for (int i = 0; i <= uncompressedCapacity; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i * 3600, i) == TSDB_OK);
+    }
+    mu_check(series->chunkCount == 2);
+    mu_check(series->lastChunk->max_samples == 16);
+    FreeSeries(series);
+
+    // compressed chunks take as many samples as the compression allows
+    series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_COMPRESSED);
+    size_t firstCapacity = series->firstChunk->max_samples;
+    for (int i = 0; i <= firstCapacity; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, 1) == TSDB_OK);
+    }
+    mu_check(series->chunkCount == 2);
+    mu_check(series->lastChunk->max_samples > firstCapacity);
+    FreeSeries(series);
+
+    // maxSamplesPerChunk caps the samples
+    series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_COMPRESSED);
+    mu_check(series->firstChunk->max_samples == 10);
+    FreeSeries(series);
+}
+
+MU_TEST(test_series_lazy_chunks) {
+    SeriesMemoryStats stats;
+    Series *series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    SeriesGetMemoryStats(series, &stats);
+    mu_check(stats.samplesBytes == 0);
+    mu_check(SeriesAddSample(series, 1000, 1) == TSDB_OK);
+    SeriesGetMemoryStats(series, &stats);
+    mu_check(stats.samplesBytes == 8 * (sizeof(double) + sizeof(timestamp_t)));
+    for (int i = 1; i < 100; i++) {
+        mu_check(SeriesAddSample(series, 1000 + i, i) == TSDB_OK);
+    }
+    SeriesGetMemoryStats(series, &stats);
+    mu_check(stats.samplesBytes == 128 * (sizeof(double) + sizeof(timestamp_t)));
+    FreeSeries(series);
+
+    series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_COMPRESSED);
+    SeriesGetMemoryStats(series, &stats);
+    mu_check(stats.samplesBytes == GORILLA_DATA_SIZE(0));
+    FreeSeries(series);
+}
+
+// the block size of the pool class size falls in, 0 when it isn't pooled
+static size_t poolClassSize(size_t size) {
+    ChunkPoolStats before, after;
+    ChunkPoolGetStats(&before);
+    void *block = ChunkPoolAlloc(size);
+    ChunkPoolGetStats(&after);
+    ChunkPoolFree(block, size);
+    return after.usedBytes - before.usedBytes;
+}
+
+MU_TEST(test_chunk_pool_classes) {
+    // nearby sizes share a class and its blocks
+    void *block = ChunkPoolAlloc(1000);
+    ChunkPoolFree(block, 1000);
+    void *other = ChunkPoolAlloc(1010);
+    mu_check(other == block);
+    ChunkPoolFree(other, 1010);
+    mu_check(poolClassSize(1000) == 1024);
+    mu_check(poolClassSize(1025) == 1280);
+    mu_check(poolClassSize(1) == CHUNK_POOL_MIN_BLOCK);
+    mu_check(poolClassSize(CHUNK_POOL_MAX_BLOCK) == CHUNK_POOL_MAX_BLOCK);
+    mu_check(poolClassSize(CHUNK_POOL_MAX_BLOCK + 1) == 0);
+    // every size fits its class and wastes at most a fifth of it
+    for (size_t size = 1; size <= CHUNK_POOL_MAX_BLOCK; size += size / 7 + 1) {
+        size_t blockSize = poolClassSize(size);
+        mu_check(blockSize >= size && (blockSize == CHUNK_POOL_MIN_BLOCK || (blockSize - size) * 5 < blockSize));
+    }
+}
+
+MU_TEST(test_chunk_from_legacy_buffer) {
+    // the chunk header before the sample counts were widened
+    struct {
+        timestamp_t base_timestamp;
+        void *samples;
+        short num_samples;
+        short max_samples;
+        char encoding;
+        char sealed;
+        ChunkSummary summary;
+        Chunk *nextChunk;
+    } legacy;
+    Chunk *chunk = NewChunk(10, CHUNK_UNCOMPRESSED);
+    int result;
+    for (int i = 0; i < 10; i++) {
+        Sample sample = {.timestamp = 100 + i, .data = i};
+        chunk = addSample(chunk, sample, &result);
+        mu_check(result == 1);
+    }
+    ChunkSeal(chunk);
+    size_t samplesLen = ChunkBlockSize(chunk) - sizeof(Chunk);
+    char *buffer = malloc(sizeof(legacy) + samplesLen);
+    memset(&legacy, 0, sizeof(legacy));
+    legacy.base_timestamp = chunk->base_timestamp;
+    legacy.num_samples = chunk->num_samples;
+    legacy.max_samples = chunk->max_samples;
+    legacy.encoding = chunk->encoding;
+    legacy.sealed = chunk->sealed;
+    legacy.summary = chunk->summary;
+    memcpy(buffer, &legacy, sizeof(legacy));
+    memcpy(buffer + sizeof(legacy), chunk + 1, samplesLen);
+
+    Chunk *loaded = ChunkFromBuffer(buffer, sizeof(legacy) + samplesLen, TRUE);
+    mu_check(loaded != NULL);
+    mu_check(ChunkNumOfSample(loaded) == 10);
+    mu_check(ChunkIsSealed(loaded));
+    mu_assert_double_eq(45, loaded->summary.sum);
+    mu_check(ChunkGetFirstTimestamp(loaded) == 100);
+    mu_check(ChunkGetLastTimestamp(loaded) == 109);
+    mu_check(ChunkFromBuffer(buffer, sizeof(legacy) + samplesLen - 1, TRUE) == NULL);
+    // a legacy header with more samples than max_samples or an unknown encoding
+    legacy.num_samples = chunk->max_samples + 1;
+    memcpy(buffer, &legacy, sizeof(legacy));
+    mu_check(ChunkFromBuffer(buffer, sizeof(legacy) + samplesLen, TRUE) == NULL);
+    legacy.num_samples = chunk->num_samples;
+    legacy.encoding = 7;
+    memcpy(buffer, &legacy, sizeof(legacy));
+    mu_check(ChunkFromBuffer(buffer, sizeof(legacy) + samplesLen, TRUE) == NULL);
+    free(buffer);
+    FreeChunk(loaded);
+    FreeChunk(chunk);
+
+    // a compressed legacy block loaded into a recycled pool block that still holds garbage
+    chunk = NewChunk(100, CHUNK_COMPRESSED);
+    for (int i = 0; i < 50; i++) {
+        Sample sample = {.timestamp = 100 + i, .data = i};
+        chunk = addSample(chunk, sample, &result);
+        mu_check(result == 1);
+    }
+    ChunkSeal(chunk);
+    samplesLen = ChunkBlockSize(chunk) - sizeof(Chunk);
+    buffer = malloc(sizeof(legacy) + samplesLen);
+    memset(&legacy, 0, sizeof(legacy));
+    legacy.base_timestamp = chunk->base_timestamp;
+    legacy.num_samples = chunk->num_samples;
+    legacy.max_samples = chunk->max_samples;
+    legacy.encoding = chunk->encoding;
+    legacy.sealed = chunk->sealed;
+    legacy.summary = chunk->summary;
+    memcpy(buffer, &legacy, sizeof(legacy));
+    memcpy(buffer + sizeof(legacy), chunk + 1, samplesLen);
+    void *dirty = ChunkPoolAlloc(sizeof(Chunk) + samplesLen);
+    memset(dirty, 0xff, sizeof(Chunk) + samplesLen);
+    ChunkPoolFree(dirty, sizeof(Chunk) + samplesLen);
+
+    loaded = ChunkFromBuffer(buffer, sizeof(legacy) + samplesLen, TRUE);
+    mu_check(loaded != NULL);
+    mu_check(loaded->allocated_samples == 0 && ChunkBlockSize(loaded) == ChunkBlockSize(chunk));
+    mu_check(ChunkNumOfSample(loaded) == 50);
+    mu_check(ChunkGetLastTimestamp(loaded) == 149);
+    free(buffer);
+    FreeChunk(loaded);
+    FreeChunk(chunk);
+}
+
+// copies the block of the chunk, lets the caller corrupt its header and loads it back
+static Chunk *loadCorrupted(Chunk *chunk, void (*corrupt)(Chunk *header)) {
+    size_t len = ChunkBlockSize(chunk);
+    char *buffer = malloc(len);
+    memcpy(buffer, chunk, len);
+    corrupt((Chunk *)buffer);
+    Chunk *loaded = ChunkFromBuffer(buffer, len, FALSE);
+    free(buffer);
+    return loaded;
+}
+
+static void corruptNumSamples(Chunk *header) { header->num_samples = header->max_samples + 1; }
+static void corruptAllocatedSamples(Chunk *header) { header->allocated_samples = header->max_samples + 1; }
+static void corruptEncoding(Chunk *header) { header->encoding = 7; }
+static void corruptBitCount(Chunk *header) {
+    GorillaData *data = (GorillaData *)(header + 1);
+    data->state.bitCount = data->capacity * 64 + 1;
+}
+static void corruptUndoBitCount(Chunk *header) {
+    GorillaData *data = (GorillaData *)(header + 1);
+    data->undoState.bitCount = data->capacity * 64 + 1;
+}
+static void corruptCapacity(Chunk *header) { ((GorillaData *)(header + 1))->capacity = (size_t)-1 / 8; }
+
+MU_TEST(test_chunk_from_corrupted_buffer) {
+    int encodings[] = {CHUNK_UNCOMPRESSED, CHUNK_COMPRESSED};
+    int i, result;
+    for (int e = 0; e < 2; e++) {
+        Chunk *chunk = NewChunk(100, encodings[e]);
+        for (i = 0; i < 50; i++) {
+            Sample sample = {.timestamp = 100 + i, .data = i};
+            chunk = addSample(chunk, sample, &result);
+            mu_check(result == 1);
+        }
+        mu_check(loadCorrupted(chunk, corruptNumSamples) == NULL);
+        mu_check(loadCorrupted(chunk, corruptEncoding) == NULL);
+        // the first version 6 blocks had padding where allocated_samples is, whatever it holds is ignored
+        Chunk *loaded = loadCorrupted(chunk, corruptAllocatedSamples);
+        mu_check(loaded != NULL && loaded->allocated_samples == chunk->allocated_samples);
+        mu_check(ChunkNumOfSample(loaded) == 50 && ChunkGetLastTimestamp(loaded) == 149);
+        FreeChunk(loaded);
+        if (encodings[e] == CHUNK_COMPRESSED) {
+            mu_check(loadCorrupted(chunk, corruptBitCount) == NULL);
+            mu_check(loadCorrupted(chunk, corruptUndoBitCount) == NULL);
+            mu_check(loadCorrupted(chunk, corruptCapacity) == NULL);
+        }
+        FreeChunk(chunk);
+    }
+
+    // an uncompressed block bigger than max_samples
+    Chunk *chunk = NewChunk(10, CHUNK_UNCOMPRESSED);
+    for (i = 0; i < 10; i++) {
+        Sample sample = {.timestamp = 100 + i, .data = i};
+        chunk = addSample(chunk, sample, &result);
+    }
+    size_t len = ChunkBlockSize(chunk) + sizeof(double) + sizeof(timestamp_t);
+    char *buffer = calloc(1, len);
+    memcpy(buffer, chunk, ChunkBlockSize(chunk));
+    mu_check(ChunkFromBuffer(buffer, len, FALSE) == NULL);
+    free(buffer);
+    FreeChunk(chunk);
+}
+
+MU_TEST(test_series_reverse_query) {
+    Series *series = NewSeries(0, 10, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    series->oooWindowSecs = 5;
+    Sample sample;
+    int i;
+    for (i = 0; i < 1000; i++) {
+        mu_check(SeriesInsertSample(series, 1000 + i * 2, i, NULL, NULL) == TSDB_OK);
+    }
+    // the newest samples are still staged
+    mu_check(series->stagedCount > 0);
+
+    // the same samples as the forward query, newest first
+    api_timestamp_t ranges[][2] = {{0, 5000}, {1501, 1600}, {2990, 2998}, {1000, 1000}, {0, 999}, {3000, 4000}};
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        Sample forward[1000];
+        int count = 0;
+        SeriesIterator iterator = SeriesQuery(series, ranges[r][0], ranges[r][1]);
+        while (SeriesIteratorGetNext(&iterator, &forward[count]) != 0) {
+            count++;
+        }
+        SeriesReverseIterator reverse = SeriesReverseQuery(series, ranges[r][0], ranges[r][1]);
+        for (i = count - 1; i >= 0; i--) {
+            mu_check(SeriesReverseIteratorGetNext(&reverse, &sample) == 1);
+            mu_check(sample.timestamp == forward[i].timestamp);
+            mu_check(sample.data == forward[i].data);
+        }
+        mu_check(SeriesReverseIteratorGetNext(&reverse, &sample) == 0);
+        FreeSeriesReverseIterator(&reverse);
+    }
+
+    // the newest samples are read starting from the chunk that holds the end of the range
+    SeriesReverseIterator reverse = SeriesReverseQuery(series, 0, 1505);
+    mu_check(SeriesReverseIteratorGetNext(&reverse, &sample) == 1 && sample.timestamp == 1504);
+    mu_check(reverse.chunkPosition == series->chunkIndexStart + 25);
+    FreeSeriesReverseIterator(&reverse);
+    FreeSeries(series);
+}
+
+static Series *newLabeledSeries(const char *host, const char *dc) {
+    Series *series = NewSeries(0, 0, CHUNK_SIZE_BYTES_DEFAULT, CHUNK_UNCOMPRESSED);
+    Label *labels = malloc(sizeof(Label) * 2);
+    labels[0].name = strdup("host");
+    labels[0].value = strdup(host);
+    labels[1].name = strdup("dc");
+    labels[1].value = strdup(dc);
+    SeriesSetLabels(series, labels, 2);
+    return series;
+}
+
+static size_t queryLabels(const char **filterStrs, size_t filtersCount, Series ***result) {
+    LabelFilter filters[4];
+    size_t resultCount;
+    for (size_t i = 0; i < filtersCount; i++) {
+        ParseLabelFilter(filterStrs[i], strlen(filterStrs[i]), &filters[i]);
+    }
+    LabelIndexMatch *matches = LabelIndexQuery(filters, filtersCount, &resultCount);
+    *result = malloc(sizeof(Series *) * (resultCount > 0 ? resultCount : 1));
+    for (size_t i = 0; i < resultCount; i++) {
+        (*result)[i] = matches[i].series;
+    }
+    FreeLabelIndexMatches(matches, resultCount);
+    for (size_t i = 0; i < filtersCount; i++) {
+        FreeLabelFilter(&filters[i]);
+    }
+    return resultCount;
+}
+
+MU_TEST(test_label_index) {
+    Series *web1 = newLabeledSeries("web1", "us");
+    Series *web2 = newLabeledSeries("web2", "eu");
+    Series *db1 = newLabeledSeries("db1", "eu");
+    Series **result;
+
+    const char *exact[] = {"host=web1"};
+    mu_check(queryLabels(exact, 1, &result) == 1 && result[0] == web1);
+    free(result);
+    const char *glob[] = {"host=web*"};
+    mu_check(queryLabels(glob, 1, &result) == 2 && result[0] == web1 && result[1] == web2);
+    free(result);
+    const char *intersection[] = {"host=web*", "dc=eu"};
+    mu_check(queryLabels(intersection, 2, &result) == 1 && result[0] == web2);
+    free(result);
+    const char *negated[] = {"dc=eu", "host!=web*"};
+    mu_check(queryLabels(negated, 2, &result) == 1 && result[0] == db1);
+    free(result);
+    const char *missing[] = {"rack=1"};
+    mu_check(queryLabels(missing, 1, &result) == 0);
+    free(result);
+
+    FreeSeries(web2);
+    const char *eu[] = {"dc=eu"};
+    mu_check(queryLabels(eu, 1, &result) == 1 && result[0] == db1);
+    free(result);
+
+    // the key names of the matches outlive the series
+    LabelFilter filter;
+    size_t matchesCount;
+    SeriesSetKeyName(db1, "db1", 3);
+    mu_check(ParseLabelFilter("dc=eu", 5, &filter) == TSDB_OK);
+    LabelIndexMatch *matches = LabelIndexQuery(&filter, 1, &matchesCount);
+    FreeLabelFilter(&filter);
+    mu_check(matchesCount == 1 && matches[0].series == db1 && matches[0].labelIndexId == db1->labelIndexId);
+    FreeSeries(web1);
+    FreeSeries(db1);
+    mu_check(matches[0].keyNameLen == 3 && memcmp(matches[0].keyName, "db1", 3) == 0);
+    FreeLabelIndexMatches(matches, matchesCount);
+    mu_check(queryLabels(eu, 1, &result) == 0);
+    free(result);
+
+    mu_check(ParseLabelFilter("dc!=eu", 6, &filter) == TSDB_OK);
+    mu_check(filter.negate && !filter.glob && strcmp(filter.name, "dc") == 0 && strcmp(filter.value, "eu") == 0);
+    FreeLabelFilter(&filter);
+    mu_check(ParseLabelFilter("dc", 2, &filter) == TSDB_ERROR);
+    mu_check(ParseLabelFilter("=eu", 3, &filter) == TSDB_ERROR);
+    mu_check(ParseLabelFilter("!=eu", 4, &filter) == TSDB_ERROR);
+    mu_check(ParseLabelFilter("dc=", 3, &filter) == TSDB_ERROR);
+    mu_check(LabelIsValid("host", 4, "web1", 4));
+    mu_check(!LabelIsValid("ho=st", 5, "web1", 4));
+}
+
 MU_TEST_SUITE(test_suite) {
 	MU_RUN_TEST(test_valid_policy);
 	MU_RUN_TEST(test_invalid_policy);
 	MU_RUN_TEST(test_StringLenAggTypeToEnum);
+	MU_RUN_TEST(test_compressed_chunk);
+	MU_RUN_TEST(test_aggregation_append_values);
+	MU_RUN_TEST(test_uncompressed_chunk_columns);
+	MU_RUN_TEST(test_chunk_seek);
+	MU_RUN_TEST(test_series_query);
+	MU_RUN_TEST(test_chunk_summary);
+	MU_RUN_TEST(test_series_load_chunks);
+	MU_RUN_TEST(test_out_of_order_window);
+	MU_RUN_TEST(test_retention_run);
+	MU_RUN_TEST(test_rule_open_bucket);
+	MU_RUN_TEST(test_series_memory_stats);
+	MU_RUN_TEST(test_series_find_rollup);
+	MU_RUN_TEST(test_series_snapshot);
+	MU_RUN_TEST(test_stats_percentiles);
+	MU_RUN_TEST(test_series_chunk_sizing);
+	MU_RUN_TEST(test_chunk_from_legacy_buffer);
+	MU_RUN_TEST(test_chunk_from_corrupted_buffer);
+	MU_RUN_TEST(test_chunk_pool_classes);
+	MU_RUN_TEST(test_series_lazy_chunks);
+	MU_RUN_TEST(test_label_index);
+	MU_RUN_TEST(test_series_reverse_query);
 }
 
 int main(int argc, char *argv[]) {
     RMUTil_InitAlloc();
+    RuleRegistrySetMainThread();
     MU_RUN_SUITE(test_suite);
 	MU_REPORT();
 	return 0;
@@ -4,11 +4,15 @@ import time
 from rmtest import ModuleTestCase
 import __builtin__
 import math
+import struct
 
 
 class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
     def _get_ts_info(self, redis, key):
-        info = redis.execute_command('TS.INFO', key)
+        return self._get_ts_info_reply(redis.execute_command('TS.INFO', key))
+
+    @staticmethod
+    def _get_ts_info_reply(info):
         return dict([(info[i], info[i+1]) for i in range(0, len(info), 2)])
 
     @staticmethod
@@ -58,14 +62,7 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
         :param calc_func: function that calculates the wanted rule, for example min/sum/avg
         :return: the values of the series after downsampling
         """
-        series = []
-        for i in range(1, int(math.ceil(len(values) / float(bucket_size)))):
-            curr_bucket_size = bucket_size
-            # we don't have enough values for a full bucket anymore
-            if (i + 1) * bucket_size > len(values):
-                curr_bucket_size = len(values) - i
-            series.append(calc_func(values[i * bucket_size: i * bucket_size + curr_bucket_size]))
-        return series
+        return [calc_func(values[i:i + bucket_size]) for i in range(0, len(values), bucket_size)]
 
     def calc_rule(self, rule, values, bucket_size):
         """
@@ -112,6 +109,29 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             actual_result = r.execute_command('TS.range', 'tester', start_ts, start_ts + samples_count)
             assert expected_result == actual_result
 
+    def test_rdb_compressed_chunks(self):
+        start_ts = 1511885909L
+        samples_count = 1000
+        values = [i % 13 * 0.5 for i in range(samples_count)]
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 100, 'COMPRESSED')
+            self._insert_data(r, 'tester', start_ts, samples_count, values)
+            data = r.execute_command('dump', 'tester')
+            r.execute_command('DEL', 'tester')
+
+            r.execute_command('RESTORE', 'tester', 0, data)
+            info = self._get_ts_info(r, 'tester')
+            assert info['chunkCount'] == 10
+            assert info['lastTimestamp'] == start_ts + samples_count - 1
+            # the restored open chunk keeps taking samples
+            assert r.execute_command('TS.ADD', 'tester', start_ts + samples_count - 1, 100)
+            assert r.execute_command('TS.ADD', 'tester', start_ts + samples_count, 7)
+            values[-1] = 100
+            values.append(7)
+            expected_result = [[start_ts + i, values[i]] for i in range(samples_count + 1)]
+            actual_result = r.execute_command('TS.RANGE', 'tester', start_ts, start_ts + samples_count)
+            assert expected_result == [[ts, float(value)] for ts, value in actual_result]
+
     def test_rdb_aggregation_context(self):
         """
         Check that the aggregation context of the rules is saved in rdb. Write data with not a full bucket,
@@ -145,6 +165,96 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             actual_result_min = r.execute_command('TS.range', 'tester_agg_min_3', start_ts, start_ts + samples_count)
             assert actual_result_min == expected_result_min
 
+    def test_compressed_series(self):
+        start_ts = 1511885909L
+        samples_count = 1000
+        values = [i % 13 * 0.5 for i in range(samples_count)]
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 360, 'COMPRESSED')
+            assert self._get_ts_info(r, 'tester')['chunkEncoding'] == 'compressed'
+            self._insert_data(r, 'tester', start_ts, samples_count, values)
+            # overriding the last sample
+            assert r.execute_command('TS.ADD', 'tester', start_ts + samples_count - 1, 100)
+            values[-1] = 100
+
+            expected_result = [[start_ts + i, values[i]] for i in range(samples_count)]
+            actual_result = r.execute_command('TS.RANGE', 'tester', start_ts, start_ts + samples_count)
+            assert [[ts, float(val)] for ts, val in actual_result] == expected_result
+            data = r.execute_command('dump', 'tester')
+
+        with self.redis() as r:
+            r.execute_command('RESTORE', 'tester', 0, data)
+            assert self._get_ts_info(r, 'tester')['chunkEncoding'] == 'compressed'
+            actual_result = r.execute_command('TS.RANGE', 'tester', start_ts, start_ts + samples_count)
+            assert [[ts, float(val)] for ts, val in actual_result] == expected_result
+
+    def test_out_of_order_window(self):
+        start_ts = 1511885900L
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 360, 'OOO_WINDOW', 30)
+            assert r.execute_command('TS.CREATE', 'tester_agg_count_10')
+            assert r.execute_command('TS.CREATERULE', 'tester', 'COUNT', 10, 'tester_agg_count_10')
+            assert self._get_ts_info(r, 'tester')['oooWindowSecs'] == 30
+            # two hosts that report every 2 seconds, one of them 9 seconds behind
+            for i in range(100):
+                assert r.execute_command('TS.ADD', 'tester', start_ts + 2 * i + 10, i)
+                assert r.execute_command('TS.ADD', 'tester', start_ts + 2 * i + 1, i + 0.5)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.ADD', 'tester', start_ts + 1, 0)
+
+            expected_result = sorted([[start_ts + 2 * i + 10, float(i)] for i in range(100)] +
+                                     [[start_ts + 2 * i + 1, i + 0.5] for i in range(100)])
+            actual_result = r.execute_command('TS.RANGE', 'tester', start_ts, start_ts + 300)
+            assert expected_result == [[ts, float(value)] for ts, value in actual_result]
+            # the rule gets the samples in order once they leave the window, so no bucket is split
+            count_result = r.execute_command('TS.RANGE', 'tester_agg_count_10', 0, start_ts + 300)
+            assert count_result[0] == [start_ts, '5']
+            assert all(count == '10' for _, count in count_result[1:-1])
+            # samples up to start_ts + 178 left the window
+            assert count_result[-1] == [start_ts + 170, '9']
+
+    def test_background_retention(self):
+        now = int(time.time())
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 3, 2)
+            for i in range(6):
+                assert r.execute_command('TS.ADD', 'tester', now - 2 + i, i)
+            assert self._get_ts_info(r, 'tester')['chunkCount'] == 3
+            # no samples are added, the background retention trims everything but the last chunk
+            time.sleep(5)
+            assert self._get_ts_info(r, 'tester')['chunkCount'] == 1
+            assert r.execute_command('TS.RANGE', 'tester', 0, now + 10) == [[now + 2, '4'], [now + 3, '5']]
+            stats = self._get_ts_info_reply(r.execute_command('TS.RETENTIONSTATS'))
+            assert stats['runs'] > 0
+            assert stats['chunksReclaimed'] >= 2
+
+    def test_madd(self):
+        start_ts = 1511885909L
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester1')
+            assert r.execute_command('TS.CREATE', 'tester2')
+            assert r.execute_command('TS.CREATE', 'tester2_agg_max_10')
+            assert r.execute_command('TS.CREATERULE', 'tester2', 'MAX', 10, 'tester2_agg_max_10')
+            r.set('not_a_series', 'value')
+
+            result = r.execute_command('TS.MADD', 'tester1', start_ts, 1, 'tester2', start_ts, 2,
+                                       'tester1', start_ts + 1, 3, 'tester1', start_ts - 1, 4,
+                                       'not_a_series', start_ts, 5, 'tester2', start_ts + 1, 'nan-value')
+            assert result[0] == 'OK'
+            assert result[1] == 'OK'
+            assert result[2] == 'OK'
+            assert isinstance(result[3], redis.ResponseError)
+            assert isinstance(result[4], redis.ResponseError)
+            assert isinstance(result[5], redis.ResponseError)
+
+            assert r.execute_command('TS.RANGE', 'tester1', 0, start_ts + 10) == [[start_ts, '1'], [start_ts + 1, '3']]
+            assert r.execute_command('TS.RANGE', 'tester2', 0, start_ts + 10) == [[start_ts, '2']]
+            assert r.execute_command('TS.RANGE', 'tester2_agg_max_10', 0, start_ts + 10) == \
+                   [[start_ts - start_ts % 10, '2']]
+
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MADD', 'tester1', start_ts + 2)
+
     def test_sanity_pipeline(self):
         start_ts = 1488823384L
         samples_count = 500
@@ -180,6 +290,32 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             actual_result = r.execute_command('TS.range', 'tester', start_ts, start_ts + 500, 'count', 500)
             assert expected_result == actual_result
 
+    def test_range_agg_over_whole_chunks(self):
+        """
+        Buckets that cover whole chunks are aggregated from the chunk summaries, they should match
+        aggregating the samples one by one
+        """
+        samples_count = 1000
+        bucket_size = 300
+        values = [(i * 37) % 11 * 0.5 for i in range(samples_count)]
+        aggregations = {'avg': lambda x: float(sum(x)) / len(x), 'sum': sum, 'min': min, 'max': max,
+                        'count': len, 'first': lambda x: x[0], 'last': lambda x: x[-1]}
+        with self.redis() as r:
+            for encoding in ['UNCOMPRESSED', 'COMPRESSED']:
+                r.execute_command('DEL', 'tester')
+                args = [0, 10, 'COMPRESSED'] if encoding == 'COMPRESSED' else [0, 10]
+                assert r.execute_command('TS.CREATE', 'tester', *args)
+                self._insert_data(r, 'tester', 0, samples_count, values)
+
+                for agg, calc in aggregations.items():
+                    # the range starts and ends in the middle of a chunk
+                    actual_result = r.execute_command('TS.RANGE', 'tester', 5, 994, agg, bucket_size)
+                    expected_result = [[bucket, calc(values[max(bucket, 5):min(bucket + bucket_size, 995)])]
+                                       for bucket in range(0, samples_count, bucket_size)]
+                    assert [ts for ts, _ in actual_result] == [ts for ts, _ in expected_result]
+                    for (_, actual), (_, expected) in zip(actual_result, expected_result):
+                        assert abs(float(actual) - expected) < 1e-9
+
     def test_compaction_rules(self):
         with self.redis() as r:
             assert r.execute_command('TS.CREATE', 'tester')
@@ -195,7 +331,9 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             assert len(actual_result) == samples_count/10
 
             info_dict = self._get_ts_info(r, 'tester')
-            assert info_dict == {'chunkCount': 2L, 'lastTimestamp': start_ts + samples_count -1, 'maxSamplesPerChunk': 360L, 'retentionSecs': 0L, 'rules': [['tester_agg_max_10', 10L, 'AVG']]}
+            for memory_key in ['headerBytes', 'samplesBytes', 'rulesBytes', 'bytesPerSample']:
+                assert float(info_dict.pop(memory_key)) > 0
+            assert info_dict == {'chunkCount': 2L, 'lastTimestamp': start_ts + samples_count -1, 'maxSamplesPerChunk': 0L, 'chunkSizeBytes': 4096L, 'retentionSecs': 0L, 'chunkEncoding': 'uncompressed', 'oooWindowSecs': 0L, 'labels': [], 'rules': [['tester_agg_max_10', 10L, 'AVG']]}
     
     def test_create_compaction_rule_without_dest_series(self):
         with self.redis() as r:
@@ -203,6 +341,19 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             with pytest.raises(redis.ResponseError) as excinfo:
                 assert r.execute_command('TS.CREATERULE', 'tester', 'MAX', 10, 'tester_agg_max_10')
 
+    def test_create_compaction_rule_limit(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester_agg')
+            for i in range(8):
+                assert r.execute_command('TS.CREATE', 'tester{}'.format(i))
+                assert r.execute_command('TS.CREATERULE', 'tester{}'.format(i), 'SUM', 10, 'tester_agg')
+            # reads couldn't add the open bucket of one more rule
+            assert r.execute_command('TS.CREATE', 'tester8')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.CREATERULE', 'tester8', 'SUM', 10, 'tester_agg')
+            assert r.execute_command('TS.DELETERULE', 'tester0', 'tester_agg')
+            assert r.execute_command('TS.CREATERULE', 'tester8', 'SUM', 10, 'tester_agg')
+
     def test_create_compaction_rule_twice(self):
         with self.redis() as r:
             assert r.execute_command('TS.CREATE', 'tester')
@@ -222,6 +373,66 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             samples_count = 500
             self._insert_data(r, 'tester', start_ts, samples_count, 5)
 
+    def test_compaction_dest_series_recreated(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester')
+            assert r.execute_command('TS.CREATE', 'tester_agg_max_10')
+            assert r.execute_command('TS.CREATERULE', 'tester', 'MAX', 10, 'tester_agg_max_10')
+            assert r.execute_command('TS.ADD', 'tester', 10, 1)
+            assert r.execute_command('TS.RANGE', 'tester_agg_max_10', 0, 100) == [[10, '1']]
+
+            # the cached destination must not be used after the key is deleted
+            assert r.delete('tester_agg_max_10')
+            assert r.execute_command('TS.ADD', 'tester', 20, 2)
+            r.set('tester_agg_max_10', 'not a series')
+            assert r.execute_command('TS.ADD', 'tester', 30, 3)
+            assert r.delete('tester_agg_max_10')
+
+            assert r.execute_command('TS.CREATE', 'tester_agg_max_10')
+            assert r.execute_command('TS.ADD', 'tester', 40, 4)
+            assert r.execute_command('TS.RANGE', 'tester_agg_max_10', 0, 100) == [[40, '4']]
+
+            # and the source can go away before its destination
+            assert r.delete('tester')
+            assert r.execute_command('TS.ADD', 'tester_agg_max_10', 50, 5)
+            r.execute_command('FLUSHALL')
+
+    def test_compaction_dest_renamed(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester')
+            assert r.execute_command('TS.CREATE', 'tester_agg_sum_10')
+            assert r.execute_command('TS.CREATERULE', 'tester', 'SUM', 10, 'tester_agg_sum_10')
+            self._insert_data(r, 'tester', 10, 15, 1)
+
+            # the rule writes into what its destination key holds, the renamed series keeps what it had
+            assert r.execute_command('RENAME', 'tester_agg_sum_10', 'renamed')
+            assert r.execute_command('TS.CREATE', 'tester_agg_sum_10')
+            self._insert_data(r, 'tester', 25, 20, 1)
+            assert r.execute_command('TS.RANGE', 'renamed', 0, 100) == [[10, '10']]
+            assert r.execute_command('TS.RANGE', 'tester_agg_sum_10', 0, 100) == [[30, '10'], [40, '5']]
+
+            # both series go away on the lazy free thread while the rule is still registered
+            r.execute_command('FLUSHALL', 'ASYNC')
+            assert r.execute_command('TS.CREATE', 'tester')
+
+    def test_chunk_pool_recycles_chunks(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 10)
+            self._insert_data(r, 'tester', 0, 100, 5)
+            stats = self._get_ts_info_reply(r.execute_command('TS.POOLSTATS'))
+            assert stats['usedBytes'] > 0
+
+            assert r.delete('tester')
+            stats = self._get_ts_info_reply(r.execute_command('TS.POOLSTATS'))
+            assert stats['freeBytes'] > 0
+            hits = stats['hits']
+
+            # the new chunks reuse the blocks of the deleted series
+            assert r.execute_command('TS.CREATE', 'tester', 0, 10)
+            self._insert_data(r, 'tester', 0, 100, 5)
+            stats = self._get_ts_info_reply(r.execute_command('TS.POOLSTATS'))
+            assert stats['hits'] >= hits + 10
+
     def test_delete_rule(self):
         with self.redis() as r:
             assert r.execute_command('TS.CREATE', 'tester')
@@ -235,6 +446,292 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
             assert r.execute_command('TS.DELETERULE', 'tester', 'tester_agg_max_10')
             assert len(self._get_ts_info(r, 'tester')['rules']) == 0
 
+    def test_compaction_open_bucket(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester')
+            assert r.execute_command('TS.CREATE', 'tester_agg_sum_10')
+            assert r.execute_command('TS.CREATERULE', 'tester', 'SUM', 10, 'tester_agg_sum_10')
+            self._insert_data(r, 'tester', 10, 15, 1)
+
+            # the open bucket isn't written yet, but reads see it
+            assert r.execute_command('TS.RANGE', 'tester_agg_sum_10', 0, 100) == [[10, '10'], [20, '5']]
+            assert self._get_ts_info(r, 'tester_agg_sum_10')['lastTimestamp'] == 20
+            # and still do after a restart
+            assert r.execute_command('DEBUG', 'RELOAD')
+            assert r.execute_command('TS.RANGE', 'tester_agg_sum_10', 0, 100) == [[10, '10'], [20, '5']]
+
+            # deleting the rule writes the open bucket to the destination
+            assert r.execute_command('TS.DELETERULE', 'tester', 'tester_agg_sum_10')
+            assert r.execute_command('TS.ADD', 'tester', 25, 1)
+            assert r.execute_command('TS.RANGE', 'tester_agg_sum_10', 0, 100) == [[10, '10'], [20, '5']]
+
+            # so does deleting the source
+            assert r.execute_command('TS.CREATERULE', 'tester', 'SUM', 10, 'tester_agg_sum_10')
+            self._insert_data(r, 'tester', 30, 15, 1)
+            assert r.delete('tester')
+            assert r.execute_command('TS.RANGE', 'tester_agg_sum_10', 0, 100) == \
+                [[10, '10'], [20, '5'], [30, '10'], [40, '5']]
+
+    def test_info_memory(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 100)
+            # an empty series has no sample buffers yet
+            empty_info = self._get_ts_info(r, 'tester')
+            assert empty_info['samplesBytes'] == 0
+            assert float(empty_info['bytesPerSample']) == 0
+            self._insert_data(r, 'tester', 1, 1000, 5)
+
+            # uncompressed samples take a timestamp and a double each
+            info = self._get_ts_info(r, 'tester')
+            assert info['samplesBytes'] == 1000 * 12
+            assert info['rulesBytes'] == 0
+            assert r.execute_command('MEMORY', 'USAGE', 'tester') >= \
+                info['headerBytes'] + info['samplesBytes']
+            assert float(info['bytesPerSample']) * 1000 == \
+                pytest.approx(info['headerBytes'] + info['samplesBytes'])
+
+    def test_range_from_rollup(self):
+        with self.redis() as r:
+            values = [(i * 37) % 101 for i in range(1000)]
+            for key in ['tester', 'tester_raw']:
+                assert r.execute_command('TS.CREATE', key)
+            # the rule misses the start of the data, the rollup only covers what came after it
+            self._insert_data(r, 'tester', 0, 95, values[:95])
+            self._insert_data(r, 'tester_raw', 0, 95, values[:95])
+            for agg in ['sum', 'count', 'avg']:
+                assert r.execute_command('TS.CREATE', 'tester_{}_10'.format(agg))
+                assert r.execute_command('TS.CREATERULE', 'tester', agg, 10, 'tester_{}_10'.format(agg))
+            self._insert_data(r, 'tester', 95, 905, values[95:])
+            self._insert_data(r, 'tester_raw', 95, 905, values[95:])
+
+            # the answer from the rollups is the one of the raw samples
+            for agg, bucket in [('sum', 10), ('sum', 60), ('count', 30), ('avg', 10), ('avg', 20)]:
+                for start_ts, end_ts in [(0, 1000), (13, 987), (200, 205), (90, 999)]:
+                    assert r.execute_command('TS.RANGE', 'tester', start_ts, end_ts, agg, bucket) == \
+                        r.execute_command('TS.RANGE', 'tester_raw', start_ts, end_ts, agg, bucket)
+
+            # neither an overridden sample nor one written directly into a rollup get into the answer
+            for key in ['tester', 'tester_raw']:
+                assert r.execute_command('TS.ADD', key, 999, 1000)
+                assert r.execute_command('TS.ADD', key, 1005, 1)
+            assert r.execute_command('TS.RANGE', 'tester', 0, 1010, 'sum', 10) == \
+                r.execute_command('TS.RANGE', 'tester_raw', 0, 1010, 'sum', 10)
+            assert r.execute_command('TS.ADD', 'tester_sum_10', 995, 1000)
+            assert r.execute_command('TS.RANGE', 'tester', 0, 1010, 'sum', 10) == \
+                r.execute_command('TS.RANGE', 'tester_raw', 0, 1010, 'sum', 10)
+
+    def test_range_limit_paging(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 100)
+            self._insert_data(r, 'tester', 1000, 1000, range(1000))
+            expected_result = r.execute_command('TS.RANGE', 'tester', 0, 5000)
+
+            # page through the range, resuming after the last timestamp of each page
+            pages = []
+            start_ts = 0
+            while True:
+                page = r.execute_command('TS.RANGE', 'tester', start_ts, 5000, 'LIMIT', 333)
+                if not page:
+                    break
+                assert len(page) <= 333
+                pages.extend(page)
+                start_ts = page[-1][0] + 1
+            assert pages == expected_result
+
+            expected_result = r.execute_command('TS.RANGE', 'tester', 0, 5000, 'sum', 30)
+            assert r.execute_command('TS.RANGE', 'tester', 0, 5000, 'sum', 30, 'limit', 5) == expected_result[:5]
+            start_ts = expected_result[4][0] + 30
+            assert r.execute_command('TS.RANGE', 'tester', start_ts, 5000, 'sum', 30, 'LIMIT', 5) == \
+                expected_result[5:10]
+
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'tester', 0, 5000, 'LIMIT', 0)
+
+    def test_range_binary_format(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 100, 'COMPRESSED')
+            self._insert_data(r, 'tester', 1000, 1000, [i * 0.5 for i in range(1000)])
+
+            def unpack(reply):
+                assert len(reply) % 12 == 0
+                values = struct.unpack('<' + 'id' * (len(reply) / 12), reply)
+                return [[values[i], values[i + 1]] for i in range(0, len(values), 2)]
+
+            for args in [[], ['avg', 7], ['LIMIT', 123], ['max', 10, 'LIMIT', 5]]:
+                expected_result = [[ts, float(value)] for ts, value in
+                                   r.execute_command('TS.RANGE', 'tester', 0, 5000, *args)]
+                reply = r.execute_command('TS.RANGE', 'tester', 0, 5000, *(args + ['FORMAT', 'BINARY']))
+                assert unpack(reply) == expected_result
+            assert r.execute_command('TS.RANGE', 'tester', 0, 10, 'FORMAT', 'BINARY') == ''
+            assert unpack(r.execute_command('TS.RANGE', 'tester', 1000, 1001, 'format', 'binary', 'LIMIT', 1)) == \
+                [[1000, 0.0]]
+
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'tester', 0, 5000, 'FORMAT', 'JSON')
+
+    def test_revrange(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 100, 'COMPRESSED', 'OOO_WINDOW', 5)
+            self._insert_data(r, 'tester', 1000, 1000, range(1000))
+            expected_result = r.execute_command('TS.RANGE', 'tester', 0, 5000)
+            assert r.execute_command('TS.REVRANGE', 'tester', 0, 5000) == expected_result[::-1]
+            assert r.execute_command('TS.REVRANGE', 'tester', 1100, 1200) == \
+                r.execute_command('TS.RANGE', 'tester', 1100, 1200)[::-1]
+            assert r.execute_command('TS.REVRANGE', 'tester', 3000, 4000) == []
+
+            # page backwards from the newest sample
+            pages = []
+            end_ts = 5000
+            while True:
+                page = r.execute_command('TS.REVRANGE', 'tester', 0, end_ts, 'LIMIT', 333)
+                if not page:
+                    break
+                assert len(page) <= 333
+                pages.extend(page)
+                end_ts = page[-1][0] - 1
+            assert pages == expected_result[::-1]
+
+            reply = r.execute_command('TS.REVRANGE', 'tester', 0, 5000, 'LIMIT', 2, 'FORMAT', 'BINARY')
+            assert struct.unpack('<idid', reply) == (1999, 999.0, 1998, 998.0)
+
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.REVRANGE', 'tester', 0, 5000, 'avg', 10)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.REVRANGE', 'nokey', 0, 5000)
+
+    def test_chunk_size(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester', 0, 0, 'COMPRESSED', 'CHUNK_SIZE', 1024)
+            assert r.execute_command('TS.CREATE', 'tester_sparse', 'CHUNK_SIZE', 1024, 'OOO_WINDOW', 10)
+            for i in range(5000):
+                r.execute_command('TS.ADD', 'tester', 1000 + i, 5)
+            for i in range(200):
+                r.execute_command('TS.ADD', 'tester_sparse', 1000 + i * 3600, i)
+
+            info = self._get_ts_info(r, 'tester')
+            assert info['chunkSizeBytes'] == 1024
+            # well compressed samples fill chunks of many more samples than 1024 bytes of raw samples hold
+            assert info['chunkCount'] < 5000 / (1024 / 12)
+            assert len(r.execute_command('TS.RANGE', 'tester', 0, 10000)) == 5000
+            info = self._get_ts_info(r, 'tester_sparse')
+            assert info['oooWindowSecs'] == 10
+            assert len(r.execute_command('TS.RANGE', 'tester_sparse', 0, 1000 + 200 * 3600)) == 200
+
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.CREATE', 'tester_invalid', 'CHUNK_SIZE', 0)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.CREATE', 'tester_invalid', 'CHUNK_SIZE', 1024, 0)
+
+    def test_stats(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.STATS', 'RESET') == 'OK'
+            assert r.execute_command('TS.CREATE', 'tester')
+            for i in range(10):
+                assert r.execute_command('TS.ADD', 'tester', 1000 + i, i)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.ADD', 'tester', 'bad', 1)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.RANGE', 'nokey', 0, 100)
+            r.execute_command('TS.RANGE', 'tester', 0, 2000)
+
+            stats = {}
+            for op_stats in r.execute_command('TS.STATS'):
+                op_stats = dict(zip(op_stats[::2], op_stats[1::2]))
+                stats[op_stats['op']] = op_stats
+            assert sorted(stats.keys()) == ['compaction', 'trim', 'ts.add', 'ts.incrby', 'ts.range']
+            assert stats['ts.add']['calls'] == 11
+            assert stats['ts.add']['errors'] == 1
+            assert stats['ts.range']['calls'] == 2
+            assert stats['ts.range']['errors'] == 1
+            assert stats['ts.incrby']['calls'] == 0
+            assert 0 < float(stats['ts.add']['p50Us']) <= float(stats['ts.add']['p99Us']) <= \
+                float(stats['ts.add']['maxUs'])
+
+            assert r.execute_command('TS.STATS', 'RESET') == 'OK'
+            assert all(op_stats[3] == 0 for op_stats in r.execute_command('TS.STATS'))
+
+    def test_mrange_mget(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'web1', 'LABELS', 'host', 'web1', 'dc', 'us')
+            assert r.execute_command('TS.CREATE', 'web2', 0, 'LABELS', 'host', 'web2', 'dc', 'eu')
+            assert r.execute_command('TS.CREATE', 'db1', 'COMPRESSED', 'LABELS', 'host', 'db1', 'dc', 'eu')
+            assert r.execute_command('TS.CREATE', 'web3', 'LABELS', 'host', 'web3', 'dc', 'us')
+            for i in range(10):
+                for key in ['web1', 'web2', 'db1']:
+                    assert r.execute_command('TS.ADD', key, 1000 + i, i)
+            assert self._get_ts_info(r, 'web1')['labels'] == [['host', 'web1'], ['dc', 'us']]
+
+            reply = r.execute_command('TS.MRANGE', 1000, 1009, 'FILTER', 'host=web*', 'dc!=eu')
+            assert [series[0] for series in reply] == ['web1', 'web3']
+            assert reply[0][1] == [['host', 'web1'], ['dc', 'us']]
+            assert len(reply[0][2]) == 10 and reply[1][2] == []
+            reply = r.execute_command('TS.MRANGE', 1000, 1009, 'avg', 5, 'LIMIT', 1, 'FILTER', 'dc=eu')
+            assert [series[0] for series in reply] == ['db1', 'web2']
+            assert [series[2] for series in reply] == [[[1000L, '2']], [[1000L, '2']]]
+
+            reply = r.execute_command('TS.MGET', 'FILTER', 'host=web*')
+            assert reply == [['web1', [['host', 'web1'], ['dc', 'us']], 1009L, '9'],
+                             ['web2', [['host', 'web2'], ['dc', 'eu']], 1009L, '9'],
+                             ['web3', [['host', 'web3'], ['dc', 'us']], None, None]]
+
+            assert r.execute_command('DEL', 'web2')
+            assert [series[0] for series in r.execute_command('TS.MGET', 'FILTER', 'dc=eu')] == ['db1']
+            assert r.execute_command('TS.MGET', 'FILTER', 'host=nope') == []
+
+            with pytest.raises(redis.ResponseError) as excinfo:
+                r.execute_command('TS.MGET', 'FILTER', 'dc!=eu')
+            with pytest.raises(redis.ResponseError) as excinfo:
+                r.execute_command('TS.MRANGE', 1000, 1009, 'FILTER', 'dc')
+            with pytest.raises(redis.ResponseError) as excinfo:
+                r.execute_command('TS.CREATE', 'invalid', 'LABELS', 'host')
+            with pytest.raises(redis.ResponseError) as excinfo:
+                r.execute_command('TS.CREATE', 'invalid', 'LABELS', 'host', 'a', 'host', 'b')
+
+    def test_mrange_mget_renamed(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'web1', 'LABELS', 'host', 'web1')
+            assert r.execute_command('TS.ADD', 'web1', 1000, 1)
+            assert r.execute_command('RENAME', 'web1', 'renamed')
+            # a series under the old name doesn't answer for the renamed one
+            assert r.execute_command('TS.CREATE', 'web1')
+            assert r.execute_command('TS.MGET', 'FILTER', 'host=web1') == []
+
+            # the series has its new name once a command opened it
+            assert r.execute_command('TS.ADD', 'renamed', 1001, 2)
+            assert r.execute_command('TS.MGET', 'FILTER', 'host=web1') == [['renamed', [['host', 'web1']], 1001L, '2']]
+            assert r.execute_command('RENAME', 'renamed', 'again')
+            assert r.execute_command('TS.GET', 'again') == [1001L, '2']
+            reply = r.execute_command('TS.MRANGE', 1000, 1001, 'FILTER', 'host=web1')
+            assert reply == [['again', [['host', 'web1']], [[1000L, '1'], [1001L, '2']]]]
+
+    def test_get_mget_keys(self):
+        with self.redis() as r:
+            assert r.execute_command('TS.CREATE', 'tester1')
+            assert r.execute_command('TS.CREATE', 'tester2', 'OOO_WINDOW', 10)
+            assert r.execute_command('TS.CREATE', 'empty')
+            r.set('string', 'value')
+            self._insert_data(r, 'tester1', 1000, 100, 5)
+            assert r.execute_command('TS.ADD', 'tester2', 1010, 3)
+            # still staged, the newest sample is the one with the highest timestamp
+            assert r.execute_command('TS.ADD', 'tester2', 1005, 2)
+
+            assert r.execute_command('TS.GET', 'tester1') == [1099L, '5']
+            assert r.execute_command('TS.GET', 'tester2') == [1010L, '3']
+            assert r.execute_command('TS.GET', 'empty') == []
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.GET', 'nokey')
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.GET', 'string')
+
+            reply = r.execute_command('TS.MGETKEYS', 'tester1', 'nokey', 'tester2', 'empty', 'string')
+            assert reply[:4] == [[1099L, '5'], None, [1010L, '3'], []]
+            assert isinstance(reply[4], redis.ResponseError)
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MGETKEYS')
+            # TS.MGET only takes filters
+            with pytest.raises(redis.ResponseError):
+                r.execute_command('TS.MGET', 'tester1', 'tester2')
+
     def test_empty_series(self):
         with self.redis() as r:
             assert r.execute_command('TS.CREATE', 'tester')
@@ -332,7 +829,7 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
         1sec (should be the same length as the original series),
         3sec (number of samples is divisible by 10),
         10s (number of samples is not divisible by 10),
-        1000sec (series should be empty since there are not enough samples)
+        1000sec (a single bucket that is still open)
         Insert some data and check that the length, the values and the info of the downsample series are as expected.
         """
         with self.redis() as r:
@@ -355,9 +852,48 @@ class MyTestCase(ModuleTestCase('redis-tsdb-module.so')):
                 for resolution in resolutions:
                     actual_result = r.execute_command('TS.RANGE', 'tester_{}_{}'.format(rule, resolution),
                                                       start_ts, end_ts)
-                    assert len(actual_result) == math.ceil((samples_count - resolution) / float(resolution))
+                    assert len(actual_result) == math.ceil(samples_count / float(resolution))
                     expected_result = self.calc_rule(rule, values, resolution)
                     assert self._get_series_value(actual_result) == expected_result
                     # last time stamp should be the beginning of the last bucket
                     assert self._get_ts_info(r, 'tester_{}_{}'.format(rule, resolution))['lastTimestamp'] == \
                                             (samples_count - 1) - (samples_count - 1) % resolution
+
+
+# the range workers are off by default
+class RangeThreadTestCase(ModuleTestCase('redis-tsdb-module.so', module_args=['RANGE_THREAD_MIN_CHUNKS', '64'])):
+    def test_range_in_background(self):
+        with self.redis() as r:
+            # enough chunks for the query to run on a worker thread
+            assert r.execute_command('TS.CREATE', 'tester', 0, 10)
+            values = [i % 17 for i in range(2000)]
+            MyTestCase._insert_data(r, 'tester', 1000, 2000, values)
+
+            actual_result = r.execute_command('TS.RANGE', 'tester', 0, 5000)
+            assert [[ts, float(value)] for ts, value in actual_result] == \
+                [[1000 + i, values[i]] for i in range(2000)]
+            actual_result = r.execute_command('TS.RANGE', 'tester', 1005, 2994, 'max', 100, 'LIMIT', 3)
+            assert [[ts, float(value)] for ts, value in actual_result] == [[1000, 16], [1100, 16], [1200, 16]]
+
+            # the series keeps taking samples after the background queries
+            assert r.execute_command('TS.ADD', 'tester', 3000, 100)
+            assert r.execute_command('TS.RANGE', 'tester', 0, 5000)[-1] == [3000, '100']
+
+
+class GlobalPolicyTestCase(ModuleTestCase('redis-tsdb-module.so',
+                                          module_args=['COMPACTION_POLICY', 'max:1m', 'RETENTION_POLICY', '0'])):
+    def test_policy_rule_into_full_destination(self):
+        with self.redis() as r:
+            # the keys created by TS.ADD get the rules of the policy and their destinations
+            assert r.execute_command('TS.ADD', 'probe', 10, 1)
+            rules = MyTestCase._get_ts_info_reply(r.execute_command('TS.INFO', 'probe'))['rules']
+            assert len(rules) == 1 and r.exists(rules[0][0])
+
+            # a destination that can't take one more rule is skipped, the key is created without it
+            dest = rules[0][0].replace('probe', 'tester')
+            assert r.execute_command('TS.CREATE', dest)
+            for i in range(8):
+                assert r.execute_command('TS.CREATE', 'source{}'.format(i))
+                assert r.execute_command('TS.CREATERULE', 'source{}'.format(i), 'SUM', 10, dest)
+            assert r.execute_command('TS.ADD', 'tester', 10, 1)
+            assert MyTestCase._get_ts_info_reply(r.execute_command('TS.INFO', 'tester'))['rules'] == []
@@ -1,55 +1,232 @@
 #include <time.h>
 #include <string.h>
 #include "rmutil/logging.h"
-#include "rmutil/strings.h"
 #include "rmutil/alloc.h"
 #include "tsdb.h"
 #include "module.h"
 #include "config.h"
+#include "retention.h"
+#include "stats.h"
 
-Series * NewSeries(int32_t retentionSecs, short maxSamplesPerChunk)
+#define CHUNK_INDEX_INITIAL_CAPACITY 4
+#define STAGED_INITIAL_CAPACITY 8
+// bounds of the samples of a chunk, whatever the chunk size in bytes and the ingest rate say
+#define CHUNK_MIN_SAMPLES 16
+#define CHUNK_MAX_SAMPLES (1 << 16)
+// a chunk is sized for no more than what the series writes in this time, so that sparse series don't keep
+// mostly empty buffers
+#define CHUNK_MAX_SPAN_SECS (24 * 3600)
+
+static void SeriesIndexAppend(Series *series, Chunk *chunk) {
+    size_t end = series->chunkIndexStart + series->chunkCount;
+    if (end == series->chunkIndexCapacity) {
+        if (series->chunkIndexStart > 0) {
+            // reuse the space left by trimmed chunks
+            memmove(series->chunkIndex, series->chunkIndex + series->chunkIndexStart,
+                    sizeof(ChunkIndexEntry) * series->chunkCount);
+            series->chunkIndexStart = 0;
+        }
+        if (series->chunkCount == series->chunkIndexCapacity) {
+            series->chunkIndexCapacity *= 2;
+            series->chunkIndex = realloc(series->chunkIndex, sizeof(ChunkIndexEntry) * series->chunkIndexCapacity);
+        }
+        end = series->chunkIndexStart + series->chunkCount;
+    }
+    series->chunkIndex[end].firstTimestamp = ChunkGetFirstTimestamp(chunk);
+    series->chunkIndex[end].chunk = chunk;
+    series->chunkCount++;
+    series->chunksBytes += ChunkBlockSize(chunk);
+}
+
+static void SeriesIndexPopFront(Series *series) {
+    Chunk *chunk = series->chunkIndex[series->chunkIndexStart].chunk;
+    series->chunksBytes -= ChunkBlockSize(chunk);
+    series->samplesCount -= ChunkNumOfSample(chunk);
+    series->chunkIndexStart++;
+    series->chunkCount--;
+}
+
+// returns the index position of the first chunk that might hold samples newer or equal to timestamp
+static size_t SeriesIndexFind(Series *series, timestamp_t timestamp) {
+    ChunkIndexEntry *entries = series->chunkIndex + series->chunkIndexStart;
+    size_t low = 0, high = series->chunkCount;
+    // find the first chunk that starts after timestamp, the one before it may still contain it
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].firstTimestamp <= timestamp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return series->chunkIndexStart + (low > 0 ? low - 1 : 0);
+}
+
+// the last chunk has run out of space before reaching its sample capacity, replace it with a bigger one
+static Chunk *SeriesGrowLastChunk(Series *series) {
+    series->chunksBytes -= ChunkBlockSize(series->lastChunk);
+    Chunk *newChunk = ChunkGrow(series->lastChunk);
+    series->chunksBytes += ChunkBlockSize(newChunk);
+    size_t lastIndex = series->chunkIndexStart + series->chunkCount - 1;
+    if (series->chunkCount > 1) {
+        series->chunkIndex[lastIndex - 1].chunk->nextChunk = newChunk;
+    } else {
+        series->firstChunk = newChunk;
+    }
+    series->chunkIndex[lastIndex].chunk = newChunk;
+    series->lastChunk = newChunk;
+    return newChunk;
+}
+
+// the sample capacity of the next chunk, sized from what the last chunk of the series holds
+static size_t SeriesNextChunkCapacity(Series *series, Chunk *lastChunk) {
+    size_t capacity;
+    if (lastChunk == NULL || ChunkNumOfSample(lastChunk) < CHUNK_MIN_SAMPLES) {
+        capacity = series->chunkSizeBytes / ChunkEstimatedBytesPerSample(series->chunkEncoding);
+    } else {
+        capacity = series->chunkSizeBytes / ChunkBytesPerSample(lastChunk);
+        timestamp_t span = ChunkGetLastTimestamp(lastChunk) - ChunkGetFirstTimestamp(lastChunk);
+        if (span > 0) {
+            double rateCapacity = (double)(ChunkNumOfSample(lastChunk) - 1) * CHUNK_MAX_SPAN_SECS / span;
+            if (rateCapacity < capacity) {
+                // rounded down to a power of two, the blocks of sparse series share a few pool classes
+                capacity = CHUNK_MIN_SAMPLES;
+                while (capacity * 2 <= rateCapacity) {
+                    capacity *= 2;
+                }
+            }
+        }
+    }
+    if (capacity < CHUNK_MIN_SAMPLES) {
+        capacity = CHUNK_MIN_SAMPLES;
+    } else if (capacity > CHUNK_MAX_SAMPLES) {
+        capacity = CHUNK_MAX_SAMPLES;
+    }
+    if (series->maxSamplesPerChunk > 0 && capacity > series->maxSamplesPerChunk) {
+        capacity = series->maxSamplesPerChunk;
+    }
+    return capacity;
+}
+
+Series * NewSeries(int32_t retentionSecs, size_t maxSamplesPerChunk, size_t chunkSizeBytes, int chunkEncoding)
 {
     Series *newSeries = (Series *)malloc(sizeof(Series));
     newSeries->maxSamplesPerChunk = maxSamplesPerChunk;
-    newSeries->firstChunk = NewChunk(newSeries->maxSamplesPerChunk);
+    newSeries->chunkSizeBytes = chunkSizeBytes;
+    newSeries->chunkEncoding = chunkEncoding;
+    newSeries->firstChunk = NewChunk(SeriesNextChunkCapacity(newSeries, NULL), newSeries->chunkEncoding);
     newSeries->lastChunk = newSeries->firstChunk;
-    newSeries->chunkCount = 1;
+    newSeries->chunkCount = 0;
+    newSeries->chunksBytes = 0;
+    newSeries->samplesCount = 0;
+    newSeries->chunkIndex = malloc(sizeof(ChunkIndexEntry) * CHUNK_INDEX_INITIAL_CAPACITY);
+    newSeries->chunkIndexStart = 0;
+    newSeries->chunkIndexCapacity = CHUNK_INDEX_INITIAL_CAPACITY;
+    SeriesIndexAppend(newSeries, newSeries->firstChunk);
     newSeries->retentionSecs = retentionSecs;
     newSeries->rules = NULL;
     newSeries->lastTimestamp = 0;
     newSeries->lastValue = 0;
+    newSeries->oooWindowSecs = 0;
+    newSeries->stagedTimestamps = NULL;
+    newSeries->stagedValues = NULL;
+    newSeries->stagedCount = 0;
+    newSeries->stagedCapacity = 0;
+    newSeries->keyName = NULL;
+    newSeries->keyNameLen = 0;
+    newSeries->labels = NULL;
+    newSeries->labelsCount = 0;
+    newSeries->labelIndexId = 0;
+    RetentionRegisterSeries(newSeries);
+    RuleRegistryAddSeries(newSeries);
 
     return newSeries;
 }
 
-void SeriesTrim(Series * series) {
+void SeriesLoadChunk(Series *series, Chunk *chunk) {
+    if (series->chunkCount == 1 && ChunkNumOfSample(series->lastChunk) == 0) {
+        // drop the empty chunk the series was created with
+        series->chunksBytes -= ChunkBlockSize(series->firstChunk);
+        FreeChunk(series->firstChunk);
+        series->firstChunk = chunk;
+        series->chunkCount = 0;
+        series->chunkIndexStart = 0;
+    } else {
+        series->lastChunk->nextChunk = chunk;
+    }
+    series->lastChunk = chunk;
+    SeriesIndexAppend(series, chunk);
+    series->samplesCount += ChunkNumOfSample(chunk);
+    if (ChunkNumOfSample(chunk) > 0) {
+        series->lastTimestamp = ChunkGetLastTimestamp(chunk);
+    }
+}
+
+size_t SeriesTrim(Series *series, size_t *bytesFreed) {
+    size_t chunksFreed = 0;
+    if (bytesFreed != NULL) {
+        *bytesFreed = 0;
+    }
     if (series->retentionSecs == 0) {
-        return;
+        return 0;
     }
+    long long startNs = StatsNowNs();
     Chunk *currentChunk = series->firstChunk;
     timestamp_t minTimestamp = time(NULL) - series->retentionSecs;
-    while (currentChunk != NULL)
+    // the last chunk is never trimmed, it is the one that is being written to
+    while (currentChunk != series->lastChunk)
     {
         if (ChunkGetLastTimestamp(currentChunk) < minTimestamp)
         {
             Chunk *nextChunk = currentChunk->nextChunk;
-            if (nextChunk != NULL) {
-                series->firstChunk = nextChunk;    
-            } else {
-                series->firstChunk = NewChunk(series->maxSamplesPerChunk);
+            series->firstChunk = nextChunk;
+            SeriesIndexPopFront(series);
+            if (bytesFreed != NULL) {
+                *bytesFreed += ChunkBlockSize(currentChunk);
             }
-            
-            series->chunkCount--;
             FreeChunk(currentChunk);
+            chunksFreed++;
             currentChunk = nextChunk;
         } else {
             break;
         }
     }
+    // only the trims that reclaimed chunks are recorded, the others are a timestamp check
+    if (chunksFreed > 0) {
+        StatsRecord(STATS_OP_TRIM, StatsNowNs() - startNs, FALSE);
+    }
+    return chunksFreed;
 }
 
-void FreeSeries(void *value) {
-    Series *currentSeries = (Series *) value;
+// writes the open buckets of the rules into the destinations they last wrote to, if those still exist
+static void SeriesWriteOpenBuckets(Series *series) {
+    RuleRegistryLock();
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        Series *destSeries = RuleRegistryGetSeries(rule->destHandle);
+        if (rule->bucketOpen && destSeries != NULL) {
+            SeriesInsertSample(destSeries, rule->bucketStart, rule->aggClass->finalize(rule->aggContext), NULL, NULL);
+            rule->bucketOpen = FALSE;
+        }
+    }
+    RuleRegistryUnlock();
+}
+
+static void SeriesFree(Series *currentSeries, int writeOpenBuckets) {
+    // the rules writing into this series find out it is gone the next time they look up their destination
+    RuleRegistryRemoveSeries(currentSeries);
+    RetentionUnregisterSeries(currentSeries);
+    LabelIndexRemove(currentSeries);
+
+    if (writeOpenBuckets) {
+        SeriesWriteOpenBuckets(currentSeries);
+    }
+    CompactionRule *rule = currentSeries->rules;
+    while (rule != NULL) {
+        CompactionRule *nextRule = rule->nextRule;
+        FreeRule(rule);
+        rule = nextRule;
+    }
+
     Chunk *currentChunk = currentSeries->firstChunk;
     while (currentChunk != NULL)
     {
@@ -57,60 +234,290 @@ void FreeSeries(void *value) {
         FreeChunk(currentChunk);
         currentChunk = nextChunk;
     }
+    free(currentSeries->chunkIndex);
+    free(currentSeries->stagedTimestamps);
+    free(currentSeries->stagedValues);
+    free(currentSeries->keyName);
+    FreeLabels(currentSeries->labels, currentSeries->labelsCount);
+    free(currentSeries);
+}
+
+void FreeSeries(void *value) {
+    // a source deleted by a command completes its open buckets as TS.DELETERULE does. the lazy free thread
+    // holds no redis lock and must not write into the destinations
+    SeriesFree((Series *) value, RuleRegistryOnMainThread());
+}
+
+void DiscardSeries(Series *series) {
+    SeriesFree(series, FALSE);
+}
+
+static size_t RuleMemUsage(CompactionRule *rule) {
+    return sizeof(CompactionRule) + rule->aggClass->contextSize + rule->destKeyLen;
+}
+
+void SeriesGetMemoryStats(Series *series, SeriesMemoryStats *stats) {
+    size_t stagedBytes = (sizeof(timestamp_t) + sizeof(double)) * series->stagedCapacity;
+    stats->headerBytes = sizeof(Series) + sizeof(ChunkIndexEntry) * series->chunkIndexCapacity +
+                         sizeof(Chunk) * series->chunkCount + series->keyNameLen;
+    for (size_t i = 0; i < series->labelsCount; i++) {
+        stats->headerBytes += sizeof(Label) + strlen(series->labels[i].name) + strlen(series->labels[i].value) + 2;
+    }
+    stats->samplesBytes = series->chunksBytes - sizeof(Chunk) * series->chunkCount + stagedBytes;
+    stats->rulesBytes = 0;
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        stats->rulesBytes += RuleMemUsage(rule);
+    }
+    stats->samplesCount = series->samplesCount + series->stagedCount;
 }
 
 size_t SeriesMemUsage(const void *value) {
-    Series *series = (Series *)value;
-    return sizeof(series) + sizeof(Chunk) * series->chunkCount;
+    SeriesMemoryStats stats;
+    SeriesGetMemoryStats((Series *)value, &stats);
+    return stats.headerBytes + stats.samplesBytes + stats.rulesBytes;
 }
 
 int SeriesAddSample(Series *series, api_timestamp_t timestamp, double value) {
     if (timestamp < series->lastTimestamp) {
         return TSDB_ERR_TIMESTAMP_TOO_OLD;
-    } else if (timestamp == series->lastTimestamp) {
-        // this is a hack, we want to override the last sample, so lets ignore it first
-        series->lastChunk->num_samples--;
+    } else if (timestamp == series->lastTimestamp && ChunkNumOfSample(series->lastChunk) > 0) {
+        // we want to override the last sample, so lets drop it first
+        ChunkRemoveLastSample(series->lastChunk);
+        series->samplesCount--;
+        // the rules saw the old value as well, their bucket of it aggregates both
+        for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+            timestamp_t bucketStart = timestamp - timestamp % rule->bucketSizeSec;
+            if (rule->coveredFrom != RULE_COVERAGE_PENDING && rule->coveredFrom <= bucketStart) {
+                rule->coveredFrom = bucketStart + rule->bucketSizeSec;
+            }
+        }
     }
     
     Chunk *currentChunk = series->lastChunk;
     Sample sample = {.timestamp = timestamp, .data = value};
     int ret = ChunkAddSample(currentChunk, sample);
-    if (ret == 0 ) {
+    if (ret == 0 && !ChunkCanGrow(currentChunk)) {
+        // the full chunk won't change anymore, summarize it for the readers
+        ChunkSeal(series->lastChunk);
         // When a new chunk is created trim the series
-        SeriesTrim(series);
+        SeriesTrim(series, NULL);
 
-        Chunk *newChunk = NewChunk(series->maxSamplesPerChunk);
+        Chunk *newChunk = NewChunk(SeriesNextChunkCapacity(series, series->lastChunk), series->chunkEncoding);
         series->lastChunk->nextChunk = newChunk;
         series->lastChunk = newChunk;
-        series->chunkCount++;        
+        SeriesIndexAppend(series, newChunk);
         currentChunk = newChunk;
-        // re-add the sample
+    }
+    if (ret == 0) {
+        // out of buffer space, new chunks have none yet
+        currentChunk = SeriesGrowLastChunk(series);
         ChunkAddSample(currentChunk, sample);
-    } 
+    }
+    if (ChunkNumOfSample(currentChunk) == 1) {
+        // the first sample of the chunk sets its position in the index
+        series->chunkIndex[series->chunkIndexStart + series->chunkCount - 1].firstTimestamp = timestamp;
+    }
+    series->samplesCount++;
     series->lastTimestamp = timestamp;
     series->lastValue = value;
     return TSDB_OK;
 }
 
+// index of the first staged sample newer or equal to timestamp, or newer when inclusive isn't set
+static size_t SeriesStagedSearch(Series *series, timestamp_t timestamp, int inclusive) {
+    size_t low = 0, high = series->stagedCount;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (series->stagedTimestamps[mid] < timestamp ||
+            (!inclusive && series->stagedTimestamps[mid] == timestamp)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void SeriesStageSample(Series *series, timestamp_t timestamp, double value) {
+    size_t index = SeriesStagedSearch(series, timestamp, TRUE);
+    if (index < series->stagedCount && series->stagedTimestamps[index] == timestamp) {
+        // override the staged sample
+        series->stagedValues[index] = value;
+        return;
+    }
+    if (series->stagedCount == series->stagedCapacity) {
+        series->stagedCapacity = series->stagedCapacity ? series->stagedCapacity * 2 : STAGED_INITIAL_CAPACITY;
+        series->stagedTimestamps = realloc(series->stagedTimestamps, sizeof(timestamp_t) * series->stagedCapacity);
+        series->stagedValues = realloc(series->stagedValues, sizeof(double) * series->stagedCapacity);
+    }
+    size_t tail = series->stagedCount - index;
+    memmove(series->stagedTimestamps + index + 1, series->stagedTimestamps + index, sizeof(timestamp_t) * tail);
+    memmove(series->stagedValues + index + 1, series->stagedValues + index, sizeof(double) * tail);
+    series->stagedTimestamps[index] = timestamp;
+    series->stagedValues[index] = value;
+    series->stagedCount++;
+}
+
+int SeriesInsertSample(Series *series, api_timestamp_t timestamp, double value,
+                       SeriesSampleCallback onAdded, void *privdata) {
+    if (series->oooWindowSecs == 0 || timestamp <= series->lastTimestamp) {
+        // samples older than the staged ones go straight to the chunks, which might reject them
+        int ret = SeriesAddSample(series, timestamp, value);
+        if (ret == TSDB_OK && onAdded != NULL) {
+            Sample sample = {.timestamp = timestamp, .data = value};
+            onAdded(privdata, sample);
+        }
+        return ret;
+    }
+
+    SeriesStageSample(series, timestamp, value);
+
+    // write the samples that left the window, they are the oldest ones
+    timestamp_t windowStart = series->stagedTimestamps[series->stagedCount - 1] - series->oooWindowSecs;
+    size_t flushed = 0;
+    while (flushed < series->stagedCount && series->stagedTimestamps[flushed] <= windowStart) {
+        Sample sample = {.timestamp = series->stagedTimestamps[flushed], .data = series->stagedValues[flushed]};
+        SeriesAddSample(series, sample.timestamp, sample.data);
+        if (onAdded != NULL) {
+            onAdded(privdata, sample);
+        }
+        flushed++;
+    }
+    if (flushed > 0) {
+        series->stagedCount -= flushed;
+        memmove(series->stagedTimestamps, series->stagedTimestamps + flushed, sizeof(timestamp_t) * series->stagedCount);
+        memmove(series->stagedValues, series->stagedValues + flushed, sizeof(double) * series->stagedCount);
+    }
+    return TSDB_OK;
+}
+
+// whether an open bucket of a source rule is newer than everything that was written to the series.
+// a bucket that started at the last written timestamp was written by an older version that updated
+// the destination on every sample, the written sample is read until the bucket closes
+static int SeriesIsOpenBucketNewer(Series *series, CompactionRule *rule) {
+    if (!rule->bucketOpen) {
+        return FALSE;
+    }
+    if (series->stagedCount > 0) {
+        return rule->bucketStart > series->stagedTimestamps[series->stagedCount - 1];
+    }
+    return ChunkNumOfSample(series->lastChunk) == 0 || rule->bucketStart > series->lastTimestamp;
+}
+
+// collects the values of the open buckets of the source rules in the range, sorted by timestamp.
+// returns how many there are, up to SERIES_ITERATOR_MAX_OPEN_BUCKETS. the source rules are the ones
+// registered under the key name of the series that wrote into it last, or that didn't look up their
+// destination yet
+static size_t SeriesCollectOpenBuckets(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp,
+                                       timestamp_t *timestamps, double *values) {
+    size_t count = 0;
+    if (series->keyName == NULL) {
+        return 0;
+    }
+    RuleRegistryLock();
+    CompactionRule **rules;
+    size_t rulesCount = RuleRegistryGetRules(series->keyName, series->keyNameLen, &rules);
+    for (size_t r = 0; r < rulesCount; r++) {
+        CompactionRule *rule = rules[r];
+        if ((rule->destHandle != 0 && rule->destHandle != series->handle) || !SeriesIsOpenBucketNewer(series, rule) ||
+            rule->bucketStart < minTimestamp || rule->bucketStart > maxTimestamp) {
+            continue;
+        }
+        size_t i = count++;
+        while (i > 0 && timestamps[i - 1] > rule->bucketStart) {
+            timestamps[i] = timestamps[i - 1];
+            values[i] = values[i - 1];
+            i--;
+        }
+        timestamps[i] = rule->bucketStart;
+        values[i] = rule->aggClass->finalize(rule->aggContext);
+    }
+    RuleRegistryUnlock();
+    return count;
+}
+
+// the newest open bucket of the source rules that is newer than the written samples, FALSE when none is
+static int SeriesNewestOpenBucket(Series *series, timestamp_t *timestamp, double *value) {
+    timestamp_t timestamps[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    double values[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    size_t count = SeriesCollectOpenBuckets(series, INT32_MIN, INT32_MAX, timestamps, values);
+    if (count == 0) {
+        return FALSE;
+    }
+    *timestamp = timestamps[count - 1];
+    *value = values[count - 1];
+    return TRUE;
+}
+
+int SeriesIsEmpty(Series *series) {
+    timestamp_t timestamp;
+    double value;
+    return series->samplesCount == 0 && series->stagedCount == 0 &&
+           !SeriesNewestOpenBucket(series, &timestamp, &value);
+}
+
+timestamp_t SeriesGetLastTimestamp(Series *series) {
+    timestamp_t timestamp;
+    double value;
+    if (SeriesNewestOpenBucket(series, &timestamp, &value)) {
+        return timestamp;
+    }
+    if (series->stagedCount > 0) {
+        return series->stagedTimestamps[series->stagedCount - 1];
+    }
+    return series->lastTimestamp;
+}
+
+double SeriesGetLastValue(Series *series) {
+    timestamp_t timestamp;
+    double value;
+    if (SeriesNewestOpenBucket(series, &timestamp, &value)) {
+        return value;
+    }
+    if (series->stagedCount > 0) {
+        return series->stagedValues[series->stagedCount - 1];
+    }
+    return series->lastValue;
+}
+
 SeriesIterator SeriesQuery(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp) {
     SeriesIterator iter;
     iter.series = series;
-    iter.currentChunk = series->firstChunk;
+    iter.chunkPosition = SeriesIndexFind(series, minTimestamp);
+    iter.currentChunk = series->chunkCount > 0 ? series->chunkIndex[iter.chunkPosition].chunk : NULL;
     iter.chunkIteratorInitialized = FALSE;
     iter.minTimestamp = minTimestamp;
     iter.maxTimestamp = maxTimestamp;
+    iter.stagedIndex = SeriesStagedSearch(series, minTimestamp, TRUE);
+    iter.stagedEnd = SeriesStagedSearch(series, maxTimestamp, FALSE);
+
+    // the open buckets are newer than the written samples, keep them sorted to be read last
+    iter.openBucketIndex = 0;
+    iter.openBucketCount = SeriesCollectOpenBuckets(series, minTimestamp, maxTimestamp, iter.openBucketTimestamps,
+                                                    iter.openBucketValues);
     return iter;
 }
 
-int SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSample) {
-    Sample internalSample;
+// chunks are followed through the index rather than nextChunk, so that a snapshot can hold a part of them
+static void SeriesIteratorNextChunk(SeriesIterator *iterator) {
+    Series *series = iterator->series;
+    iterator->chunkPosition++;
+    if (iterator->chunkPosition < series->chunkIndexStart + series->chunkCount) {
+        iterator->currentChunk = series->chunkIndex[iterator->chunkPosition].chunk;
+    } else {
+        iterator->currentChunk = NULL;
+    }
+    iterator->chunkIteratorInitialized = FALSE;
+}
+
+// positions the chunk iterator on the current chunk that overlaps the range, 0 when there are none left
+static int SeriesIteratorPrepareChunk(SeriesIterator *iterator) {
     while (iterator->currentChunk != NULL)
     {
         Chunk *currentChunk = iterator->currentChunk;
         if (ChunkGetLastTimestamp(currentChunk) < iterator->minTimestamp)
         {
-            iterator->currentChunk = currentChunk->nextChunk;
-            iterator->chunkIteratorInitialized = FALSE;
+            SeriesIteratorNextChunk(iterator);
             continue;
         }
         else if (ChunkGetFirstTimestamp(currentChunk) > iterator->maxTimestamp)
@@ -121,32 +528,263 @@ int SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSample) {
         if (!iterator->chunkIteratorInitialized) 
         {
             iterator->chunkIterator = NewChunkIterator(iterator->currentChunk);
+            ChunkIteratorSeek(&iterator->chunkIterator, iterator->minTimestamp, iterator->maxTimestamp);
             iterator->chunkIteratorInitialized = TRUE;
         }
+        return 1;
+    }
+    return 0;
+}
+
+
+Chunk *SeriesIteratorPeekWholeChunk(SeriesIterator *iterator) {
+    if (!SeriesIteratorPrepareChunk(iterator)) {
+        return NULL;
+    }
+    Chunk *chunk = iterator->currentChunk;
+    if (!ChunkIsSealed(chunk) || iterator->chunkIterator.currentIndex != 0 ||
+        ChunkGetFirstTimestamp(chunk) < iterator->minTimestamp ||
+        ChunkGetLastTimestamp(chunk) > iterator->maxTimestamp) {
+        return NULL;
+    }
+    return chunk;
+}
+
+void SeriesIteratorSkipChunk(SeriesIterator *iterator) {
+    SeriesIteratorNextChunk(iterator);
+}
+
+int SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSample) {
+    while (SeriesIteratorPrepareChunk(iterator)) {
+        // the chunk iterator only returns samples inside the range
+        if (ChunkIteratorGetNext(&iterator->chunkIterator, currentSample) != 0) {
+            return 1;
+        }
+        // reached the end of the chunk
+        SeriesIteratorNextChunk(iterator);
+    }
+    if (iterator->stagedIndex < iterator->stagedEnd) {
+        currentSample->timestamp = iterator->series->stagedTimestamps[iterator->stagedIndex];
+        currentSample->data = iterator->series->stagedValues[iterator->stagedIndex];
+        iterator->stagedIndex++;
+        return 1;
+    }
+    if (iterator->openBucketIndex < iterator->openBucketCount) {
+        currentSample->timestamp = iterator->openBucketTimestamps[iterator->openBucketIndex];
+        currentSample->data = iterator->openBucketValues[iterator->openBucketIndex];
+        iterator->openBucketIndex++;
+        return 1;
+    }
+    return 0;
+}
 
-        if (ChunkIteratorGetNext(&iterator->chunkIterator, &internalSample) == 0) { // reached the end of the chunk
-            iterator->currentChunk = currentChunk->nextChunk;
-            iterator->chunkIteratorInitialized = FALSE;
-            continue;
+int SeriesIteratorGetNextRun(SeriesIterator *iterator, SampleRun *run) {
+    while (SeriesIteratorPrepareChunk(iterator)) {
+        if (ChunkIteratorGetNextRun(&iterator->chunkIterator, run, iterator->runTimestamps,
+                                    iterator->runValues, SERIES_ITERATOR_RUN_SIZE) != 0) {
+            return 1;
         }
+        SeriesIteratorNextChunk(iterator);
+    }
+    if (iterator->stagedIndex < iterator->stagedEnd) {
+        run->timestamps = iterator->series->stagedTimestamps + iterator->stagedIndex;
+        run->values = iterator->series->stagedValues + iterator->stagedIndex;
+        run->count = iterator->stagedEnd - iterator->stagedIndex;
+        iterator->stagedIndex = iterator->stagedEnd;
+        return 1;
+    }
+    if (iterator->openBucketIndex < iterator->openBucketCount) {
+        run->timestamps = iterator->openBucketTimestamps + iterator->openBucketIndex;
+        run->values = iterator->openBucketValues + iterator->openBucketIndex;
+        run->count = iterator->openBucketCount - iterator->openBucketIndex;
+        iterator->openBucketIndex = iterator->openBucketCount;
+        return 1;
+    }
+    return 0;
+}
 
-        if (internalSample.timestamp < iterator->minTimestamp) {
+SeriesReverseIterator SeriesReverseQuery(Series *series, api_timestamp_t minTimestamp,
+                                         api_timestamp_t maxTimestamp) {
+    SeriesReverseIterator iter;
+    iter.series = series;
+    iter.minTimestamp = minTimestamp;
+    iter.maxTimestamp = maxTimestamp;
+    // the chunks newer than maxTimestamp are skipped through the index
+    iter.chunkPosition = series->chunkCount > 0 ? SeriesIndexFind(series, maxTimestamp) + 1 : series->chunkIndexStart;
+    iter.timestamps = NULL;
+    iter.values = NULL;
+    iter.count = 0;
+    iter.decodedTimestamps = NULL;
+    iter.decodedValues = NULL;
+    iter.decodedCapacity = 0;
+    iter.stagedStart = SeriesStagedSearch(series, minTimestamp, TRUE);
+    iter.stagedIndex = SeriesStagedSearch(series, maxTimestamp, FALSE);
+    iter.openBucketIndex = SeriesCollectOpenBuckets(series, minTimestamp, maxTimestamp, iter.openBucketTimestamps,
+                                                    iter.openBucketValues);
+    return iter;
+}
+
+// loads the samples in range of the next older chunk that has any, 0 when there are none left
+static int SeriesReverseIteratorPrepareChunk(SeriesReverseIterator *iterator) {
+    Series *series = iterator->series;
+    while (iterator->count == 0) {
+        if (iterator->chunkPosition == series->chunkIndexStart) {
+            return 0;
+        }
+        Chunk *chunk = series->chunkIndex[--iterator->chunkPosition].chunk;
+        if (ChunkNumOfSample(chunk) == 0 || ChunkGetFirstTimestamp(chunk) > iterator->maxTimestamp) {
             continue;
-        } else if (internalSample.timestamp > iterator->maxTimestamp) {
-            break;
+        }
+        if (ChunkGetLastTimestamp(chunk) < iterator->minTimestamp) {
+            // the older chunks are out of the range too
+            iterator->chunkPosition = series->chunkIndexStart;
+            return 0;
+        }
+        ChunkIterator chunkIterator = NewChunkIterator(chunk);
+        ChunkIteratorSeek(&chunkIterator, iterator->minTimestamp, iterator->maxTimestamp);
+        SampleRun run;
+        if (chunk->encoding != CHUNK_COMPRESSED) {
+            // the columns are read in place
+            if (ChunkIteratorGetNextRun(&chunkIterator, &run, NULL, NULL, 0) != 0) {
+                iterator->timestamps = run.timestamps;
+                iterator->values = run.values;
+                iterator->count = run.count;
+            }
+            continue;
+        }
+        // compressed samples can only be decoded in order, the chunk is decoded once and read backwards
+        if (iterator->decodedCapacity < (size_t)ChunkNumOfSample(chunk)) {
+            iterator->decodedCapacity = ChunkNumOfSample(chunk);
+            iterator->decodedTimestamps = realloc(iterator->decodedTimestamps,
+                                                  sizeof(timestamp_t) * iterator->decodedCapacity);
+            iterator->decodedValues = realloc(iterator->decodedValues, sizeof(double) * iterator->decodedCapacity);
+        }
+        ChunkIteratorGetNextRun(&chunkIterator, &run, iterator->decodedTimestamps, iterator->decodedValues,
+                                iterator->decodedCapacity);
+        iterator->timestamps = iterator->decodedTimestamps;
+        iterator->values = iterator->decodedValues;
+        iterator->count = run.count;
+    }
+    return 1;
+}
+
+int SeriesReverseIteratorGetNext(SeriesReverseIterator *iterator, Sample *currentSample) {
+    if (iterator->openBucketIndex > 0) {
+        iterator->openBucketIndex--;
+        currentSample->timestamp = iterator->openBucketTimestamps[iterator->openBucketIndex];
+        currentSample->data = iterator->openBucketValues[iterator->openBucketIndex];
+        return 1;
+    }
+    if (iterator->stagedIndex > iterator->stagedStart) {
+        iterator->stagedIndex--;
+        currentSample->timestamp = iterator->series->stagedTimestamps[iterator->stagedIndex];
+        currentSample->data = iterator->series->stagedValues[iterator->stagedIndex];
+        return 1;
+    }
+    if (!SeriesReverseIteratorPrepareChunk(iterator)) {
+        return 0;
+    }
+    iterator->count--;
+    currentSample->timestamp = iterator->timestamps[iterator->count];
+    currentSample->data = iterator->values[iterator->count];
+    return 1;
+}
+
+void FreeSeriesReverseIterator(SeriesReverseIterator *iterator) {
+    free(iterator->decodedTimestamps);
+    free(iterator->decodedValues);
+}
+
+size_t SeriesChunksInRange(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp) {
+    if (series->chunkCount == 0 || maxTimestamp < minTimestamp) {
+        return 0;
+    }
+    size_t first = SeriesIndexFind(series, minTimestamp);
+    size_t last = SeriesIndexFind(series, maxTimestamp);
+    return last >= first ? last - first + 1 : 0;
+}
+
+SeriesSnapshot *NewSeriesSnapshot(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp) {
+    SeriesSnapshot *snapshot = calloc(1, sizeof(SeriesSnapshot));
+    Series *copy = &snapshot->series;
+    SeriesIterator iterator = SeriesQuery(series, minTimestamp, maxTimestamp);
+
+    size_t first = iterator.chunkPosition, last = first;
+    size_t end = series->chunkIndexStart + series->chunkCount;
+    while (last < end && series->chunkIndex[last].firstTimestamp <= maxTimestamp) {
+        last++;
+    }
+    copy->chunkCount = last - first;
+    copy->chunkIndexCapacity = copy->chunkCount;
+    copy->chunkIndex = malloc(sizeof(ChunkIndexEntry) * (copy->chunkCount > 0 ? copy->chunkCount : 1));
+    for (size_t i = first; i < last; i++) {
+        ChunkIndexEntry entry = series->chunkIndex[i];
+        if (entry.chunk == series->lastChunk) {
+            // the chunk that is still being written is copied, the sealed ones are shared
+            entry.chunk = snapshot->ownChunk = ChunkClone(entry.chunk);
+        }
+        copy->chunkIndex[i - first] = entry;
+    }
+    if (copy->chunkCount > 0) {
+        copy->firstChunk = copy->chunkIndex[0].chunk;
+        copy->lastChunk = copy->chunkIndex[copy->chunkCount - 1].chunk;
+    }
+
+    // the staged samples and the open buckets in the range become the staged samples of the copy
+    size_t stagedIndex = iterator.stagedIndex, openBucketIndex = 0;
+    copy->stagedCapacity = iterator.stagedEnd - iterator.stagedIndex + iterator.openBucketCount;
+    copy->stagedTimestamps = malloc(sizeof(timestamp_t) * (copy->stagedCapacity > 0 ? copy->stagedCapacity : 1));
+    copy->stagedValues = malloc(sizeof(double) * (copy->stagedCapacity > 0 ? copy->stagedCapacity : 1));
+    while (copy->stagedCount < copy->stagedCapacity) {
+        size_t i = copy->stagedCount++;
+        if (openBucketIndex == iterator.openBucketCount ||
+            (stagedIndex < iterator.stagedEnd &&
+             series->stagedTimestamps[stagedIndex] <= iterator.openBucketTimestamps[openBucketIndex])) {
+            copy->stagedTimestamps[i] = series->stagedTimestamps[stagedIndex];
+            copy->stagedValues[i] = series->stagedValues[stagedIndex++];
         } else {
-            memcpy(currentSample, &internalSample, sizeof(Sample));
-            return 1;
+            copy->stagedTimestamps[i] = iterator.openBucketTimestamps[openBucketIndex];
+            copy->stagedValues[i] = iterator.openBucketValues[openBucketIndex++];
         }
     }
-    return 0;
+
+    copy->retentionSecs = series->retentionSecs;
+    copy->maxSamplesPerChunk = series->maxSamplesPerChunk;
+    copy->chunkSizeBytes = series->chunkSizeBytes;
+    copy->chunkEncoding = series->chunkEncoding;
+    copy->lastTimestamp = series->lastTimestamp;
+    copy->lastValue = series->lastValue;
+    snapshot->readerEpoch = ChunkReadersEnter();
+    return snapshot;
+}
+
+void FreeSeriesSnapshot(SeriesSnapshot *snapshot) {
+    ChunkReadersLeave(snapshot->readerEpoch);
+    if (snapshot->ownChunk != NULL) {
+        FreeChunk(snapshot->ownChunk);
+    }
+    free(snapshot->series.chunkIndex);
+    free(snapshot->series.stagedTimestamps);
+    free(snapshot->series.stagedValues);
+    free(snapshot);
 }
 
-CompactionRule * SeriesAddRule(Series *series, RedisModuleString *destKeyStr, int aggType, long long bucketSize) {
-    CompactionRule *rule = NewRule(destKeyStr, aggType, bucketSize);
+CompactionRule * SeriesAddRule(Series *series, const char *destKey, size_t destKeyLen, int aggType,
+                               long long bucketSize) {
+    CompactionRule *rule = NewRule(destKey, destKeyLen, aggType, bucketSize);
     if (rule == NULL ) {
         return NULL;
     }
+    if (destKey != NULL && RuleRegistryAddRule(destKey, destKeyLen, rule) != TSDB_OK) {
+        FreeRule(rule);
+        return NULL;
+    }
+    if (series->samplesCount == 0) {
+        rule->coveredFrom = 0;
+    } else {
+        // the bucket of the last sample is missing what was written before the rule
+        rule->coveredFrom = series->lastTimestamp - series->lastTimestamp % bucketSize + bucketSize;
+    }
     if (series->rules == NULL){
         series->rules = rule;
     } else {
@@ -169,24 +807,147 @@ int SeriesCreateRulesFromGlobalConfig(RedisModuleCtx *ctx, RedisModuleString *ke
                                             RedisModule_StringPtrLen(keyName, &len),
                                             AggTypeEnumToString(rule->aggType),
                                             rule->bucketSizeSec);
-        RedisModule_RetainString(ctx, destKey);
-        SeriesAddRule(series, destKey, rule->aggType, rule->bucketSizeSec);
+        const char *destKeyStr = RedisModule_StringPtrLen(destKey, &len);
+        if (SeriesAddRule(series, destKeyStr, len, rule->aggType, rule->bucketSizeSec) == NULL) {
+            RM_LOG_WARNING(ctx, "Cannot create compaction rule into key '%s'", destKeyStr);
+            RedisModule_FreeString(ctx, destKey);
+            continue;
+        }
 
         compactedKey = RedisModule_OpenKey(ctx, destKey, REDISMODULE_READ|REDISMODULE_WRITE);
 
         if (RedisModule_KeyType(compactedKey) != REDISMODULE_KEYTYPE_EMPTY) {
-            RM_LOG_WARNING(ctx, "Cannot create compacted key, key '%s' already exists", destKey);
-            RedisModule_CloseKey(compactedKey);
-            continue;
+            RM_LOG_WARNING(ctx, "Cannot create compacted key, key '%s' already exists", destKeyStr);
+        } else {
+            CreateTsKey(ctx, destKey, rule->retentionSizeSec, TSGlobalConfig.maxSamplesPerChunk,
+                        TSGlobalConfig.chunkSizeBytes, series->chunkEncoding,
+                        &compactedSeries, &compactedKey);
         }
-
-        CreateTsKey(ctx, destKey, rule->retentionSizeSec, TSGlobalConfig.maxSamplesPerChunk, &compactedSeries, &compactedKey);
         RedisModule_CloseKey(compactedKey);
+        // the rule keeps its own copy of the name
+        RedisModule_FreeString(ctx, destKey);
     }
     return TSDB_OK;
 }
 
-CompactionRule *NewRule(RedisModuleString *destKey, int aggType, int bucketSizeSec) {
+void SeriesSetKeyName(Series *series, const char *keyName, size_t len) {
+    free(series->keyName);
+    series->keyName = malloc(len);
+    memcpy(series->keyName, keyName, len);
+    series->keyNameLen = len;
+}
+
+void SeriesSetLabels(Series *series, Label *labels, size_t labelsCount) {
+    LabelIndexRemove(series);
+    FreeLabels(series->labels, series->labelsCount);
+    series->labels = labels;
+    series->labelsCount = labelsCount;
+    if (labelsCount > 0) {
+        LabelIndexAdd(series);
+    }
+}
+
+void SeriesMarkDestWritten(const char *keyName, size_t len) {
+    RuleRegistryLock();
+    CompactionRule **rules;
+    size_t rulesCount = RuleRegistryGetRules(keyName, len, &rules);
+    for (size_t i = 0; i < rulesCount; i++) {
+        rules[i]->coveredFrom = RULE_COVERAGE_PENDING;
+    }
+    RuleRegistryUnlock();
+}
+
+void SeriesRuleSetDest(CompactionRule *rule, Series *destSeries) {
+    u_int64_t handle = destSeries != NULL ? destSeries->handle : 0;
+    if (rule->destHandle != 0 && rule->destHandle != handle) {
+        // the open bucket went away with the destination, and a new one would miss what came until then
+        rule->bucketOpen = FALSE;
+        rule->aggClass->resetContext(rule->aggContext);
+        rule->coveredFrom = RULE_COVERAGE_PENDING;
+    }
+    rule->destHandle = handle;
+}
+
+int SeriesRuleNeedsDest(CompactionRule *rule, timestamp_t timestamp) {
+    return !rule->bucketOpen || timestamp - timestamp % rule->bucketSizeSec > rule->bucketStart;
+}
+
+void SeriesRuleAddSample(CompactionRule *rule, Series *destSeries, timestamp_t timestamp, double value) {
+    timestamp_t bucketStart = timestamp - timestamp % rule->bucketSizeSec;
+    if (rule->coveredFrom == RULE_COVERAGE_PENDING) {
+        // older samples of this bucket may never have reached the rule
+        rule->coveredFrom = bucketStart + rule->bucketSizeSec;
+    }
+    if (rule->bucketOpen && bucketStart > rule->bucketStart) {
+        // the bucket is complete, this is the only time it is written
+        SeriesInsertSample(destSeries, rule->bucketStart, rule->aggClass->finalize(rule->aggContext), NULL, NULL);
+        rule->aggClass->resetContext(rule->aggContext);
+        rule->bucketOpen = FALSE;
+    }
+    if (!rule->bucketOpen) {
+        if (bucketStart != destSeries->lastTimestamp) {
+            // unless the context is of a bucket that an older version already started writing
+            rule->aggClass->resetContext(rule->aggContext);
+        }
+        rule->bucketStart = bucketStart;
+        rule->bucketOpen = TRUE;
+    }
+    rule->aggClass->appendValue(rule->aggContext, value);
+}
+
+static long long AlignToBucket(long long timestamp, long long bucketSize) {
+    long long offset = timestamp % bucketSize;
+    return offset < 0 ? timestamp - offset - bucketSize : timestamp - offset;
+}
+
+CompactionRule *SeriesFindRollup(Series *series, int aggType, long long bucketSize, long long start,
+                                 long long end, timestamp_t *rollupStart, timestamp_t *rollupEnd,
+                                 Series **bestDest) {
+    CompactionRule *best = NULL;
+    if (series->rules == NULL || bucketSize <= 0 || ChunkNumOfSample(series->firstChunk) == 0) {
+        return NULL;
+    }
+    timestamp_t firstTimestamp = ChunkGetFirstTimestamp(series->firstChunk);
+    RuleRegistryLock();
+    for (CompactionRule *rule = series->rules; rule != NULL; rule = rule->nextRule) {
+        Series *destSeries = RuleRegistryGetSeries(rule->destHandle);
+        long long ruleBucket = rule->bucketSizeSec;
+        // every rollup bucket has to fold into a single requested bucket, an average only as a whole
+        if (rule->aggType != aggType || bucketSize % ruleBucket != 0 ||
+            (aggType == TS_AGG_AVG && ruleBucket != bucketSize)) {
+            continue;
+        }
+        // the destination has to hold exactly what the rule wrote, no other rule may write into it
+        if (destSeries == NULL || RuleRegistryDestRulesCount(rule) != 1 ||
+            rule->coveredFrom == RULE_COVERAGE_PENDING || !rule->bucketOpen ||
+            ChunkNumOfSample(destSeries->firstChunk) == 0) {
+            continue;
+        }
+        if (best != NULL && best->bucketSizeSec >= ruleBucket) {
+            continue;
+        }
+        // whole buckets the rule has closed, that neither retention has trimmed and that are inside the range
+        long long bounds[] = {ChunkGetFirstTimestamp(destSeries->firstChunk),
+                              AlignToBucket(firstTimestamp + ruleBucket - 1, ruleBucket),
+                              AlignToBucket(start + ruleBucket - 1, ruleBucket)};
+        long long from = rule->coveredFrom;
+        for (int i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+            from = bounds[i] > from ? bounds[i] : from;
+        }
+        long long to = AlignToBucket(end + 1, ruleBucket);
+        to = rule->bucketStart < to ? rule->bucketStart : to;
+        if (from < to) {
+            best = rule;
+            *rollupStart = from;
+            *rollupEnd = to;
+            *bestDest = destSeries;
+        }
+    }
+    RuleRegistryUnlock();
+    return best;
+}
+
+CompactionRule *NewRule(const char *destKey, size_t destKeyLen, int aggType, int bucketSizeSec) {
     if (bucketSizeSec <= 0) {
         return NULL;
     }
@@ -196,17 +957,41 @@ CompactionRule *NewRule(RedisModuleString *destKey, int aggType, int bucketSizeS
     rule->aggType = aggType;
     rule->aggContext = rule->aggClass->createContext();
     rule->bucketSizeSec = bucketSizeSec;
-    rule->destKey = destKey;
+    rule->destKey = NULL;
+    rule->destKeyLen = 0;
+    if (destKey != NULL) {
+        rule->destKey = malloc(destKeyLen);
+        memcpy(rule->destKey, destKey, destKeyLen);
+        rule->destKeyLen = destKeyLen;
+    }
+    rule->destHandle = 0;
+    rule->registryEntry = NULL;
+    rule->bucketOpen = FALSE;
+    rule->bucketStart = 0;
+    rule->coveredFrom = RULE_COVERAGE_PENDING;
 
     rule->nextRule = NULL;
 
     return rule;
 }
 
+void FreeRule(CompactionRule *rule) {
+    RuleRegistryRemoveRule(rule);
+    rule->aggClass->freeContext(rule->aggContext);
+    free(rule->destKey);
+    free(rule);
+}
+
+int RuleHasDestKey(CompactionRule *rule, RedisModuleString *destKey) {
+    size_t len;
+    const char *key = RedisModule_StringPtrLen(destKey, &len);
+    return rule->destKey != NULL && rule->destKeyLen == len && memcmp(rule->destKey, key, len) == 0;
+}
+
 int SeriesHasRule(Series *series, RedisModuleString *destKey) {
     CompactionRule *rule = series->rules;
     while (rule != NULL) {
-        if (RMUtil_StringEquals(rule->destKey, destKey)) {
+        if (RuleHasDestKey(rule, destKey)) {
             return TRUE;
         }
         rule = rule->nextRule;
@@ -5,48 +5,244 @@
 #include "compaction.h"
 #include "consts.h"
 #include "chunk.h"
+#include "label_index.h"
+#include "rule_registry.h"
+
+struct Series;
 
 typedef struct CompactionRule {
-    RedisModuleString *destKey;
+    // a copy of the name, the rule is freed on the lazy free thread where no context is valid
+    char *destKey;
+    size_t destKeyLen;
     int32_t bucketSizeSec;
     AggregationClass *aggClass;
     int aggType;
     void *aggContext;
+    // the bucket that aggContext holds, it is written to the destination once a newer bucket starts
+    int bucketOpen;
+    timestamp_t bucketStart;
+    // the rule has seen every source sample from this bucket on, so the destination can answer range
+    // aggregations from there. RULE_COVERAGE_PENDING until the next sample tells which bucket that is
+    timestamp_t coveredFrom;
     struct CompactionRule *nextRule;
+    // handle of the series destKey held when the rule last looked it up, 0 until then, see rule_registry.h
+    u_int64_t destHandle;
+    // where the rule is indexed under destKey, NULL when it isn't
+    struct RuleRegistryEntry *registryEntry;
 } CompactionRule;
 
+#define RULE_COVERAGE_PENDING INT32_MAX
+
+// entry of the per series chunk index, sorted by the first timestamp of the chunk
+typedef struct ChunkIndexEntry {
+    timestamp_t firstTimestamp;
+    Chunk *chunk;
+} ChunkIndexEntry;
+
 typedef struct Series {
     Chunk *firstChunk;
     Chunk *lastChunk;
     size_t chunkCount;
+    // memory of all the chunk blocks and the samples they hold, kept up to date as chunks come and go
+    size_t chunksBytes;
+    size_t samplesCount;
+    // chunkCount entries starting at chunkIndexStart, trimmed chunks are popped from the front
+    ChunkIndexEntry *chunkIndex;
+    size_t chunkIndexStart;
+    size_t chunkIndexCapacity;
     int32_t retentionSecs;
-    short maxSamplesPerChunk;
+    // the sample buffer of a chunk is sized for chunkSizeBytes at the bytes per sample and the ingest rate
+    // the series had so far, maxSamplesPerChunk caps the samples when set
+    size_t maxSamplesPerChunk;
+    size_t chunkSizeBytes;
+    int chunkEncoding;
     CompactionRule *rules;
     timestamp_t lastTimestamp;
     double lastValue;
+    // samples up to oooWindowSecs older than the newest one are accepted, they are kept sorted in the
+    // staged columns and written to the chunks once they get out of the window. staged samples are all
+    // newer than lastTimestamp, which is the last sample that was written to the chunks
+    int32_t oooWindowSecs;
+    timestamp_t *stagedTimestamps;
+    double *stagedValues;
+    size_t stagedCount;
+    size_t stagedCapacity;
+    // links of the list of all the series, walked by the background retention
+    struct Series *prevSeries;
+    struct Series *nextSeries;
+    // the key the series was created under, NULL for series of older rdb files. a key renamed, restored or
+    // migrated under another name keeps the old one until a command opens it, the multi series queries
+    // skip it until then
+    char *keyName;
+    size_t keyNameLen;
+    Label *labels;
+    size_t labelsCount;
+    // order of the series in the posting lists of the label index, 0 when it isn't indexed
+    u_int64_t labelIndexId;
+    // never reused, the rules writing into the series refer to it by this handle
+    u_int64_t handle;
+    struct Series *nextInRegistry;
 } Series;
 
+// called for every sample that reaches the chunks of the series, in timestamp order
+typedef void (*SeriesSampleCallback)(void *privdata, Sample sample);
+
+// how many samples of a compressed chunk are decoded at a time by SeriesIteratorGetNextRun
+#define SERIES_ITERATOR_RUN_SIZE 128
+// open buckets of source rules an iterator can add, the registry takes no more rules per destination
+#define SERIES_ITERATOR_MAX_OPEN_BUCKETS 8
+
 typedef struct SeriesIterator {
     Series *series;
+    // position of currentChunk in the chunk index of the series
+    size_t chunkPosition;
     Chunk *currentChunk;
     int chunkIteratorInitialized;
     ChunkIterator chunkIterator;
     api_timestamp_t maxTimestamp;
     api_timestamp_t minTimestamp;
+    // the staged samples in the range, they are read after the chunks
+    size_t stagedIndex;
+    size_t stagedEnd;
+    // the open buckets of the source rules in the range, read after the staged samples
+    timestamp_t openBucketTimestamps[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    double openBucketValues[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    size_t openBucketIndex;
+    size_t openBucketCount;
+    timestamp_t runTimestamps[SERIES_ITERATOR_RUN_SIZE];
+    double runValues[SERIES_ITERATOR_RUN_SIZE];
 } SeriesIterator;
 
-Series * NewSeries(int32_t retentionSecs, short maxSamplesPerChunk);
+// reads a range from the newest sample to the oldest: the open buckets, the staged samples, then the chunks
+// from the one holding the end of the range backwards through the chunk index. an uncompressed chunk is read
+// in place and a compressed one is decoded once, so the newest n samples cost n reads plus at most a chunk,
+// however long the series is
+typedef struct SeriesReverseIterator {
+    Series *series;
+    api_timestamp_t minTimestamp;
+    api_timestamp_t maxTimestamp;
+    // one past the position of the next chunk to read in the chunk index
+    size_t chunkPosition;
+    // the samples of the current chunk that are left, read from count - 1 down
+    timestamp_t *timestamps;
+    double *values;
+    size_t count;
+    // the samples of the current compressed chunk
+    timestamp_t *decodedTimestamps;
+    double *decodedValues;
+    size_t decodedCapacity;
+    // the staged samples left are [stagedStart, stagedIndex)
+    size_t stagedStart;
+    size_t stagedIndex;
+    // the open buckets left are [0, openBucketIndex)
+    timestamp_t openBucketTimestamps[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    double openBucketValues[SERIES_ITERATOR_MAX_OPEN_BUCKETS];
+    size_t openBucketIndex;
+} SeriesReverseIterator;
+
+// what a query reads of a series, to be iterated on a background thread while the series keeps changing.
+// the sealed chunks are shared with the series, the chunk that is still being written, the staged samples
+// and the open buckets are copied. the series field only supports SeriesQuery and its iterators
+typedef struct SeriesSnapshot {
+    Series series;
+    // the copy of the chunk that was still being written
+    Chunk *ownChunk;
+    int readerEpoch;
+} SeriesSnapshot;
+
+typedef struct SeriesMemoryStats {
+    // the series, its chunk index, the chunk headers, the key name and the labels
+    size_t headerBytes;
+    // the sample buffers of the chunks and the staged samples
+    size_t samplesBytes;
+    // the rules, their aggregation contexts and destination key names
+    size_t rulesBytes;
+    size_t samplesCount;
+} SeriesMemoryStats;
+
+Series * NewSeries(int32_t retentionSecs, size_t maxSamplesPerChunk, size_t chunkSizeBytes, int chunkEncoding);
+/*
+ * Also the free callback of the redis type. On FLUSHALL ASYNC and FLUSHDB ASYNC redis frees the values
+ * from its lazy free thread, without the redis lock, so the module-wide state FreeSeries updates (label
+ * index, retention registry, rule registry, chunk pool, deferred chunks) has a lock of its own, and it
+ * never touches another series or its rules there. On the main thread the open buckets of the rules are
+ * written to their destinations first.
+ */
 void FreeSeries(void *value);
+// frees a series that never made it to the keyspace, such as one whose load failed. the open buckets of
+// its rules aren't written anywhere
+void DiscardSeries(Series *series);
 size_t SeriesMemUsage(const void *value);
+void SeriesGetMemoryStats(Series *series, SeriesMemoryStats *stats);
+// how many chunks a query of the range would read
+size_t SeriesChunksInRange(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp);
+// needs the redis lock, the snapshot is read and freed without it
+SeriesSnapshot *NewSeriesSnapshot(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp);
+void FreeSeriesSnapshot(SeriesSnapshot *snapshot);
 int SeriesAddSample(Series *series, api_timestamp_t timestamp, double value);
+// frees the chunks that are older than the retention, returns how many were freed.
+// bytesFreed, when not NULL, is set to the memory they took
+size_t SeriesTrim(Series *series, size_t *bytesFreed);
+// adds a sample that may be out of order by up to oooWindowSecs, the samples are passed to SeriesAddSample
+// and to onAdded, which may be NULL, once they leave the window
+int SeriesInsertSample(Series *series, api_timestamp_t timestamp, double value,
+                       SeriesSampleCallback onAdded, void *privdata);
+// the newest sample of the series, including the staged ones and the open buckets of the source rules
+timestamp_t SeriesGetLastTimestamp(Series *series);
+double SeriesGetLastValue(Series *series);
+// whether the series has no sample to report as its newest, written, staged or in an open bucket
+int SeriesIsEmpty(Series *series);
+// appends a whole chunk to the end of the series, used when loading a saved series
+void SeriesLoadChunk(Series *series, Chunk *chunk);
 int SeriesHasRule(Series *series, RedisModuleString *destKey);
-CompactionRule *SeriesAddRule(Series *series, RedisModuleString *destKeyStr, int aggType, long long bucketSize);
+// adds a rule and registers it under the destination key, NULL when the destination can't take one more rule
+CompactionRule *SeriesAddRule(Series *series, const char *destKey, size_t destKeyLen, int aggType,
+                              long long bucketSize);
+// a sample was written directly into the key, the rules writing into it can't answer range aggregations
+// from what it holds until their next bucket
+void SeriesMarkDestWritten(const char *keyName, size_t len);
+// sets the series the destination key of the rule holds now, NULL when there is none. the open bucket is
+// dropped when it differs from the series the rule wrote to, the bucket belonged to the old destination
+void SeriesRuleSetDest(CompactionRule *rule, Series *destSeries);
+// whether the sample closes the open bucket of the rule or opens a new one, only then the rule needs its
+// destination
+int SeriesRuleNeedsDest(CompactionRule *rule, timestamp_t timestamp);
+// adds a sample of the source series to the rule, the open bucket is written to destSeries when the
+// sample starts a newer one. destSeries is only used, and must be set, when SeriesRuleNeedsDest
+void SeriesRuleAddSample(CompactionRule *rule, Series *destSeries, timestamp_t timestamp, double value);
+// finds the rule whose destination can answer the aggregation of [start, end] in buckets of bucketSize.
+// the destination, returned in *destSeries, covers whole buckets in [*rollupStart, *rollupEnd), the rest
+// has to come from the raw samples. the destinations must be set with SeriesRuleSetDest, returns NULL when
+// no rule fits
+CompactionRule *SeriesFindRollup(Series *series, int aggType, long long bucketSize, long long start,
+                                 long long end, timestamp_t *rollupStart, timestamp_t *rollupEnd,
+                                 Series **destSeries);
 int SeriesCreateRulesFromGlobalConfig(RedisModuleCtx *ctx, RedisModuleString *keyName, Series *series);
+void SeriesSetKeyName(Series *series, const char *keyName, size_t len);
+// takes over the labels and indexes the series under them
+void SeriesSetLabels(Series *series, Label *labels, size_t labelsCount);
 
 // Iterator over the series
 SeriesIterator SeriesQuery(Series *series, api_timestamp_t minTimestamp, api_timestamp_t maxTimestamp);
 int SeriesIteratorGetNext(SeriesIterator *iterator, Sample *currentSample);
+// returns the next consecutive samples of the range as columns, the run is valid until the next call
+int SeriesIteratorGetNextRun(SeriesIterator *iterator, SampleRun *run);
+// returns the current chunk when none of its samples were read yet, it is sealed and the range covers it
+// entirely, so the reader can use its summary and skip it. NULL otherwise
+Chunk *SeriesIteratorPeekWholeChunk(SeriesIterator *iterator);
+// moves the iterator to the next chunk
+void SeriesIteratorSkipChunk(SeriesIterator *iterator);
+
+// iterator over the range from the newest sample, see SeriesReverseIterator
+SeriesReverseIterator SeriesReverseQuery(Series *series, api_timestamp_t minTimestamp,
+                                         api_timestamp_t maxTimestamp);
+int SeriesReverseIteratorGetNext(SeriesReverseIterator *iterator, Sample *currentSample);
+void FreeSeriesReverseIterator(SeriesReverseIterator *iterator);
 
 
-CompactionRule *NewRule(RedisModuleString *destKey, int aggType, int bucketSizeSec);
+// copies the destination key, which may be NULL
+CompactionRule *NewRule(const char *destKey, size_t destKeyLen, int aggType, int bucketSizeSec);
+// unregisters the rule and frees it with its context and destination key
+void FreeRule(CompactionRule *rule);
+int RuleHasDestKey(CompactionRule *rule, RedisModuleString *destKey);
 #endif /* TSDB_H */
\ No newline at end of file
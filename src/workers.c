@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "consts.h"
+#include "workers.h"
+#include "rmutil/alloc.h"
+
+typedef struct WorkerJob {
+    WorkerJobFunc func;
+    void *arg;
+    struct WorkerJob *next;
+} WorkerJob;
+
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static WorkerJob *queueHead = NULL;
+static WorkerJob *queueTail = NULL;
+static int queued = 0;
+static int running = FALSE;
+
+static void *WorkerThreadMain(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queueLock);
+        while (queueHead == NULL) {
+            pthread_cond_wait(&queueCond, &queueLock);
+        }
+        WorkerJob *job = queueHead;
+        queueHead = job->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&queueLock);
+
+        job->func(job->arg);
+        free(job);
+    }
+    return NULL;
+}
+
+int WorkersStart() {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < WORKERS_COUNT; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, WorkerThreadMain, NULL) != 0) {
+            pthread_attr_destroy(&attr);
+            // the threads that did start keep serving the queue
+            return i > 0 ? TSDB_OK : TSDB_ERROR;
+        }
+        running = TRUE;
+    }
+    pthread_attr_destroy(&attr);
+    return TSDB_OK;
+}
+
+int WorkersSubmit(WorkerJobFunc func, void *arg) {
+    pthread_mutex_lock(&queueLock);
+    if (!running || queued >= WORKERS_MAX_QUEUED) {
+        pthread_mutex_unlock(&queueLock);
+        return TSDB_ERROR;
+    }
+    WorkerJob *job = malloc(sizeof(WorkerJob));
+    job->func = func;
+    job->arg = arg;
+    job->next = NULL;
+    if (queueTail == NULL) {
+        queueHead = job;
+    } else {
+        queueTail->next = job;
+    }
+    queueTail = job;
+    queued++;
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueLock);
+    return TSDB_OK;
+}
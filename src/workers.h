@@ -0,0 +1,19 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+/*
+ * A fixed pool of threads for the commands that run in the background, like large range queries.
+ * Jobs are run in the order they were submitted, without the redis lock.
+ */
+
+#define WORKERS_COUNT 4
+// jobs waiting for a thread at most, submitting fails beyond that
+#define WORKERS_MAX_QUEUED 1024
+
+typedef void (*WorkerJobFunc)(void *arg);
+
+int WorkersStart();
+// TSDB_ERROR when the pool isn't running or the queue is full, the caller should run the job itself
+int WorkersSubmit(WorkerJobFunc func, void *arg);
+
+#endif
@@ -2,6 +2,7 @@
 
 import argparse
 import redis
+import struct
 import flask
 import calendar
 import dateutil.parser
@@ -28,7 +29,11 @@ def search():
 def process_targets(targets, redis_client):
     result = []
     for target in targets:
-        if '*' in target:
+        if '=' in target:
+            # label filters separated by commas, e.g. host=web*,dc!=eu
+            filters = target.split(',')
+            result.extend(series[0] for series in redis_client.execute_command('TS.MGET', 'FILTER', *filters))
+        elif '*' in target:
             result.extend(redis_client.keys(target))
         else:
             result.append(target)
@@ -49,9 +54,12 @@ def query():
         args = ['ts.range', target, int(stime), int(etime)]
         if 'intervalMs' in request and request['intervalMs'] > 0 and request['intervalMs']/1000 > 1:
             args += ['avg', int(round(request['intervalMs']/1000))]
+        args += ['FORMAT', 'BINARY']
         print(args)
         redis_resp = redis_client.execute_command(*args)
-        datapoints = [(x2.decode("ascii"), x1*1000) for x1, x2 in redis_resp]
+        # little endian int32 timestamp and double pairs
+        values = struct.unpack('<' + 'id' * (len(redis_resp) // 12), redis_resp)
+        datapoints = [(values[i + 1], values[i] * 1000) for i in range(0, len(values), 2)]
         response.append(dict(target=target, datapoints=datapoints))
     return jsonify(response)
 